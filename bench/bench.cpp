@@ -0,0 +1,334 @@
+#include "VM.h"
+#include <fmt/core.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <unistd.h>
+
+// Runs each script on the stack backend under every dispatch engine and the
+// JIT, and on the register backend, and reports instructions executed and ns
+// per (interpreted) instruction, plus calls made and ns per call for scripts
+// that spend their time calling. Build with tracing and code dumps disabled (see CMakeLists.txt).
+//
+// With --pairs it instead profiles the stack code: it prints the most
+// frequently executed opcode pairs summed over all scripts, which is the
+// data superinstructions are chosen from.
+//
+// With --startup it measures cold start instead: the time from source text to
+// a runnable chunk in a fresh VM, compiling versus loading from a warm
+// bytecode cache, for the given scripts and a large generated one.
+//
+// With --tables it instead times the VM's hash table against the standard
+// containers at 1K, 100K and 10M keys: inserting every key, then looking
+// each one up, and as many absent ones, in random order. Maps are keyed on
+// interned strings as the global slots are, or on the text as the standard
+// map the VM used to keep them in was; sets find by text as interning does.
+
+constexpr const int REPETITIONS = 5;
+constexpr const int TOP_PAIRS = 20;
+constexpr const int STARTUP_STATEMENTS = 20000;
+constexpr const size_t TABLE_SIZES[] = {1000, 100 * 1000, 10 * 1000 * 1000};
+// Small tables are filled and probed again until this many keys have gone by.
+constexpr const size_t TABLE_MIN_OPERATIONS = 10 * 1000 * 1000;
+
+static std::string readSource(const char *path) {
+    std::ifstream file{path, std::ios::binary};
+    if (!file) {
+        fmt::print(stderr, "Could not open file \"{}\".\n", path);
+        exit(74);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+static uint64_t countInstructions(std::string_view source, Backend backend) {
+    VM vm;
+    vm.backend = backend;
+    vm.countInstructions = true;
+    vm.interpret(source);
+    return vm.instructionCount;
+}
+
+// Scripts making fewer calls than this per instruction get no ns per call.
+constexpr const uint64_t INSTRUCTIONS_PER_CALL = 100;
+
+// Stack code only: CALL and TAIL_CALL executions, read off the pair counts.
+static uint64_t countCalls(std::string_view source) {
+    VM vm;
+    vm.countInstructions = true;
+    vm.interpret(source);
+    uint64_t calls = 0;
+    for (int previous = 0; previous < OP_COUNT; ++previous) {
+        calls += vm.pairCounts[previous * OP_COUNT + to_integral(OP::CALL)];
+        calls += vm.pairCounts[previous * OP_COUNT + to_integral(OP::TAIL_CALL)];
+    }
+    return calls;
+}
+
+static void printTopPairs(const std::vector<uint64_t> &pairCounts) {
+    uint64_t total = 0;
+    std::vector<int> order(pairCounts.size());
+    for (int pair = 0; pair < static_cast<int>(pairCounts.size()); ++pair) {
+        order[pair] = pair;
+        total += pairCounts[pair];
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return pairCounts[a] > pairCounts[b]; });
+
+    for (int rank = 0; rank < TOP_PAIRS && pairCounts[order[rank]] > 0; ++rank) {
+        auto pair = order[rank];
+        fmt::print("  {:>6.2f}%  {} -> {}\n", 100.0 * static_cast<double>(pairCounts[pair]) / static_cast<double>(total),
+                   static_cast<OP>(pair / OP_COUNT), static_cast<OP>(pair % OP_COUNT));
+    }
+}
+
+static double bestRunNanos(std::string_view source, Backend backend, Dispatch dispatch, Jit jit = Jit::NONE) {
+    double best = std::numeric_limits<double>::max();
+    for (int rep = 0; rep < REPETITIONS; ++rep) {
+        VM vm;
+        vm.backend = backend;
+        vm.dispatch = dispatch;
+        vm.jit = jit;
+        auto start = std::chrono::steady_clock::now();
+        vm.interpret(source);
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    return best;
+}
+
+// The cache pays off with the amount of source, so --startup also measures
+// a program much larger than the benchmark scripts.
+static std::string generatedSource() {
+    std::string source = "var v0 = 0;\n";
+    for (int i = 1; i < STARTUP_STATEMENTS; ++i) {
+        source += i % 4 == 0
+                ? fmt::format("if (v{} > {}) {{ v{} = v{} - 1; }} else {{ print \"v{}\"; }}\n", i - 1, i, i - 1, i - 1, i)
+                : fmt::format("var v{} = v{} * 2 + {};\n", i, i - 1, i);
+    }
+    return source;
+}
+
+static double bestStartupNanos(std::string_view source, const BytecodeCache *cache) {
+    double best = std::numeric_limits<double>::max();
+    for (int rep = 0; rep < REPETITIONS; ++rep) {
+        VM vm;
+        std::pmr::monotonic_buffer_resource arena;
+        Chunk chunk{&arena};
+        vm.chunk = &chunk;
+        auto start = std::chrono::steady_clock::now();
+        bool ready = cache != nullptr ? cache->load(source, vm, chunk).has_value() : vm.compile(source, chunk);
+        auto end = std::chrono::steady_clock::now();
+        vm.chunk = nullptr;
+        if (!ready) return std::numeric_limits<double>::quiet_NaN();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count());
+    }
+    return best;
+}
+
+static void startup(int count, const char *paths[]) {
+    auto directory = std::filesystem::temp_directory_path() / fmt::format("cpplox_bench_{}", getpid());
+    BytecodeCache cache{directory};
+    std::vector<std::pair<std::string, std::string>> scripts{{"generated", generatedSource()}};
+    for (int i = 0; i < count; ++i) scripts.emplace_back(paths[i], readSource(paths[i]));
+
+    for (auto &[name, source]: scripts) {
+        VM warm;
+        warm.bytecodeCache.emplace(directory);
+        warm.precompile(source);
+        auto compiled = bestStartupNanos(source, nullptr);
+        auto cached = bestStartupNanos(source, &cache);
+        fmt::print("{} ({} bytes)\n  compile {:>10.3f} ms\n  cached  {:>10.3f} ms  {:>6.1f}x\n",
+                   name, source.size(), compiled / 1e6, cached / 1e6, compiled / cached);
+    }
+    std::error_code error;
+    std::filesystem::remove_all(directory, error);
+}
+
+// Interned-looking strings made without a VM, `prefix` followed by 0 to count - 1.
+struct TableKeys {
+    std::vector<ObjString *> strings;
+    std::vector<std::string> texts;
+
+    TableKeys(char prefix, size_t count) {
+        strings.reserve(count);
+        texts.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            auto &text = texts.emplace_back(fmt::format("{}{}", prefix, i));
+            auto length = static_cast<uint32_t>(text.size());
+            auto memory = ::operator new(sizeof(ObjString) + stringPayload(length));
+            auto string = new(memory) ObjString{ObjType::STRING, nullptr, false, false, length, hashString(text)};
+            std::memcpy(string + 1, text.c_str(), length + 1);
+            strings.push_back(string);
+        }
+    }
+
+    TableKeys(const TableKeys &) = delete;
+
+    ~TableKeys() {
+        for (auto string: strings) ::operator delete(string);
+    }
+};
+
+struct CachedHash {
+    size_t operator()(const ObjString *string) const { return string->hash; }
+};
+
+struct TableTimes {
+    double insert;
+    double hit;
+    double miss;
+};
+
+static volatile size_t tableSink;
+
+// Best ns per key over enough rounds. `fill` builds a table, which `probe`
+// is then given with a key index and whether to use the absent keys, and
+// returns something to sum so the lookups cannot be dropped.
+template<typename Table, typename Fill, typename Probe>
+static TableTimes timeTable(size_t count, const std::vector<size_t> &order, Fill fill, Probe probe) {
+    using Clock = std::chrono::steady_clock;
+    auto perKey = [count](Clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / static_cast<double>(count);
+    };
+    TableTimes best{std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+                    std::numeric_limits<double>::max()};
+    size_t sink = 0;
+    for (size_t round = 0; round < std::max<size_t>(1, TABLE_MIN_OPERATIONS / count); ++round) {
+        Table table;
+        auto start = Clock::now();
+        fill(table);
+        best.insert = std::min(best.insert, perKey(start));
+        start = Clock::now();
+        for (auto index: order) sink += probe(table, index, false);
+        best.hit = std::min(best.hit, perKey(start));
+        start = Clock::now();
+        for (auto index: order) sink += probe(table, index, true);
+        best.miss = std::min(best.miss, perKey(start));
+    }
+    tableSink = sink;
+    return best;
+}
+
+static void tables() {
+    for (auto count: TABLE_SIZES) {
+        TableKeys present{'k', count};
+        TableKeys absent{'m', count};
+        std::vector<size_t> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), std::mt19937_64{count});
+        auto keys = [&](bool miss) -> TableKeys & { return miss ? absent : present; };
+
+        fmt::print("{} keys{:>28}{:>12}{:>12}\n", count, "insert", "hit", "miss");
+        auto report = [](const char *name, TableTimes times) {
+            fmt::print("  {:<32} {:>7.2f} ns {:>7.2f} ns {:>7.2f} ns\n", name, times.insert, times.hit, times.miss);
+        };
+
+        report("SwissTable<int>", timeTable<SwissTable<int>>(count, order, [&](auto &table) {
+            for (size_t i = 0; i < count; ++i) table.insertUnique(present.strings[i], static_cast<int>(i));
+        }, [&](auto &table, size_t index, bool miss) {
+            auto entry = table.find(keys(miss).strings[index]);
+            return entry != nullptr ? entry->value : 0;
+        }));
+        report("unordered_map<ObjString*, int>", timeTable<std::unordered_map<ObjString *, int, CachedHash>>(
+                count, order, [&](auto &table) {
+            for (size_t i = 0; i < count; ++i) table.emplace(present.strings[i], static_cast<int>(i));
+        }, [&](auto &table, size_t index, bool miss) {
+            auto found = table.find(keys(miss).strings[index]);
+            return found != table.end() ? found->second : 0;
+        }));
+        report("unordered_map<string, int>", timeTable<std::unordered_map<std::string, int>>(
+                count, order, [&](auto &table) {
+            for (size_t i = 0; i < count; ++i) table.emplace(present.texts[i], static_cast<int>(i));
+        }, [&](auto &table, size_t index, bool miss) {
+            auto found = table.find(keys(miss).texts[index]);
+            return found != table.end() ? found->second : 0;
+        }));
+        report("StringTable (by text)", timeTable<StringTable>(count, order, [&](auto &table) {
+            for (size_t i = 0; i < count; ++i) table.insert(present.strings[i]);
+        }, [&](auto &table, size_t index, bool miss) {
+            auto &text = keys(miss).texts[index];
+            return table.find(text, hashString(text)) != nullptr;
+        }));
+        report("unordered_set<string>", timeTable<std::unordered_set<std::string>>(count, order, [&](auto &table) {
+            for (size_t i = 0; i < count; ++i) table.insert(present.texts[i]);
+        }, [&](auto &table, size_t index, bool miss) {
+            return table.contains(keys(miss).texts[index]);
+        }));
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    if (argc == 2 && std::string_view{argv[1]} == "--tables") {
+        tables();
+        return 0;
+    }
+
+    if (argc < 2) {
+        fmt::print(stderr, "Usage: cpplox_bench [--pairs | --startup] script.lox... | --tables\n");
+        exit(64);
+    }
+
+    if (std::string_view{argv[1]} == "--startup") {
+        startup(argc - 2, argv + 2);
+        return 0;
+    }
+
+    if (std::string_view{argv[1]} == "--pairs") {
+        std::vector<uint64_t> pairCounts(OP_COUNT * OP_COUNT);
+        for (int i = 2; i < argc; ++i) {
+            VM vm;
+            vm.countInstructions = true;
+            vm.interpret(readSource(argv[i]));
+            for (size_t pair = 0; pair < pairCounts.size(); ++pair) pairCounts[pair] += vm.pairCounts[pair];
+        }
+        fmt::print("most frequent opcode pairs:\n");
+        printTopPairs(pairCounts);
+        return 0;
+    }
+
+    constexpr std::pair<Dispatch, const char *> modes[] = {
+            {Dispatch::SWITCH,        "switch"},
+            {Dispatch::COMPUTED_GOTO, "computed_goto"},
+            {Dispatch::TAIL_CALL,     "tail_call"},
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        auto source = readSource(argv[i]);
+        auto instructions = countInstructions(source, Backend::STACK);
+        auto calls = countCalls(source);
+        bool perCall = calls > 0 && calls * INSTRUCTIONS_PER_CALL >= instructions;
+        fmt::print("{}\n  stack: {} instructions", argv[i], instructions);
+        if (perCall) fmt::print(", {} calls", calls);
+        fmt::print("\n");
+        auto report = [&](const char *name, double nanos) {
+            fmt::print("    {:<14} {:>10.3f} ms {:>8.3f} ns/instruction",
+                       name, nanos / 1e6, nanos / static_cast<double>(instructions));
+            if (perCall) fmt::print(" {:>8.3f} ns/call", nanos / static_cast<double>(calls));
+            fmt::print("\n");
+        };
+        for (auto [dispatch, name]: modes) {
+            report(name, bestRunNanos(source, Backend::STACK, dispatch));
+        }
+        for (auto [jit, name]: {std::pair{Jit::BASELINE, "jit"}, std::pair{Jit::TRACE, "trace"}}) {
+            report(name, bestRunNanos(source, Backend::STACK, DEFAULT_DISPATCH, jit));
+        }
+
+        auto registerInstructions = countInstructions(source, Backend::REGISTER);
+        if (registerInstructions == 0) {
+            fmt::print("  register: does not compile\n");
+            continue;
+        }
+        auto nanos = bestRunNanos(source, Backend::REGISTER, DEFAULT_DISPATCH);
+        fmt::print("  register: {} instructions\n", registerInstructions);
+        fmt::print("    {:<14} {:>10.3f} ms {:>8.3f} ns/instruction\n",
+                   "switch", nanos / 1e6, nanos / static_cast<double>(registerInstructions));
+    }
+}
@@ -6,7 +6,7 @@
 void Disassembler::disassembleChunk(const Chunk &chunk, std::string_view name) {
     fmt::print("== {} ==\n", name);
 
-    for (int idx = 0; idx < chunk.code.size();) {
+    for (int idx = 0; idx < static_cast<int>(chunk.bytes().size());) {
         idx = disassembleInstruction(chunk, idx);
     }
 }
@@ -19,15 +19,36 @@ int Disassembler::disassembleInstruction(const Chunk &chunk, int index) {
         fmt::print("{:>4} ", chunk.getLine(index));
     }
 
-    switch (auto instruction = static_cast<OP>(chunk.code[index]); instruction) {
+    switch (auto instruction = static_cast<OP>(chunk.bytes()[index]); instruction) {
         case OP::CONSTANT:
-        case OP::DEFINE_GLOBAL:
-        case OP::GET_GLOBAL:
-        case OP::SET_GLOBAL:
+        case OP::CONSTANT_LONG:
+        case OP::CLASS:
+        case OP::GET_FIELD:
+        case OP::GET_FIELD_MONO:
+        case OP::SET_FIELD:
+        case OP::SET_FIELD_MONO:
             return constantInstruction(chunk, instruction, index);
+        case OP::DEFINE_GLOBAL_SLOT:
+        case OP::GET_GLOBAL_SLOT:
+        case OP::SET_GLOBAL_SLOT:
         case OP::GET_LOCAL:
         case OP::SET_LOCAL:
+        case OP::SET_LOCAL_POP:
+        case OP::POPN:
+        case OP::CALL:
+        case OP::TAIL_CALL:
             return byteInstruction(chunk, instruction, index);
+        case OP::DEFINE_GLOBAL_SLOT_LONG:
+        case OP::GET_GLOBAL_SLOT_LONG:
+        case OP::SET_GLOBAL_SLOT_LONG:
+        case OP::GET_LOCAL_LONG:
+        case OP::SET_LOCAL_LONG:
+        case OP::BUILD_MAP:
+        case OP::FOR_IN:
+            return shortInstruction(chunk, instruction, index);
+        case OP::ADD_TO_LOCAL:
+        case OP::ADD_TO_LOCAL_NUMBER:
+            return localConstantInstruction(chunk, instruction, index);
         case OP::NIL:
         case OP::TRUE:
         case OP::FALSE:
@@ -42,17 +63,31 @@ int Disassembler::disassembleInstruction(const Chunk &chunk, int index) {
         case OP::SUBTRACT:
         case OP::MULTIPLY:
         case OP::DIVIDE:
+        case OP::ADD_NUMBERS:
+        case OP::ADD_TEXT:
+        case OP::EQUAL_NUMBERS:
+        case OP::NOT_EQUAL_NUMBERS:
         case OP::NOT:
         case OP::PRINT:
         case OP::POP:
+        case OP::GET_INDEX:
+        case OP::SET_INDEX:
         case OP::RETURN:
             return simpleInstruction(instruction, index);
         case OP::JUMP:
         case OP::JUMP_IF_TRUE:
         case OP::JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_TRUE:
+        case OP::JUMP_IF_NOT_LESS:
+        case OP::JUMP_IF_NOT_LESS_EQUAL:
+        case OP::JUMP_IF_NOT_GREATER:
+        case OP::JUMP_IF_NOT_GREATER_EQUAL:
             return jumpInstruction(chunk, instruction, 1, index);
         case OP::LOOP:
             return jumpInstruction(chunk, instruction, -1, index);
+        case OP::JUMP_LONG:
+            return longJumpInstruction(chunk, instruction, index);
         default:
             return unknownInstruction(instruction, index);
     }
@@ -69,22 +104,115 @@ int Disassembler::simpleInstruction(OP code, int index) {
 }
 
 int Disassembler::byteInstruction(const Chunk &chunk, OP code, int index) {
-    auto slot = chunk.code[index + 1];
+    auto slot = chunk.bytes()[index + 1];
     fmt::print("{} {}\n", code, slot);
     return index + 2;
 }
 
+int Disassembler::shortInstruction(const Chunk &chunk, OP code, int index) {
+    auto slot = readShort(&chunk.bytes()[index + 1]);
+    fmt::print("{} {}\n", code, slot);
+    return index + 3;
+}
+
 int Disassembler::constantInstruction(const Chunk &chunk, OP op, int index) {
-    auto constant_index = chunk.code[index + 1];
+    // Everything but CONSTANT has a 24-bit index; the field ops' inline caches are not shown.
+    auto constant_index = op == OP::CONSTANT ? chunk.bytes()[index + 1] : readTriple(&chunk.bytes()[index + 1]);
     fmt::print("{} {} ", op, constant_index);
     printValue(chunk.constants[constant_index]);
     fmt::print("\n");
-    return index + 2;
+    return index + instructionLength(op);
+}
+
+int Disassembler::localConstantInstruction(const Chunk &chunk, OP op, int index) {
+    auto slot = chunk.bytes()[index + 1];
+    auto constant_index = chunk.bytes()[index + 2];
+    fmt::print("{} {} {} ", op, slot, constant_index);
+    printValue(chunk.constants[constant_index]);
+    fmt::print("\n");
+    return index + 3;
 }
 
 int Disassembler::jumpInstruction(const Chunk &chunk, OP op, int sign, int index) {
-    uint16_t jump = static_cast<uint16_t>(chunk.code[index + 1] << 8) | chunk.code[index + 2];
+    uint16_t jump = static_cast<uint16_t>(chunk.bytes()[index + 1] << 8) | chunk.bytes()[index + 2];
     fmt::print("{} {} {}\n", op, index, index + 3 + sign * jump);
 
     return index + 3;
 }
+
+int Disassembler::longJumpInstruction(const Chunk &chunk, OP op, int index) {
+    auto jump = readInt(&chunk.bytes()[index + 1]);
+    fmt::print("{} {} {}\n", op, index, index + 5 + jump);
+
+    return index + 5;
+}
+
+void Disassembler::disassembleRegisterChunk(const Chunk &chunk, std::string_view name) {
+    fmt::print("== {} ({} registers) ==\n", name, chunk.registerCount);
+
+    for (int idx = 0; idx < static_cast<int>(chunk.bytes().size());) {
+        idx = disassembleRegisterInstruction(chunk, idx);
+    }
+}
+
+// Register instructions print as destination, then operands; K operands and
+// constant loads also show the constant.
+int Disassembler::disassembleRegisterInstruction(const Chunk &chunk, int index) {
+    fmt::print("{:#04} ", index);
+    if (index > 0 && chunk.getLine(index) == chunk.getLine(index - 1)) {
+        fmt::print("{:>5}", "| ");
+    } else {
+        fmt::print("{:>4} ", chunk.getLine(index));
+    }
+
+    auto instruction = static_cast<ROP>(chunk.bytes()[index]);
+    int a = chunk.bytes()[index + 1];
+    int b = chunk.bytes()[index + 2];
+    int c = chunk.bytes()[index + 3];
+    int bx = (b << 8) | c;
+    int next = index + REGISTER_INSTRUCTION_SIZE;
+
+    switch (instruction) {
+        case ROP::LOADNIL:
+        case ROP::LOADTRUE:
+        case ROP::LOADFALSE:
+        case ROP::PRINT:
+            fmt::print("{} r{}\n", instruction, a);
+            break;
+        case ROP::MOVE:
+        case ROP::NOT:
+        case ROP::NEGATE:
+            fmt::print("{} r{} r{}\n", instruction, a, b);
+            break;
+        case ROP::LOADK:
+            fmt::print("{} r{} k{} ", instruction, a, bx);
+            printValue(chunk.constants[bx]);
+            fmt::print("\n");
+            break;
+        case ROP::DEFINE_GLOBAL:
+        case ROP::GET_GLOBAL:
+        case ROP::SET_GLOBAL:
+            fmt::print("{} r{} g{}\n", instruction, a, bx);
+            break;
+        case ROP::JUMP:
+        case ROP::JUMP_IF_TRUE:
+        case ROP::JUMP_IF_FALSE:
+            fmt::print("{} r{} {} -> {}\n", instruction, a, index,
+                       next + static_cast<int16_t>(bx) * REGISTER_INSTRUCTION_SIZE);
+            break;
+        case ROP::RETURN:
+            fmt::print("{}\n", instruction);
+            break;
+        default:
+            // Binary operators; the K forms sit at odd distances from EQUAL.
+            if ((to_integral(instruction) - to_integral(ROP::EQUAL)) % 2 == 1) {
+                fmt::print("{} r{} r{} k{} ", instruction, a, b, c);
+                printValue(chunk.constants[c]);
+                fmt::print("\n");
+            } else {
+                fmt::print("{} r{} r{} r{}\n", instruction, a, b, c);
+            }
+            break;
+    }
+    return next;
+}
@@ -10,9 +10,15 @@ struct Disassembler {
     static int disassembleInstruction(const Chunk& chunk, int index);
     static int simpleInstruction(OP code, int index);
     static int byteInstruction(const Chunk &chunk, OP code, int index);
+    static int shortInstruction(const Chunk &chunk, OP code, int index);
     static int constantInstruction(const Chunk& chunk, OP op, int index);
     static int unknownInstruction(OP op, int index);
+    static int localConstantInstruction(const Chunk &chunk, OP op, int index);
     static int jumpInstruction(const Chunk &chunk, OP op, int sign, int index);
+    static int longJumpInstruction(const Chunk &chunk, OP op, int index);
+
+    static void disassembleRegisterChunk(const Chunk& chunk, std::string_view name);
+    static int disassembleRegisterInstruction(const Chunk& chunk, int index);
 };
 
 
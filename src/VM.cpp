@@ -3,204 +3,692 @@
 #include "Disassembler.h"
 #include <functional>
 #include "compiler.h"
+#include "regcompiler.h"
+#include "jit.h"
+#include "trace.h"
+#include "verifier.h"
+#include "map.h"
+#include <algorithm>
+#include <cstring>
 //#include <cstdarg>
 
 
-VM::VM() : stackTop{stack.data()} {}
-
+// Everything transient about one compile-and-run (the chunk's code, constant
+// pool and line table) is carved from a monotonic arena that starts in
+// arenaBuffer, so it is released in one go when the run ends.
 InterpretResult VM::interpret(std::string_view source) {
-    auto *a_chunk = new Chunk{};
-    Compiler compiler(source, this);
+    std::pmr::monotonic_buffer_resource arena{arenaBuffer.get(), ARENA_INITIAL_SIZE};
+    Chunk a_chunk{&arena};
 
-    if (!compiler.compile(a_chunk)) {
-        return InterpretResult::COMPILE_ERROR;
+    // The chunk is a GC root while the compiler or the cache fills its constant pool.
+    this->chunk = &a_chunk;
+    // A cached chunk's code lives in the mapping, so it stays open for the run.
+    auto mapped = bytecodeCache ? bytecodeCache->load(source, *this, a_chunk) : std::nullopt;
+    // Nothing runs unverified. A cache entry the verifier rejects is treated
+    // like any other bad entry: compiled again and overwritten.
+    Verification verified;
+    if (mapped && !(verified = verify(a_chunk, backend, globals.size()))) {
+        mapped.reset();
+        a_chunk.clear();
+    }
+    bool compiled = mapped.has_value() || compile(source, a_chunk);
+    if (compiled && !mapped) {
+        verified = verify(a_chunk, backend, globals.size());
+        if (verified && bytecodeCache) bytecodeCache->store(source, *this, a_chunk);
     }
 
-    this->chunk = a_chunk;
-    this->ip = a_chunk->code.data();
+    InterpretResult result = InterpretResult::COMPILE_ERROR;
+    if (compiled && !verified) {
+        fmt::print(stderr, "Invalid bytecode at offset {}: {}.\n", verified.offset, verified.error);
+    } else if (compiled) {
+        stack.commit(verified.maxStack + STACK_SCRATCH);
+        resetStack();
+        std::pmr::vector<uint8_t> code{a_chunk.bytes().begin(), a_chunk.bytes().end(), &arena};
+        frames[0] = {nullptr, code.data(), code.data(), stack.data()};
+        frameCount = 1;
+        enterFrame(frames[0]);
+        if (jit == Jit::TRACE && backend == Backend::STACK) hotLoops.resize(code.size());
+        // An overflow abandons the run where it stands. Nothing on the way
+        // out is destroyed: at worst the baseline JIT's code or a trace
+        // being recorded leaks.
+        if (!stack.guard([&] { result = run(); })) {
+            recordingTrace = false;
+            runtimeError(fmt::runtime("Stack overflow."));
+            result = InterpretResult::RUNTIME_ERROR;
+        }
+        hotLoops.clear();
+    }
 
-    InterpretResult result = run();
+    this->chunk = nullptr;
+    this->code = nullptr;
+    frameCount = 0;
     return result;
 }
 
+InterpretResult VM::precompile(std::string_view source) {
+    std::pmr::monotonic_buffer_resource arena{arenaBuffer.get(), ARENA_INITIAL_SIZE};
+    Chunk a_chunk{&arena};
+
+    this->chunk = &a_chunk;
+    bool compiled = compile(source, a_chunk) && verify(a_chunk, backend, globals.size());
+    if (compiled && bytecodeCache) bytecodeCache->store(source, *this, a_chunk);
+
+    this->chunk = nullptr;
+    return compiled ? InterpretResult::OK : InterpretResult::COMPILE_ERROR;
+}
+
+bool VM::compile(std::string_view source, Chunk &a_chunk) {
+    a_chunk.reserve(source.size());
+    return backend == Backend::REGISTER
+            ? RegisterCompiler(source, this).compile(&a_chunk)
+            : Compiler(source, this).compile(&a_chunk);
+}
+
+void VM::printPeepholeStats() const {
+    fmt::print(stderr, "peephole: removed {} instructions, {} bytes\n",
+               peepholeStats.instructions, peepholeStats.bytes);
+}
+
 InterpretResult VM::run() {
-//#define READ_BYTE() (*ip++)
-//#define READ_CONSTANT() (chunk->constants[READ_BYTE()])
-//#define BINARY_OP(op) \
-//    do { \
-//      Value b = pop(); \
-//      Value a = pop(); \
-//      push(a op b); \
-//    } while (false)
+    if (backend == Backend::REGISTER) {
+        return countInstructions ? runRegisters<true>() : runRegisters<false>();
+    }
+    if (countInstructions) return runSwitch<true>();
+    if (jit == Jit::BASELINE) {
+        if (auto native = JitCode::compile(*this)) return finish(native->run(*this));
+    }
 
+    switch (dispatch) {
+        case Dispatch::COMPUTED_GOTO:
+            return runThreaded();
+        case Dispatch::TAIL_CALL:
+            return runTailCall();
+        case Dispatch::SWITCH:
+        default:
+            return runSwitch<false>();
+    }
+}
 
+template<bool COUNT>
+InterpretResult VM::runSwitch() {
+    if constexpr (COUNT) pairCounts.resize(OP_COUNT * OP_COUNT);
+    uint8_t previous = to_integral(OP::RETURN);
 
-    OP instruction;
     for (;;) {
-        if constexpr (DEBUG_TRACE_EXECUTION) {
-            fmt::print("{:>10}", " ");
-            for (Value *slot = stack.data(); slot < stackTop; ++slot) {
-                fmt::print("[ ");
-                printValue(*slot);
-                fmt::print(" ]");
-            }
-            fmt::print("\n");
-            Disassembler::disassembleInstruction(*chunk, static_cast<int>(ip - chunk->code.data()));
+        if constexpr (DEBUG_TRACE_EXECUTION) traceExecution();
+        if constexpr (COUNT) {
+            ++instructionCount;
+            ++pairCounts[previous * OP_COUNT + *ip];
+            previous = *ip;
         }
-        switch (instruction = static_cast<OP>(read_byte()); instruction) {
-            case OP::CONSTANT:
-                push(read_constant());
+        if (auto step = execute(static_cast<OP>(read_byte())); step != Step::CONTINUE) {
+            return finish(step);
+        }
+    }
+}
+
+InterpretResult VM::runThreaded() {
+#if CPPLOX_HAS_COMPUTED_GOTO
+#define LOX_OPCODE_LABEL_ADDRESS(name) &&op_##name,
+    static void *const labels[] = {LOX_OPCODES(LOX_OPCODE_LABEL_ADDRESS)};
+#undef LOX_OPCODE_LABEL_ADDRESS
+
+#define DISPATCH()                                               \
+    do {                                                         \
+        if constexpr (DEBUG_TRACE_EXECUTION) traceExecution();   \
+        goto *labels[read_byte()];                               \
+    } while (false)
+
+    DISPATCH();
+
+#define LOX_OPCODE_LABEL(name)                                                  \
+    op_##name:                                                                  \
+    if (auto step = execute(OP::name); step != Step::CONTINUE) return finish(step); \
+    DISPATCH();
+
+    LOX_OPCODES(LOX_OPCODE_LABEL)
+
+#undef LOX_OPCODE_LABEL
+#undef DISPATCH
+#else
+    return runSwitch<false>();
+#endif
+}
+
+#define LOX_OPCODE_HANDLER(name) &VM::handle<OP::name>,
+static constexpr VM::Handler handlers[] = {LOX_OPCODES(LOX_OPCODE_HANDLER)};
+#undef LOX_OPCODE_HANDLER
+
+template<OP op>
+InterpretResult VM::handle(VM &vm) {
+    if (auto step = vm.execute(op); step != Step::CONTINUE) return finish(step);
+    if constexpr (DEBUG_TRACE_EXECUTION) vm.traceExecution();
+    CPPLOX_MUSTTAIL return handlers[vm.read_byte()](vm);
+}
+
+InterpretResult VM::runTailCall() {
+#if CPPLOX_HAS_TAIL_CALL
+    if constexpr (DEBUG_TRACE_EXECUTION) traceExecution();
+    return handlers[read_byte()](*this);
+#else
+    return runSwitch<false>();
+#endif
+}
+
+InterpretResult VM::finish(Step step) {
+    return step == Step::RETURN ? InterpretResult::OK : InterpretResult::RUNTIME_ERROR;
+}
+
+void VM::traceExecution() {
+    fmt::print("{:>10}", " ");
+    for (Value *slot = stack.data(); slot < stackTop; ++slot) {
+        fmt::print("[ ");
+        printValue(*slot);
+        fmt::print(" ]");
+    }
+    fmt::print("\n");
+    auto function = frames[frameCount - 1].function;
+    Disassembler::disassembleInstruction(function != nullptr ? *function->chunk : *chunk, static_cast<int>(ip - code));
+}
+
+// The register machine's loop. Registers are the bottom stack slots; stackTop
+// sits just above them, which keeps every register a GC root and leaves the
+// slots above free for the helpers that still work on the stack.
+template<bool COUNT>
+InterpretResult VM::runRegisters() {
+    Value *registers = stack.data();
+    const Value *constants = chunk->constants.data();
+    std::fill_n(registers, chunk->registerCount, nil_val());
+    stackTop = registers + chunk->registerCount;
+
+#define REGISTER_OP(fct, rhs)                                                       \
+    if (register_op(fct, registers[a], registers[b], rhs) != InterpretResult::OK)   \
+        return InterpretResult::RUNTIME_ERROR;                                      \
+    break
+
+    for (;;) {
+        if constexpr (DEBUG_TRACE_EXECUTION) traceRegisters();
+        if constexpr (COUNT) ++instructionCount;
+
+        auto instruction = static_cast<ROP>(ip[0]);
+        uint8_t a = ip[1];
+        uint8_t b = ip[2];
+        uint8_t c = ip[3];
+        uint16_t bx = static_cast<uint16_t>((b << 8) | c);
+        ip += REGISTER_INSTRUCTION_SIZE;
+
+        switch (instruction) {
+            case ROP::MOVE:
+                registers[a] = registers[b];
                 break;
-            case OP::NIL:
-                push(nil_val());
+            case ROP::LOADK:
+                registers[a] = constants[bx];
                 break;
-            case OP::TRUE:
-                push(bool_val(true));
+            case ROP::LOADNIL:
+                registers[a] = nil_val();
                 break;
-            case OP::FALSE:
-                push(bool_val(false));
+            case ROP::LOADTRUE:
+                registers[a] = bool_val(true);
                 break;
-            case OP::NEGATE:
-                if (!isNumber(peek(0))) {
+            case ROP::LOADFALSE:
+                registers[a] = bool_val(false);
+                break;
+            case ROP::NOT:
+                registers[a] = bool_val(isFalsey(registers[b]));
+                break;
+            case ROP::NEGATE:
+                if (!isNumber(registers[b])) {
                     runtimeError(fmt::runtime("Operand must be a number."));
                     return InterpretResult::RUNTIME_ERROR;
                 }
-                push(number_val(-(asNumber(pop()))));
+                registers[a] = number_val(-asNumber(registers[b]));
                 break;
-            case OP::EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(bool_val(valuesEqual(a, b)));
+            case ROP::EQUAL: {
+                bool equal = textEqual(registers[b], registers[c]);
+                registers[a] = bool_val(equal);
                 break;
             }
-            case OP::NOT_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(bool_val(a != b));
+            case ROP::EQUALK: {
+                bool equal = textEqual(registers[b], constants[c]);
+                registers[a] = bool_val(equal);
                 break;
             }
-            case OP::GREATER: {
-                if (binary_op(std::greater<double>{}) == InterpretResult::RUNTIME_ERROR)
-                    return InterpretResult::RUNTIME_ERROR;
+            case ROP::NOT_EQUAL: {
+                bool equal = textEqual(registers[b], registers[c]);
+                registers[a] = bool_val(!equal);
                 break;
             }
-            case OP::GREATER_EQUAL: {
-                if (binary_op(std::greater_equal<double>{}) == InterpretResult::RUNTIME_ERROR)
-                    return InterpretResult::RUNTIME_ERROR;
+            case ROP::NOT_EQUALK: {
+                bool equal = textEqual(registers[b], constants[c]);
+                registers[a] = bool_val(!equal);
                 break;
             }
-            case OP::LESS: {
-                if (binary_op(std::less<double>{}) == InterpretResult::RUNTIME_ERROR)
+            case ROP::GREATER:
+                REGISTER_OP(std::greater<double>{}, registers[c]);
+            case ROP::GREATERK:
+                REGISTER_OP(std::greater<double>{}, constants[c]);
+            case ROP::GREATER_EQUAL:
+                REGISTER_OP(std::greater_equal<double>{}, registers[c]);
+            case ROP::GREATER_EQUALK:
+                REGISTER_OP(std::greater_equal<double>{}, constants[c]);
+            case ROP::LESS:
+                REGISTER_OP(std::less<double>{}, registers[c]);
+            case ROP::LESSK:
+                REGISTER_OP(std::less<double>{}, constants[c]);
+            case ROP::LESS_EQUAL:
+                REGISTER_OP(std::less_equal<double>{}, registers[c]);
+            case ROP::LESS_EQUALK:
+                REGISTER_OP(std::less_equal<double>{}, constants[c]);
+            case ROP::ADD:
+                if (register_add(registers[a], registers[b], registers[c]) != InterpretResult::OK)
                     return InterpretResult::RUNTIME_ERROR;
                 break;
-            }
-            case OP::LESS_EQUAL: {
-                if (binary_op(std::less_equal<double>{}) == InterpretResult::RUNTIME_ERROR)
+            case ROP::ADDK:
+                if (register_add(registers[a], registers[b], constants[c]) != InterpretResult::OK)
                     return InterpretResult::RUNTIME_ERROR;
                 break;
-            }
-            case OP::ADD:
-                if (isString(peek(0)) && isString(peek(1))) {
-                    concatenate();
-                } else if (isNumber(peek(0)) && isNumber(peek(1))) {
-                    double b = asNumber(pop());
-                    double a = asNumber(pop());
-                    push(number_val(a + b));
-                } else {
-                    runtimeError(fmt::runtime("Operands must be two numbers or two strings."));
-                    return InterpretResult::RUNTIME_ERROR;
-                }
+            case ROP::SUBTRACT:
+                REGISTER_OP(std::minus<double>{}, registers[c]);
+            case ROP::SUBTRACTK:
+                REGISTER_OP(std::minus<double>{}, constants[c]);
+            case ROP::MULTIPLY:
+                REGISTER_OP(std::multiplies<double>{}, registers[c]);
+            case ROP::MULTIPLYK:
+                REGISTER_OP(std::multiplies<double>{}, constants[c]);
+            case ROP::DIVIDE:
+                REGISTER_OP(std::divides<double>{}, registers[c]);
+            case ROP::DIVIDEK:
+                REGISTER_OP(std::divides<double>{}, constants[c]);
+            case ROP::PRINT:
+                push(registers[a]);
+                printValue(flattenAt(0));
+                pop();
+                fmt::print("\n");
                 break;
-            case OP::SUBTRACT:
-                if (binary_op(std::minus<double>{}) == InterpretResult::RUNTIME_ERROR)
-                    return InterpretResult::RUNTIME_ERROR;
+            case ROP::DEFINE_GLOBAL:
+                writeGlobal(bx, registers[a]);
                 break;
-            case OP::MULTIPLY:
-                if (binary_op(std::multiplies<double>{}) == InterpretResult::RUNTIME_ERROR)
+            case ROP::GET_GLOBAL: {
+                Value value = globals[bx];
+                if (isUndefined(value)) {
+                    runtimeError(fmt::runtime("Undefined variable '{}'."), globalNames[bx]->str());
                     return InterpretResult::RUNTIME_ERROR;
+                }
+                registers[a] = value;
                 break;
-            case OP::DIVIDE:
-                if (binary_op(std::divides<double>{}) == InterpretResult::RUNTIME_ERROR)
+            }
+            case ROP::SET_GLOBAL:
+                if (isUndefined(globals[bx])) {
+                    runtimeError(fmt::runtime("Undefined variable '{}'."), globalNames[bx]->str());
                     return InterpretResult::RUNTIME_ERROR;
+                }
+                writeGlobal(bx, registers[a]);
                 break;
-            case OP::NOT:
-                push(bool_val(isFalsey(pop())));
+            case ROP::JUMP:
+                ip += static_cast<int16_t>(bx) * REGISTER_INSTRUCTION_SIZE;
                 break;
-            case OP::PRINT:
-                printValue(pop());
-                fmt::print("\n");
+            case ROP::JUMP_IF_TRUE:
+                if (!isFalsey(registers[a])) ip += static_cast<int16_t>(bx) * REGISTER_INSTRUCTION_SIZE;
                 break;
-            case OP::POP:
-                pop();
-                break;
-            case OP::DEFINE_GLOBAL: {
-                ObjString *name = read_string();
-                globals.emplace(name->str, peek(0));
-                pop();
+            case ROP::JUMP_IF_FALSE:
+                if (isFalsey(registers[a])) ip += static_cast<int16_t>(bx) * REGISTER_INSTRUCTION_SIZE;
                 break;
+            case ROP::RETURN:
+                resetStack();
+                return InterpretResult::OK;
+        }
+    }
+
+#undef REGISTER_OP
+}
+
+void VM::traceRegisters() {
+    fmt::print("{:>10}", " ");
+    for (int reg = 0; reg < chunk->registerCount; ++reg) {
+        fmt::print("[ ");
+        printValue(stack[reg]);
+        fmt::print(" ]");
+    }
+    fmt::print("\n");
+    Disassembler::disassembleRegisterInstruction(*chunk, static_cast<int>(ip - code));
+}
+
+// Inline cache entries are not aligned.
+template<typename T>
+static T loadCached(const uint8_t *at) {
+    T value;
+    std::memcpy(&value, at, sizeof(T));
+    return value;
+}
+
+template<typename T>
+static void storeCached(uint8_t *at, T value) {
+    std::memcpy(at, &value, sizeof(T));
+}
+
+Step VM::execute(OP instruction) {
+    switch (instruction) {
+        case OP::CONSTANT:
+            push(read_constant());
+            break;
+        case OP::NIL:
+            push(nil_val());
+            break;
+        case OP::TRUE:
+            push(bool_val(true));
+            break;
+        case OP::FALSE:
+            push(bool_val(false));
+            break;
+        case OP::NEGATE:
+            if (!isNumber(peek(0))) {
+                runtimeError(fmt::runtime("Operand must be a number."));
+                return Step::ERROR;
             }
-            case OP::GET_LOCAL: {
-                auto slot = read_byte();
-                push(stack[slot]);
-                break;
+            push(number_val(-(asNumber(pop()))));
+            break;
+        case OP::EQUAL:
+            equal_op(false);
+            break;
+        case OP::NOT_EQUAL:
+            equal_op(true);
+            break;
+        case OP::GREATER: {
+            if (binary_op(std::greater<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        }
+        case OP::GREATER_EQUAL: {
+            if (binary_op(std::greater_equal<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        }
+        case OP::LESS: {
+            if (binary_op(std::less<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        }
+        case OP::LESS_EQUAL: {
+            if (binary_op(std::less_equal<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        }
+        case OP::ADD:
+            if (add_op() == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::SUBTRACT:
+            if (binary_op(std::minus<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::MULTIPLY:
+            if (binary_op(std::multiplies<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::DIVIDE:
+            if (binary_op(std::divides<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::NOT:
+            push(bool_val(isFalsey(pop())));
+            break;
+        case OP::PRINT:
+            printValue(flattenAt(0));
+            pop();
+            fmt::print("\n");
+            break;
+        case OP::POP:
+            pop();
+            break;
+        case OP::POPN:
+            stackTop -= read_byte();
+            break;
+        case OP::DEFINE_GLOBAL_SLOT: {
+            auto slot = read_byte();
+            writeGlobal(slot, pop());
+            break;
+        }
+        case OP::GET_LOCAL: {
+            auto slot = read_byte();
+            push(slots[slot]);
+            break;
+        }
+        case OP::SET_LOCAL: {
+            auto slot = read_byte();
+            slots[slot] = peek(0);
+            break;
+        }
+        case OP::GET_GLOBAL_SLOT: {
+            auto slot = read_byte();
+            Value value = globals[slot];
+            if (isUndefined(value)) {
+                runtimeError(fmt::runtime("Undefined variable '{}'."), globalNames[slot]->str());
+                return Step::ERROR;
             }
-            case OP::SET_LOCAL: {
-                auto slot = read_byte();
-                stack[slot] = peek(0);
-                break;
+            push(value);
+            break;
+        }
+        case OP::SET_GLOBAL_SLOT: {
+            auto slot = read_byte();
+            if (isUndefined(globals[slot])) {
+                runtimeError(fmt::runtime("Undefined variable '{}'."), globalNames[slot]->str());
+                return Step::ERROR;
             }
-            case OP::GET_GLOBAL: {
-                ObjString *name = read_string();
-                auto it = globals.find(std::string(name->str));
-                if (it != globals.end()) {
-                    Value value = it->second;
-                    push(value);
-                } else {
-                    runtimeError(fmt::runtime("Undefined variable '{}'."), name->str);
-                    return InterpretResult::RUNTIME_ERROR;
-                }
-                break;
+            writeGlobal(slot, peek(0));
+            break;
+        }
+        case OP::JUMP: {
+            auto offset = read_short();
+            ip += offset;
+            break;
+        }
+        case OP::JUMP_IF_TRUE: {
+            auto offset = read_short();
+            if (!isFalsey(peek(0))) ip += offset;
+            break;
+        }
+        case OP::JUMP_IF_FALSE: {
+            auto offset = read_short();
+            if (isFalsey(peek(0))) ip += offset;
+            break;
+        }
+        case OP::LOOP: {
+            auto offset = read_short();
+            ip -= offset;
+            // Traces are recorded for the script's loops only.
+            if (jit == Jit::TRACE && !recordingTrace && frameCount == 1) loopBackEdge();
+            break;
+        }
+        case OP::POP_JUMP_IF_FALSE: {
+            auto offset = read_short();
+            if (isFalsey(pop())) ip += offset;
+            break;
+        }
+        case OP::POP_JUMP_IF_TRUE: {
+            auto offset = read_short();
+            if (!isFalsey(pop())) ip += offset;
+            break;
+        }
+        case OP::JUMP_IF_NOT_LESS:
+            if (branch_op(std::less<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::JUMP_IF_NOT_LESS_EQUAL:
+            if (branch_op(std::less_equal<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::JUMP_IF_NOT_GREATER:
+            if (branch_op(std::greater<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::JUMP_IF_NOT_GREATER_EQUAL:
+            if (branch_op(std::greater_equal<double>{}) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        case OP::SET_LOCAL_POP: {
+            auto slot = read_byte();
+            slots[slot] = pop();
+            break;
+        }
+        case OP::ADD_TO_LOCAL: {
+            auto slot = read_byte();
+            Value constant = read_constant();
+            if (add_to_local(slot, constant) == InterpretResult::RUNTIME_ERROR)
+                return Step::ERROR;
+            break;
+        }
+        // Quickened forms. Each guards on the types it was specialised for and
+        // otherwise runs the generic handler, which requickens the instruction
+        // for whatever types it finds.
+        case OP::ADD_NUMBERS:
+            if (isNumber(peek(0)) && isNumber(peek(1))) {
+                double b = asNumber(pop());
+                double a = asNumber(pop());
+                push(number_val(a + b));
+            } else if (add_op() == InterpretResult::RUNTIME_ERROR) {
+                return Step::ERROR;
             }
-            case OP::SET_GLOBAL: {
-                ObjString* name = read_string();
-                auto it = globals.find(std::string(name->str));
-                if (it != globals.end()) {
-                    it->second = peek(0);
-                } else {
-                    runtimeError(fmt::runtime("Undefined variable '{}'."), name->str);
-                    return InterpretResult::RUNTIME_ERROR;
-                }
-                break;
+            break;
+        case OP::ADD_TEXT:
+            if (isText(peek(0)) && isText(peek(1))) {
+                concatenate();
+            } else if (add_op() == InterpretResult::RUNTIME_ERROR) {
+                return Step::ERROR;
             }
-            case OP::JUMP: {
-                auto offset = read_short();
-                ip += offset;
-                break;
+            break;
+        case OP::EQUAL_NUMBERS:
+            if (isNumber(peek(0)) && isNumber(peek(1))) {
+                double b = asNumber(pop());
+                double a = asNumber(pop());
+                push(bool_val(a == b));
+            } else {
+                equal_op(false);
             }
-            case OP::JUMP_IF_TRUE: {
-                auto offset = read_short();
-                if (!isFalsey(peek(0))) ip += offset;
-                break;
+            break;
+        case OP::NOT_EQUAL_NUMBERS:
+            if (isNumber(peek(0)) && isNumber(peek(1))) {
+                double b = asNumber(pop());
+                double a = asNumber(pop());
+                push(bool_val(a != b));
+            } else {
+                equal_op(true);
             }
-            case OP::JUMP_IF_FALSE: {
-                auto offset = read_short();
-                if (isFalsey(peek(0))) ip += offset;
+            break;
+        case OP::ADD_TO_LOCAL_NUMBER: {
+            auto slot = read_byte();
+            Value constant = read_constant();
+            // Only numeric constants get here, so the local is all there is to check.
+            if (isNumber(slots[slot])) {
+                slots[slot] = number_val(asNumber(slots[slot]) + asNumber(constant));
+            } else if (add_to_local(slot, constant) == InterpretResult::RUNTIME_ERROR) {
+                return Step::ERROR;
+            }
+            break;
+        }
+        case OP::CONSTANT_LONG:
+            push(constants[read_triple()]);
+            break;
+        case OP::DEFINE_GLOBAL_SLOT_LONG:
+            writeGlobal(read_short(), pop());
+            break;
+        case OP::GET_LOCAL_LONG:
+            push(slots[read_short()]);
+            break;
+        case OP::SET_LOCAL_LONG:
+            slots[read_short()] = peek(0);
+            break;
+        case OP::GET_GLOBAL_SLOT_LONG: {
+            auto slot = read_short();
+            Value value = globals[slot];
+            if (isUndefined(value)) {
+                runtimeError(fmt::runtime("Undefined variable '{}'."), globalNames[slot]->str());
+                return Step::ERROR;
+            }
+            push(value);
+            break;
+        }
+        case OP::SET_GLOBAL_SLOT_LONG: {
+            auto slot = read_short();
+            if (isUndefined(globals[slot])) {
+                runtimeError(fmt::runtime("Undefined variable '{}'."), globalNames[slot]->str());
+                return Step::ERROR;
+            }
+            writeGlobal(slot, peek(0));
+            break;
+        }
+        case OP::JUMP_LONG: {
+            auto offset = read_int();
+            ip += offset;
+            break;
+        }
+        case OP::CALL: {
+            auto argc = read_byte();
+            if (!call(peek(argc), argc)) return Step::ERROR;
+            break;
+        }
+        case OP::TAIL_CALL: {
+            auto argc = read_byte();
+            if (!tailCall(peek(argc), argc)) return Step::ERROR;
+            break;
+        }
+        case OP::CLASS: {
+            auto name = asString(constants[read_triple()]);
+            auto klass = allocateObject<ObjClass>(0, ObjType::CLASS, nullptr, false, false, name, uint32_t{0});
+            writeBarrier(klass, name);
+            push(obj_val(klass));
+            break;
+        }
+        // A _MONO site checks its one cached shape here and leaves anything
+        // else to the generic handler, which caches the new shape.
+        case OP::GET_FIELD_MONO: {
+            const uint8_t *cache = ip + 3;
+            if (isInstance(peek(0)) && asInstance(peek(0))->shape == loadCached<uint32_t>(cache)) {
+                stackTop[-1] = fieldAt(asInstance(peek(0)), loadCached<uint16_t>(cache + 4));
+                ip += instructionLength(OP::GET_FIELD) - 1;
                 break;
             }
-            case OP::LOOP: {
-                auto offset = read_short();
-                ip -= offset;
+            [[fallthrough]];
+        }
+        case OP::GET_FIELD:
+            if (!getField()) return Step::ERROR;
+            break;
+        case OP::SET_FIELD_MONO: {
+            const uint8_t *cache = ip + 3;
+            if (isInstance(peek(1)) && asInstance(peek(1))->shape == loadCached<uint32_t>(cache)) {
+                ip += instructionLength(OP::SET_FIELD) - 1;
+                storeField(loadCached<uint32_t>(cache + 4), loadCached<uint16_t>(cache + 8));
                 break;
             }
-            case OP::RETURN:
-                return InterpretResult::OK;
-
+            [[fallthrough]];
         }
+        case OP::SET_FIELD:
+            if (!setField()) return Step::ERROR;
+            break;
+        case OP::BUILD_MAP:
+            if (!buildMap(read_short())) return Step::ERROR;
+            break;
+        case OP::GET_INDEX:
+            if (!getIndex()) return Step::ERROR;
+            break;
+        case OP::SET_INDEX:
+            if (!setIndex()) return Step::ERROR;
+            break;
+        case OP::FOR_IN:
+            if (!forIn(read_short())) return Step::ERROR;
+            break;
+        case OP::RETURN:
+            if (frameCount == 1) return Step::RETURN;
+            leaveFrame();
+            break;
     }
+    return Step::CONTINUE;
+}
 
-//#undef READ_BYTE
-//#undef READ_CONSTANT
-//#undef BINARY_OP
+// Runs the single instruction at `instruction`, for callers outside the
+// dispatch loops such as JIT code.
+Step VM::executeAt(uint8_t *instruction) {
+    ip = instruction;
+    return execute(static_cast<OP>(read_byte()));
 }
 
 uint8_t VM::read_byte() {
@@ -209,11 +697,21 @@ uint8_t VM::read_byte() {
 
 uint16_t VM::read_short() {
     ip += 2;
-    return static_cast<uint16_t>((ip[-2] << 8) | ip[-1]);
+    return readShort(ip - 2);
+}
+
+uint32_t VM::read_triple() {
+    ip += 3;
+    return readTriple(ip - 3);
+}
+
+int32_t VM::read_int() {
+    ip += 4;
+    return readInt(ip - 4);
 }
 
 Value VM::read_constant() {
-    return chunk->constants[read_byte()];
+    return constants[read_byte()];
 }
 
 ObjString *VM::read_string() {
@@ -228,6 +726,10 @@ Value VM::pop() {
     return *(--stackTop);
 }
 
+void VM::popN(int count) {
+    stackTop -= count;
+}
+
 Value VM::peek(int distance) const {
     return stackTop[-1 - distance];
 }
@@ -237,10 +739,23 @@ void VM::runtimeError(fmt::basic_runtime<char> format, Args &&... args) {
     fmt::print(stderr, format, args...);
     fmt::print(stderr, "\n");
 
-    size_t instruction = ip - chunk->code.data() - 1;
-//    int line = chunk->lines[instruction].line_no;
-    int line = chunk->getLine(instruction);
-    fmt::print(stderr, "[line {}] in script\n", line);
+    // Innermost first. A deep recursion shows its two ends.
+    frames[frameCount - 1].ip = ip;
+    for (int i = frameCount - 1; i >= 0; --i) {
+        if (i == frameCount - 1 - TRACE_FRAMES && i > TRACE_FRAMES) {
+            fmt::print(stderr, "... {} more frames\n", i - TRACE_FRAMES + 1);
+            i = TRACE_FRAMES;
+            continue;
+        }
+        auto &frame = frames[i];
+        size_t instruction = frame.ip - frame.code - 1;
+        if (frame.function == nullptr) {
+            fmt::print(stderr, "[line {}] in script\n", chunk->getLine(instruction));
+        } else {
+            fmt::print(stderr, "[line {}] in {}()\n", frame.function->chunk->getLine(instruction),
+                       frame.function->name->str());
+        }
+    }
     resetStack();
 }
 
@@ -248,17 +763,494 @@ void VM::resetStack() {
     stackTop = stack.data();
 }
 
+// Loads a frame into the VM's registers.
+void VM::enterFrame(const CallFrame &frame) {
+    code = frame.code;
+    ip = frame.ip;
+    slots = frame.slots;
+    constants = (frame.function != nullptr ? frame.function->chunk : chunk)->constants.data();
+}
+
+// Returns the value on top of the stack from the running function to its caller.
+void VM::leaveFrame() {
+    Value result = pop();
+    stackTop = slots;
+    --frameCount;
+    enterFrame(frames[frameCount - 1]);
+    push(result);
+}
+
+bool VM::checkCall(Value callee, int argc) {
+    int arity;
+    if (isFunction(callee)) {
+        arity = asFunction(callee)->arity;
+    } else if (isClass(callee)) {
+        arity = 0;
+    } else if (isNative(callee)) {
+        arity = asNative(callee)->arity;
+    } else {
+        runtimeError(fmt::runtime("Can only call functions and classes."));
+        return false;
+    }
+    if (argc != arity) {
+        runtimeError(fmt::runtime("Expected {} arguments but got {}."), arity, argc);
+        return false;
+    }
+    return true;
+}
+
+// The arguments stay where the caller pushed them: with the callee below
+// them, they are the bottom slots of the new frame. Nothing is allocated.
+bool VM::call(Value callee, int argc) {
+    if (!checkCall(callee, argc)) return false;
+    if (isClass(callee)) {
+        instantiate();
+        return true;
+    }
+    if (isNative(callee)) return asNative(callee)->function(*this, argc);
+    if (frameCount == FRAMES_MAX) {
+        runtimeError(fmt::runtime("Stack overflow."));
+        return false;
+    }
+
+    frames[frameCount - 1].ip = ip;
+    auto function = asFunction(callee);
+    auto &frame = frames[frameCount++];
+    frame = {function, function->chunk->code.data(), function->chunk->code.data(), stackTop - argc - 1};
+    enterFrame(frame);
+    return true;
+}
+
+// `return f(...);` in a function: the callee and its arguments move down
+// over the current frame's slots and the frame is reused, so a tail call
+// takes no frame and no stack.
+bool VM::tailCall(Value callee, int argc) {
+    if (!checkCall(callee, argc)) return false;
+    if (isClass(callee)) {
+        instantiate();
+        leaveFrame();
+        return true;
+    }
+    if (isNative(callee)) {
+        if (!asNative(callee)->function(*this, argc)) return false;
+        leaveFrame();
+        return true;
+    }
+
+    auto function = asFunction(callee);
+    stackTop = std::copy(stackTop - argc - 1, stackTop, slots);
+    auto &frame = frames[frameCount - 1];
+    frame = {function, function->chunk->code.data(), function->chunk->code.data(), slots};
+    enterFrame(frame);
+    return true;
+}
+
+// Replaces the class on top of the stack, which takes no arguments, with a
+// new instance of it. Instances are usually temporaries and start young.
+void VM::instantiate() {
+    auto klass = asClass(peek(0));
+    auto capacity = klass->fieldCapacity;
+    auto instance = allocateYoung<ObjInstance>(capacity * sizeof(Value), ObjType::INSTANCE, nullptr, false, false,
+                                               klass, EMPTY_SHAPE, capacity, nullptr);
+    stackTop[-1] = obj_val(instance);
+}
+
+// Generic GET_FIELD, entered with ip just past the opcode. It looks through
+// the cache, then in the shape, and caches where a field it had to look up
+// was found. A site that has filled its cache is megamorphic: new shapes
+// keep being looked up.
+bool VM::getField() {
+    uint8_t *instruction = ip - 1;
+    auto name = asString(constants[read_triple()]);
+    uint8_t *cache = ip;
+    ip = instruction + instructionLength(OP::GET_FIELD);
+    if (!isInstance(peek(0))) {
+        runtimeError(fmt::runtime("Only instances have properties."));
+        return false;
+    }
+    auto instance = asInstance(peek(0));
+
+    int entry = 0;
+    for (; entry < FIELD_CACHE_ENTRIES; ++entry, cache += GET_CACHE_ENTRY_SIZE) {
+        auto shape = loadCached<uint32_t>(cache);
+        if (shape == NO_SHAPE) break;
+        if (shape == instance->shape) {
+            stackTop[-1] = fieldAt(instance, loadCached<uint16_t>(cache + 4));
+            return true;
+        }
+    }
+
+    int index = shapes.find(instance->shape, name);
+    if (index < 0) {
+        runtimeError(fmt::runtime("Undefined property '{}'."), name->str());
+        return false;
+    }
+    if (entry < FIELD_CACHE_ENTRIES) {
+        storeCached(cache, instance->shape);
+        storeCached(cache + 4, static_cast<uint16_t>(index));
+        *instruction = to_integral(entry == 0 ? OP::GET_FIELD_MONO : OP::GET_FIELD);
+    }
+    stackTop[-1] = fieldAt(instance, index);
+    return true;
+}
+
+// Generic SET_FIELD, as getField. Storing a field the instance lacks adds it
+// and moves the instance to the next shape; that transition is cached like
+// any other store.
+bool VM::setField() {
+    uint8_t *instruction = ip - 1;
+    auto name = asString(constants[read_triple()]);
+    uint8_t *cache = ip;
+    ip = instruction + instructionLength(OP::SET_FIELD);
+    if (!isInstance(peek(1))) {
+        runtimeError(fmt::runtime("Only instances have fields."));
+        return false;
+    }
+    uint32_t shape = asInstance(peek(1))->shape;
+
+    int entry = 0;
+    for (; entry < FIELD_CACHE_ENTRIES; ++entry, cache += SET_CACHE_ENTRY_SIZE) {
+        auto cached = loadCached<uint32_t>(cache);
+        if (cached == NO_SHAPE) break;
+        if (cached == shape) {
+            storeField(loadCached<uint32_t>(cache + 4), loadCached<uint16_t>(cache + 8));
+            return true;
+        }
+    }
+
+    uint32_t next = shape;
+    int index = shapes.find(shape, name);
+    if (index < 0) {
+        if (shapes[shape].fieldCount == MAX_FIELDS) {
+            runtimeError(fmt::runtime("Too many fields."));
+            return false;
+        }
+        next = shapes.transition(shape, name);
+        index = static_cast<int>(shapes[shape].fieldCount);
+    }
+    if (entry < FIELD_CACHE_ENTRIES) {
+        storeCached(cache, shape);
+        storeCached(cache + 4, next);
+        storeCached(cache + 8, static_cast<uint16_t>(index));
+        *instruction = to_integral(entry == 0 ? OP::SET_FIELD_MONO : OP::SET_FIELD);
+    }
+    storeField(next, index);
+    return true;
+}
+
+// Stores the value on top of the stack in field `index` of the instance
+// below it, which then has shape `shape`, and leaves the value in place of
+// both.
+void VM::storeField(uint32_t shape, uint32_t index) {
+    if (index >= asInstance(peek(1))->capacity) growOverflow(index);
+    auto instance = asInstance(peek(1));
+    Value value = peek(0);
+    fieldAt(instance, index) = value;
+    if (isObj(value)) {
+        writeBarrier(index < instance->capacity ? static_cast<Obj *>(instance) : instance->overflow, asObject(value));
+    }
+    if (shape != instance->shape) {
+        instance->shape = shape;
+        auto &fieldCapacity = instance->klass->fieldCapacity;
+        fieldCapacity = std::max(fieldCapacity, index + 1);
+    }
+    stackTop[-2] = value;
+    --stackTop;
+}
+
+// Makes sure the overflow array of the instance below the top of the stack
+// has room for field `index`, doubling it when it has not.
+void VM::growOverflow(uint32_t index) {
+    auto instance = asInstance(peek(1));
+    uint32_t needed = index - instance->capacity + 1;
+    uint32_t old = instance->overflow != nullptr ? instance->overflow->capacity : 0;
+    if (needed <= old) return;
+
+    uint32_t capacity = std::max({needed, old * 2, OVERFLOW_INITIAL_FIELDS});
+    auto fields = allocateYoung<ObjFields>(capacity * sizeof(Value), ObjType::FIELDS, nullptr, false, false, capacity);
+    std::fill_n(overflowFields(fields), capacity, nil_val());
+
+    instance = asInstance(peek(1)); // the collector may have moved it
+    for (uint32_t i = 0; i < old; ++i) {
+        Value value = overflowFields(instance->overflow)[i];
+        overflowFields(fields)[i] = value;
+        if (isObj(value)) writeBarrier(fields, asObject(value));
+    }
+    instance->overflow = fields;
+    writeBarrier(instance, fields);
+}
+
+// Replaces the value `distance` slots down the stack by the map key it
+// stands for, or reports that it cannot be one.
+bool VM::checkMapKey(int distance) {
+    Value key = flattenAt(distance);
+    if (!isMapKey(key)) {
+        runtimeError(fmt::runtime("Map keys must be numbers other than NaN, strings, booleans or nil."));
+        return false;
+    }
+    stackTop[-1 - distance] = canonicalKey(key);
+    return true;
+}
+
+// Replaces the `count` key/value pairs on top of the stack by a map of them.
+// A key given twice keeps its last value.
+bool VM::buildMap(int count) {
+    for (int distance = 2 * count - 1; distance > 0; distance -= 2) {
+        if (!checkMapKey(distance)) return false;
+    }
+
+    auto map = allocateYoung<ObjMap>(0, ObjType::MAP, nullptr, false, false, uint32_t{0}, uint32_t{0}, nullptr);
+    push(obj_val(map));
+    if (count > 0) resizeMap(0, mapCapacity(count));
+
+    map = asMap(peek(0)); // the collector may have moved it
+    Value *pairs = stackTop - 1 - 2 * count;
+    for (int i = 0; i < count; ++i) mapStore(map, pairs[2 * i], pairs[2 * i + 1]);
+    pairs[0] = obj_val(map);
+    stackTop = pairs + 1;
+    return true;
+}
+
+// GET_INDEX. A key the map lacks reads as nil. Only a rope key allocates,
+// when it is flattened.
+bool VM::getIndex() {
+    if (!isMap(peek(1))) {
+        runtimeError(fmt::runtime("Only maps can be indexed."));
+        return false;
+    }
+    if (!checkMapKey(0)) return false;
+
+    Value *value = findValue(asMap(peek(1)), peek(0));
+    stackTop[-2] = value != nullptr ? *value : nil_val();
+    --stackTop;
+    return true;
+}
+
+// SET_INDEX leaves the value in place of the map, key and value. A new key
+// that would take the map past its load factor doubles its capacity first.
+bool VM::setIndex() {
+    if (!isMap(peek(2))) {
+        runtimeError(fmt::runtime("Only maps can be indexed."));
+        return false;
+    }
+    if (!checkMapKey(1)) return false;
+
+    auto map = asMap(peek(2));
+    if (Value *value = findValue(map, peek(1))) {
+        *value = peek(0);
+        if (isObj(*value)) writeBarrier(map->entries, asObject(*value));
+    } else {
+        if (mapIsFull(map)) {
+            if (map->capacity == MAP_MAX_CAPACITY) {
+                runtimeError(fmt::runtime("Too many entries in map."));
+                return false;
+            }
+            resizeMap(2, std::max(MAP_MIN_CAPACITY, map->capacity * 2));
+        }
+        mapStore(asMap(peek(2)), peek(1), peek(0));
+    }
+    stackTop[-3] = peek(0);
+    stackTop -= 2;
+    return true;
+}
+
+// Stores `value` under `key` in a map with room for one more key.
+void VM::mapStore(ObjMap *map, Value key, Value value) {
+    Value *entry = findEntry(map, key);
+    if (isUndefined(entry[0])) {
+        entry[0] = key;
+        if (isObj(key)) writeBarrier(map->entries, asObject(key));
+        ++map->count;
+    }
+    entry[1] = value;
+    if (isObj(value)) writeBarrier(map->entries, asObject(value));
+}
+
+// Gives the map `distance` slots down the stack a new entries array of
+// `capacity` slots, and moves its entries there.
+void VM::resizeMap(int distance, uint32_t capacity) {
+    auto entries = allocateYoung<ObjFields>(2 * capacity * sizeof(Value), ObjType::FIELDS, nullptr, false, false,
+                                            2 * capacity);
+    std::fill_n(overflowFields(entries), 2 * capacity, undefined_val());
+
+    auto map = asMap(peek(distance)); // the collector may have moved it
+    auto old = map->entries;
+    auto oldCapacity = map->capacity;
+    map->entries = entries;
+    map->capacity = capacity;
+    map->count = 0;
+    writeBarrier(map, entries);
+    for (uint32_t i = 0; i < oldCapacity; ++i) {
+        Value *entry = &overflowFields(old)[2 * i];
+        if (!isUndefined(entry[0])) mapStore(map, entry[0], entry[1]);
+    }
+}
+
+// Moves a for-in loop's cursor to the next key of its map, stores the key in
+// the loop variable and pushes true, or pushes false when there are no more.
+// Keys come in slot order; storing new keys during the loop can make it skip
+// some or see some twice.
+bool VM::forIn(int slot) {
+    if (!isMap(slots[slot])) {
+        runtimeError(fmt::runtime("Can only iterate over maps."));
+        return false;
+    }
+    auto map = asMap(slots[slot]);
+    for (auto index = static_cast<uint32_t>(asNumber(slots[slot + 1])); index < map->capacity; ++index) {
+        Value key = mapEntries(map)[2 * index];
+        if (isUndefined(key)) continue;
+        slots[slot + 1] = number_val(index + 1);
+        slots[slot + 2] = key;
+        push(bool_val(true));
+        return true;
+    }
+    push(bool_val(false));
+    return true;
+}
+
+int VM::resolveGlobal(std::string_view name) {
+    auto key = copyString(name);
+    auto [entry, inserted] = globalSlots.insert(key, static_cast<int>(globals.size()));
+    if (inserted) {
+        globals.push_back(undefined_val());
+        globalNames.push_back(key);
+        globalRemembered.push_back(0);
+    }
+    return entry->value;
+}
+
+// The slot of an existing global, or -1. Never allocates.
+int VM::findGlobal(std::string_view name) const {
+    auto hash = hashString(name);
+    auto key = strings.find(name, hash);
+    if (key == nullptr) key = youngStrings.find(name, hash);
+    if (key == nullptr) return -1;
+    auto entry = globalSlots.findIf(hash, [key](const ObjString *candidate) { return candidate == key; });
+    return entry != nullptr ? entry->value : -1;
+}
+
+// Both operands stay on the stack until the result exists: allocating may
+// run a collection, which can move young operands.
 void VM::concatenate() {
-    ObjString* b = asString(pop());
-    ObjString* a = asString(pop());
-    auto aStr = std::string(a->str);
-    auto bStr = std::string(b->str);
-    auto [it, res] = strings.emplace(aStr + bStr);
-    auto view = std::string_view{*it};
-    auto obj = new ObjString{ObjType::STRING, objects, view};
-    objects = obj;
+    size_t length = textLength(asObject(peek(1))) + textLength(asObject(peek(0)));
+
+    Obj* result;
+    if (length < ROPE_MIN_LENGTH) {
+        std::string chars;
+        chars.reserve(length);
+        appendText(chars, asObject(peek(1)));
+        appendText(chars, asObject(peek(0)));
+        result = runtimeString(chars);
+    } else {
+        auto rope = allocateYoung<ObjRope>(0, ObjType::ROPE, nullptr, false, false,
+                                           nullptr, nullptr, nullptr, length);
+        rope->left = asObject(peek(1));
+        writeBarrier(rope, rope->left);
+        rope->right = asObject(peek(0));
+        writeBarrier(rope, rope->right);
+        result = rope;
+    }
+
+    popN(2);
+    push(obj_val(result));
+}
+
+// Replaces a rope on the stack by its interned string, assembling the text
+// the first time the rope is flattened.
+Value VM::flattenAt(int distance) {
+    Value value = peek(distance);
+    if (!isRope(value)) return value;
+
+    ObjString* flat = asRope(value)->flat;
+    if (flat == nullptr) {
+        std::string chars;
+        chars.reserve(asRope(value)->length);
+        appendText(chars, asRope(value));
+        flat = runtimeString(chars);
+
+        auto rope = asRope(peek(distance)); // the collector may have moved it
+        rope->flat = flat;
+        writeBarrier(rope, flat);
+        rope->left = nullptr;
+        rope->right = nullptr;
+    }
 
-    push(createValue(static_cast<Obj*>(obj)));
+    stackTop[-1 - distance] = obj_val(flat);
+    return obj_val(flat);
+}
+
+// Literals and identifiers from the compiler live as long as their chunk,
+// so they skip the nursery and go straight to the old generation.
+ObjString *VM::copyString(std::string_view chars) {
+    auto hash = hashString(chars);
+    if (auto interned = strings.find(chars, hash)) return interned;
+    if (auto interned = youngStrings.find(chars, hash)) return interned;
+
+    return allocateString(chars, hash, false);
+}
+
+// Strings built at runtime are usually temporaries and start in the nursery.
+ObjString *VM::runtimeString(std::string_view chars) {
+    auto hash = hashString(chars);
+    if (auto interned = strings.find(chars, hash)) return interned;
+    if (auto interned = youngStrings.find(chars, hash)) return interned;
+
+    return allocateString(chars, hash, true);
+}
+
+ObjString *VM::allocateString(std::string_view chars, uint32_t hash, bool young) {
+    auto length = static_cast<uint32_t>(chars.size());
+    auto payload = stringPayload(length);
+    auto obj = young
+            ? allocateYoung<ObjString>(payload, ObjType::STRING, nullptr, false, false, length, hash)
+            : allocateObject<ObjString>(payload, ObjType::STRING, nullptr, false, false, length, hash);
+
+    auto storage = reinterpret_cast<char *>(obj + 1);
+    std::memcpy(storage, chars.data(), length);
+    storage[length] = '\0';
+
+    if (nursery.contains(obj)) {
+        youngStrings.insert(obj);
+    } else {
+        strings.insert(obj); // pretenured, or too large for the nursery
+    }
+    return obj;
+}
+
+// Functions come from the compiler and, like literals, skip the nursery.
+// The name is set by the caller once the function is reachable.
+ObjFunction *VM::newFunction() {
+    return allocateObject<ObjFunction>(0, ObjType::FUNCTION, nullptr, false, false, 0, nullptr, new Chunk{});
+}
+
+// len(value): the number of keys in a map, or of characters in a string.
+static bool lenNative(VM &vm, int argc) {
+    Value value = vm.peek(0);
+    double length;
+    if (isMap(value)) {
+        length = asMap(value)->count;
+    } else if (isText(value)) {
+        length = static_cast<double>(textLength(asObject(value)));
+    } else {
+        vm.runtimeError(fmt::runtime("Can only take the length of a map or a string."));
+        return false;
+    }
+    vm.popN(argc + 1);
+    vm.push(number_val(length));
+    return true;
+}
+
+VM::VM() : stackTop{stack.data()} {
+    defineNative("len", 1, lenNative);
+}
+
+// Natives are globals defined before any script runs, so every VM has them
+// in the same slots.
+void VM::defineNative(std::string_view name, int arity, NativeFn function) {
+    int slot = resolveGlobal(name);
+    auto native = allocateObject<ObjNative>(0, ObjType::NATIVE, nullptr, false, false, function, arity,
+                                            globalNames[slot]);
+    writeGlobal(slot, obj_val(native));
 }
 
 VM::~VM() {
@@ -266,11 +1258,13 @@ VM::~VM() {
 }
 
 void VM::deleteObjects() const {
-    Obj* object = objects;
-    while (object != nullptr) {
-        auto next = object->next;
-        delete object;
-        object = next;
+    for (Obj* list: {objects, sweepList}) {
+        Obj* object = list;
+        while (object != nullptr) {
+            auto next = object->next;
+            freeObject(object);
+            object = next;
+        }
     }
 }
 
@@ -287,3 +1281,112 @@ constexpr auto VM::binary_op(BINARY fct) -> InterpretResult {
 }
 
 
+
+// Compare-and-branch: pops both operands and jumps unless the comparison holds.
+template<typename COMPARE>
+auto VM::branch_op(COMPARE fct) -> InterpretResult {
+    auto offset = read_short();
+    if (!isNumber(peek(0)) || !isNumber(peek(1))) {
+        runtimeError(fmt::runtime("Operands must be numbers."));
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    double b = asNumber(pop());
+    double a = asNumber(pop());
+    if (!fct(a, b)) ip += offset;
+    return InterpretResult::OK;
+}
+
+// Rewrites the opcode of the instruction just read, `size` bytes long, in the
+// per-run copy of the code.
+void VM::quicken(int size, OP op) {
+    ip[-size] = to_integral(op);
+}
+
+// Generic ADD. It also quickens the instruction for the operand types it saw,
+// so a type-stable site pays for the checks only once.
+auto VM::add_op() -> InterpretResult {
+    if (isNumber(peek(0)) && isNumber(peek(1))) {
+        quicken(1, OP::ADD_NUMBERS);
+        double b = asNumber(pop());
+        double a = asNumber(pop());
+        push(number_val(a + b));
+    } else if (isText(peek(0)) && isText(peek(1))) {
+        quicken(1, OP::ADD_TEXT);
+        concatenate();
+    } else {
+        runtimeError(fmt::runtime("Operands must be two numbers or two strings."));
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    return InterpretResult::OK;
+}
+
+// Generic EQUAL and NOT_EQUAL. Only numbers are worth a quickened form: any
+// other operand may be a rope that has to be flattened before comparing.
+void VM::equal_op(bool negate) {
+    if (isNumber(peek(0)) && isNumber(peek(1))) {
+        quicken(1, negate ? OP::NOT_EQUAL_NUMBERS : OP::EQUAL_NUMBERS);
+    }
+    // Flattening the second operand may collect and move the first, so both
+    // are read back from the stack afterwards.
+    flattenAt(0);
+    flattenAt(1);
+    bool equal = valuesEqual(peek(1), peek(0));
+    popN(2);
+    push(bool_val(equal != negate));
+}
+
+auto VM::add_to_local(uint8_t slot, Value constant) -> InterpretResult {
+    if (isNumber(slots[slot]) && isNumber(constant)) {
+        quicken(3, OP::ADD_TO_LOCAL_NUMBER);
+        slots[slot] = number_val(asNumber(slots[slot]) + asNumber(constant));
+    } else if (isText(slots[slot]) && isText(constant)) {
+        push(slots[slot]);
+        push(constant);
+        concatenate();
+        slots[slot] = pop();
+    } else {
+        runtimeError(fmt::runtime("Operands must be two numbers or two strings."));
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    return InterpretResult::OK;
+}
+
+template<typename BINARY>
+auto VM::register_op(BINARY fct, Value &result, Value a, Value b) -> InterpretResult {
+    if (!isNumber(a) || !isNumber(b)) {
+        runtimeError(fmt::runtime("Operands must be numbers."));
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    result = createValue(fct(asNumber(a), asNumber(b)));
+    return InterpretResult::OK;
+}
+
+// String operands go through concatenate on the stack, where the collector
+// can see and move them while the result is allocated.
+auto VM::register_add(Value &result, Value a, Value b) -> InterpretResult {
+    if (isNumber(a) && isNumber(b)) {
+        result = number_val(asNumber(a) + asNumber(b));
+    } else if (isText(a) && isText(b)) {
+        push(a);
+        push(b);
+        concatenate();
+        result = pop();
+    } else {
+        runtimeError(fmt::runtime("Operands must be two numbers or two strings."));
+        return InterpretResult::RUNTIME_ERROR;
+    }
+    return InterpretResult::OK;
+}
+
+// valuesEqual for operands that may be ropes, which compare by content.
+bool VM::textEqual(Value a, Value b) {
+    if (!isRope(a) && !isRope(b)) return valuesEqual(a, b);
+
+    push(a);
+    push(b);
+    flattenAt(0);
+    flattenAt(1);
+    bool equal = valuesEqual(peek(1), peek(0));
+    popN(2);
+    return equal;
+}
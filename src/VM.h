@@ -3,11 +3,37 @@
 
 #include <memory>
 #include "chunk.h"
+#include "common.h"
 #include <array>
-#include <unordered_set>
-#include <unordered_map>
+#include "table.h"
+#include "nursery.h"
+#include "histogram.h"
+#include "peephole.h"
+#include "cache.h"
+#include "valuestack.h"
+#include "shape.h"
 
-constexpr const auto STACK_MAX = 256;
+// Address space reserved for the value stack, in slots. Only what is used is mapped.
+constexpr const size_t STACK_MAX_SLOTS = 16 * 1024 * 1024;
+// Call depth, the script's frame included.
+constexpr const int FRAMES_MAX = 64 * 1024;
+// A runtime error's stack trace shows this many frames at either end.
+constexpr const int TRACE_FRAMES = 10;
+// Slots above the verified maximum for helpers that push their operands
+// while they allocate (add_to_local, register_add, textEqual, buildMap).
+constexpr const int STACK_SCRATCH = 2;
+constexpr const size_t GC_INITIAL_THRESHOLD = 1024 * 1024;
+constexpr const double GC_HEAP_GROW_FACTOR = 2.0;
+constexpr const size_t NURSERY_SIZE = 256 * 1024;
+constexpr const size_t GC_SLICE_BYTES = 64 * 1024;
+constexpr const uint64_t GC_PAUSE_TARGET_NANOS = 500 * 1000;
+// Concatenations shorter than this are copied eagerly; longer ones become ropes.
+constexpr const size_t ROPE_MIN_LENGTH = 64;
+constexpr const size_t ARENA_INITIAL_SIZE = 64 * 1024;
+// Fields an instance's first overflow array has room for.
+constexpr const uint32_t OVERFLOW_INITIAL_FIELDS = 4;
+
+struct HotLoop;
 
 enum class InterpretResult {
     OK,
@@ -15,30 +41,183 @@ enum class InterpretResult {
     RUNTIME_ERROR
 };
 
+// Where the incremental collector is in its cycle. MARK traces the old
+// generation a slice at a time; SWEEP frees what it did not reach.
+enum class GCPhase {
+    IDLE,
+    MARK,
+    SWEEP
+};
+
+// Outcome of executing a single instruction.
+enum class Step {
+    CONTINUE,
+    RETURN,
+    ERROR
+};
+
+// One activation. The running frame keeps its code, ip and slots in the VM's
+// own members; the copies here are brought up to date when it calls out.
+struct CallFrame {
+    ObjFunction* function;  // nullptr for the script
+    uint8_t* code;
+    uint8_t* ip;
+    Value* slots;
+};
+
 struct VM {
+    using Handler = InterpretResult (*)(VM &);
+
+    // The script's chunk, a GC root while it is compiled and run.
     Chunk* chunk{};
+    // The code being run. For the script, a per-run copy of chunk->code that
+    // quickening rewrites in place, leaving the compiled chunk untouched; a
+    // function's own code is quickened where it is.
+    uint8_t* code{};
     uint8_t* ip{};
-    std::array<Value, STACK_MAX> stack;
+    // The running frame's locals, from its callee up, and constant pool.
+    Value* slots{};
+    const Value* constants{};
+    // Preallocated, so a call only fills in the next entry.
+    std::unique_ptr<CallFrame[]> frames{new CallFrame[FRAMES_MAX]};
+    int frameCount{};
+    std::unique_ptr<std::byte[]> arenaBuffer{new std::byte[ARENA_INITIAL_SIZE]};
+    // Grows on demand. What the verifier computes for a chunk is mapped
+    // before it runs, so only code it cannot bound makes the stack grow.
+    ValueStack stack{STACK_MAX_SLOTS};
     Value* stackTop;
     Obj* objects{nullptr};
-    std::unordered_set<std::string> strings;
-    std::unordered_map<std::string, Value> globals;
+    StringTable strings;
+    Nursery nursery{NURSERY_SIZE};
+    StringTable youngStrings;
+    std::vector<Value> globals;
+    // Interned, and GC roots.
+    std::vector<ObjString*> globalNames;
+    SwissTable<int> globalSlots;
+    std::vector<uint8_t> globalRemembered;
+    std::vector<int> rememberedGlobals;
+    std::vector<Obj*> rememberedObjects;
+    std::vector<Obj*> scavengeQueue;
+    std::vector<Obj*> grayStack;
+    ShapeTable shapes;
+    GCPhase gcPhase{GCPhase::IDLE};
+    Obj* sweepList{nullptr};
+    size_t bytesAllocated{};
+    size_t allocationDebt{};
+    size_t nextGC{GC_INITIAL_THRESHOLD};
+    double gcGrowFactor{GC_HEAP_GROW_FACTOR};
+    uint64_t gcPauseTarget{GC_PAUSE_TARGET_NANOS};
+    PauseHistogram minorPauses;
+    PauseHistogram majorPauses;
+    Backend backend{Backend::STACK};
+    Dispatch dispatch{DEFAULT_DISPATCH};
+    // Stack code only.
+    OptLevel optLevel{OptLevel::O0};
+    bool peephole{true};
+    PeepholeStats peepholeStats;
+    Jit jit{Jit::NONE};
+    // When set, interpret() loads compiled chunks from here and stores new ones.
+    std::optional<BytecodeCache> bytecodeCache;
+    // Tracing JIT state for the current run, indexed by loop header offset.
+    std::vector<HotLoop> hotLoops;
+    bool recordingTrace{false};
+    bool countInstructions{false};
+    uint64_t instructionCount{};
+    // Stack code only, while counting: executions of each (previous, next)
+    // opcode pair, indexed previous * OP_COUNT + next.
+    std::vector<uint64_t> pairCounts;
 
     VM();
     ~VM();
 
     InterpretResult interpret(std::string_view);
+    // Compiles into the bytecode cache without running anything.
+    InterpretResult precompile(std::string_view);
+    bool compile(std::string_view source, Chunk &chunk);
     InterpretResult run();
+    template<bool COUNT>
+    InterpretResult runSwitch();
+    InterpretResult runThreaded();
+    InterpretResult runTailCall();
+    template<OP op>
+    static InterpretResult handle(VM &vm);
+    CPPLOX_ALWAYS_INLINE Step execute(OP instruction);
+    Step executeAt(uint8_t *instruction);
+    void loopBackEdge();
+    void recordTrace(int header);
+    [[nodiscard]] bool traceable(OP instruction) const;
+    static InterpretResult finish(Step step);
+    void traceExecution();
+    template<bool COUNT>
+    InterpretResult runRegisters();
+    void traceRegisters();
     inline uint8_t read_byte();
     inline uint16_t read_short();
+    inline uint32_t read_triple();
+    inline int32_t read_int();
     inline Value read_constant();
 
     void push(Value value);
     Value pop();
+    void popN(int count);
 
     template<typename BINARY>
     constexpr auto binary_op(BINARY fct) -> InterpretResult;
 
+    template<typename COMPARE>
+    auto branch_op(COMPARE fct) -> InterpretResult;
+
+    void quicken(int size, OP op);
+
+    bool call(Value callee, int argc);
+
+    bool tailCall(Value callee, int argc);
+
+    bool checkCall(Value callee, int argc);
+
+    void enterFrame(const CallFrame &frame);
+
+    void leaveFrame();
+
+    void instantiate();
+
+    bool getField();
+
+    bool setField();
+
+    void storeField(uint32_t shape, uint32_t index);
+
+    void growOverflow(uint32_t index);
+
+    bool checkMapKey(int distance);
+
+    bool buildMap(int count);
+
+    bool getIndex();
+
+    bool setIndex();
+
+    void mapStore(ObjMap *map, Value key, Value value);
+
+    void resizeMap(int distance, uint32_t capacity);
+
+    bool forIn(int slot);
+
+    void defineNative(std::string_view name, int arity, NativeFn function);
+
+    auto add_op() -> InterpretResult;
+
+    void equal_op(bool negate);
+
+    auto add_to_local(uint8_t slot, Value constant) -> InterpretResult;
+
+    template<typename BINARY>
+    auto register_op(BINARY fct, Value &result, Value a, Value b) -> InterpretResult;
+
+    auto register_add(Value &result, Value a, Value b) -> InterpretResult;
+
+    bool textEqual(Value a, Value b);
+
     Value peek(int distance) const;
 
     template<typename... Args>
@@ -46,12 +225,119 @@ struct VM {
 
     void resetStack();
 
+    int resolveGlobal(std::string_view name);
+    [[nodiscard]] int findGlobal(std::string_view name) const;
+
     void concatenate();
 
+    Value flattenAt(int distance);
+
+    ObjString *copyString(std::string_view chars);
+
+    ObjString *runtimeString(std::string_view chars);
+
+    ObjString *allocateString(std::string_view chars, uint32_t hash, bool young);
+
+    ObjFunction *newFunction();
+
     void deleteObjects() const;
 
+    // Both allocators reserve sizeof(T) + extra bytes, so variable-length
+    // payloads such as string characters share the object's allocation.
+    template<typename T, typename... Args>
+    T *allocateObject(size_t extra, Args &&... args);
+
+    template<typename T, typename... Args>
+    T *allocateYoung(size_t extra, Args &&... args);
+
+    [[nodiscard]] bool isYoung(Value value) const {
+        return isObj(value) && nursery.contains(asObject(value));
+    }
+
+    // Write barrier for global slots. It remembers slots that point into the
+    // nursery so a minor collection need not scan every global, and shades
+    // the stored value while the old generation is being marked.
+    void writeGlobal(int slot, Value value) {
+        globals[slot] = value;
+        if (isYoung(value) && !globalRemembered[slot]) {
+            globalRemembered[slot] = 1;
+            rememberedGlobals.push_back(slot);
+        }
+        if (gcPhase == GCPhase::MARK) markValue(value);
+    }
+
+    // Write barrier for object fields: remembers old objects that point into
+    // the nursery, and shades the target if the owner was already marked.
+    void writeBarrier(Obj *owner, Obj *target) {
+        if (target == nullptr) return;
+        if (!owner->isRemembered && nursery.contains(target) && !nursery.contains(owner)) {
+            owner->isRemembered = true;
+            rememberedObjects.push_back(owner);
+        }
+        if (gcPhase == GCPhase::MARK && owner->isMarked) markObject(target);
+    }
+
+    void minorCollect();
+    Value evacuate(Value value);
+    Obj *evacuateObject(Obj *object);
+    void scavengeObject(Obj *object);
+    Obj *promote(Obj *object);
+
+    void collectGarbage();
+    void payAllocation(size_t size);
+    void linkObject(Obj *object);
+    void gcSlice();
+    bool gcStep();
+    void startCycle();
+    void remark();
+    void finishCycle();
+    void markRoots();
+    void markValue(Value value);
+    void markObject(Obj *object);
+    void traceReferences();
+    void blackenObject(Obj *object);
+    void printGCStats() const;
+    void printPeepholeStats() const;
+
     ObjString *read_string();
 };
 
 
+template<typename T, typename... Args>
+T *VM::allocateObject(size_t extra, Args &&... args) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    if constexpr (DEBUG_STRESS_GC) {
+        collectGarbage();
+    } else {
+        payAllocation(sizeof(T) + extra);
+    }
+
+    auto obj = new(::operator new(sizeof(T) + extra)) T{std::forward<Args>(args)...};
+    linkObject(obj);
+    return obj;
+}
+
+template<typename T, typename... Args>
+T *VM::allocateYoung(size_t extra, Args &&... args) {
+    if (!nursery.accepts(sizeof(T) + extra)) {
+        return allocateObject<T>(extra, std::forward<Args>(args)...);
+    }
+
+    if constexpr (DEBUG_STRESS_GC) collectGarbage();
+
+    void *memory = nursery.allocate(sizeof(T) + extra);
+    if (memory == nullptr) {
+        minorCollect();
+        if (gcPhase == GCPhase::IDLE) {
+            payAllocation(0);
+        } else {
+            gcSlice(); // each nursery refill also advances a running cycle
+        }
+        memory = nursery.allocate(sizeof(T) + extra);
+    }
+
+    return new(memory) T{std::forward<Args>(args)...};
+}
+
+
 #endif //CPPLOX_VM_H
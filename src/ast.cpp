@@ -0,0 +1,484 @@
+#include "ast.h"
+#include <cstdlib>
+#include <limits>
+#include <utility>
+#include "chunk.h"
+
+// Indexed by TokenType; the entries must stay in enum order.
+const std::array<AstParser::ParseRule, TOKEN_TYPE_COUNT> AstParser::rules{{
+        {&AstParser::grouping, &AstParser::call,    Precedence::CALL},       // TokenType::LEFT_PAREN
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::RIGHT_PAREN
+        {&AstParser::map,      nullptr,             Precedence::NONE},       // TokenType::LEFT_BRACE
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::RIGHT_BRACE
+        {nullptr,              &AstParser::index,   Precedence::CALL},       // TokenType::LEFT_BRACKET
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::RIGHT_BRACKET
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::COLON
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::COMMA
+        {nullptr,              &AstParser::dot,     Precedence::CALL},       // TokenType::DOT
+        {&AstParser::unary,    &AstParser::binary,  Precedence::TERM},       // TokenType::MINUS
+        {nullptr,              &AstParser::binary,  Precedence::TERM},       // TokenType::PLUS
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::SEMICOLON
+        {nullptr,              &AstParser::binary,  Precedence::FACTOR},     // TokenType::SLASH
+        {nullptr,              &AstParser::binary,  Precedence::FACTOR},     // TokenType::STAR
+        {&AstParser::unary,    nullptr,             Precedence::NONE},       // TokenType::BANG
+        {nullptr,              &AstParser::binary,  Precedence::EQUALITY},   // TokenType::BANG_EQUAL
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::EQUAL
+        {nullptr,              &AstParser::binary,  Precedence::EQUALITY},   // TokenType::EQUAL_EQUAL
+        {nullptr,              &AstParser::binary,  Precedence::COMPARISON}, // TokenType::GREATER
+        {nullptr,              &AstParser::binary,  Precedence::COMPARISON}, // TokenType::GREATER_EQUAL
+        {nullptr,              &AstParser::binary,  Precedence::COMPARISON}, // TokenType::LESS
+        {nullptr,              &AstParser::binary,  Precedence::COMPARISON}, // TokenType::LESS_EQUAL
+        {&AstParser::variable, nullptr,             Precedence::NONE},       // TokenType::IDENTIFIER
+        {&AstParser::string,   nullptr,             Precedence::NONE},       // TokenType::STRING
+        {&AstParser::number,   nullptr,             Precedence::NONE},       // TokenType::NUMBER
+        {nullptr,              &AstParser::logical, Precedence::AND},        // TokenType::AND
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::CLASS
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::ELSE
+        {&AstParser::literal,  nullptr,             Precedence::NONE},       // TokenType::FALSE
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::FOR
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::FUN
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::IF
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::IN
+        {&AstParser::literal,  nullptr,             Precedence::NONE},       // TokenType::NIL
+        {nullptr,              &AstParser::logical, Precedence::OR},         // TokenType::OR
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::PRINT
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::RETURN
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::SUPER
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::THIS
+        {&AstParser::literal,  nullptr,             Precedence::NONE},       // TokenType::TRUE
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::VAR
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::WHILE
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::ERROR
+        {nullptr,              nullptr,             Precedence::NONE},       // TokenType::EOFILE
+}};
+
+Ast AstParser::parse() {
+    NodeId last = NO_NODE;
+    while (!parser.match(TokenType::EOFILE)) {
+        NodeId statement = declaration();
+        if (statement == NO_NODE) continue;
+        (last == NO_NODE ? ast.root : ast[last].next) = statement;
+        last = statement;
+    }
+    return std::move(ast);
+}
+
+// The node for the token just consumed.
+NodeId AstParser::node(NodeKind kind, NodeId a, NodeId b) {
+    return ast.add({kind, parser.previous, 0, {}, a, b});
+}
+
+void AstParser::beginScope() {
+    scopeDepth++;
+}
+
+void AstParser::endScope() {
+    scopeDepth--;
+    while (!locals.empty() && locals.back().depth > scopeDepth) locals.pop_back();
+}
+
+// Statements return NO_NODE only after a syntax error.
+NodeId AstParser::declaration() {
+    NodeId result;
+    if (parser.match(TokenType::CLASS)) {
+        result = classDeclaration();
+    } else if (parser.match(TokenType::FUN)) {
+        result = funDeclaration();
+    } else if (parser.match(TokenType::VAR)) {
+        result = varDeclaration();
+    } else {
+        result = statement();
+    }
+    if (parser.panicMode) parser.synchronize();
+    return result;
+}
+
+// Adds the local declared by `decl`, not yet initialized, to the current scope.
+void AstParser::declareLocal(NodeId decl) {
+    Token name = ast[decl].token;
+    for (auto local = locals.rbegin(); local != locals.rend(); ++local) {
+        if (local->depth != -1 && local->depth < scopeDepth) break;
+        if (local->name.lexeme == name.lexeme) parser.error("Already a variable with this name in this scope.");
+    }
+    if (locals.size() == UINT16_COUNT) {
+        parser.error("Too many local variables in function.");
+    } else {
+        locals.push_back({name, -1, decl});
+    }
+    ast[decl].local = true;
+}
+
+NodeId AstParser::varDeclaration() {
+    parser.consume(TokenType::IDENTIFIER, "Expect variable name");
+    return varInitializer(node(NodeKind::VAR));
+}
+
+NodeId AstParser::varInitializer(NodeId decl) {
+    if (scopeDepth > 0) declareLocal(decl);
+
+    if (parser.match(TokenType::EQUAL)) {
+        NodeId initializer = expression();
+        ast[decl].a = initializer;
+    }
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after variable declaration");
+
+    if (scopeDepth > 0 && !locals.empty() && locals.back().decl == decl) locals.back().depth = scopeDepth;
+    return decl;
+}
+
+NodeId AstParser::classDeclaration() {
+    parser.consume(TokenType::IDENTIFIER, "Expect class name.");
+    NodeId klass = node(NodeKind::CLASS);
+    if (scopeDepth > 0) {
+        declareLocal(klass);
+        if (!locals.empty() && locals.back().decl == klass) locals.back().depth = scopeDepth;
+    }
+    parser.consume(TokenType::LEFT_BRACE, "Expect '{' before class body.");
+    parser.consume(TokenType::RIGHT_BRACE, "Expect '}' after class body.");
+    return klass;
+}
+
+// The name is initialized before the body, so the function can refer to itself.
+NodeId AstParser::funDeclaration() {
+    parser.consume(TokenType::IDENTIFIER, "Expect function name.");
+    NodeId fun = node(NodeKind::FUN);
+    if (scopeDepth > 0) {
+        declareLocal(fun);
+        if (!locals.empty() && locals.back().decl == fun) locals.back().depth = scopeDepth;
+    }
+    function(fun);
+    return fun;
+}
+
+void AstParser::function(NodeId fun) {
+    auto enclosing = std::exchange(locals, {});
+    int enclosingDepth = std::exchange(scopeDepth, 0);
+    ++functionDepth;
+    beginScope();
+    locals.push_back({Token{}, 0, NO_NODE}); // slot 0 holds the callee
+
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
+    NodeId last = NO_NODE;
+    int arity = 0;
+    if (!parser.check(TokenType::RIGHT_PAREN)) {
+        do {
+            if (++arity > 255) parser.errorAtCurrent("Can't have more than 255 parameters.");
+            parser.consume(TokenType::IDENTIFIER, "Expect parameter name.");
+            NodeId parameter = node(NodeKind::VAR);
+            declareLocal(parameter);
+            if (locals.back().decl == parameter) locals.back().depth = scopeDepth;
+            (last == NO_NODE ? ast[fun].a : ast[last].next) = parameter;
+            last = parameter;
+        } while (parser.match(TokenType::COMMA));
+    }
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+    parser.consume(TokenType::LEFT_BRACE, "Expect '{' before function body.");
+    NodeId body = block();
+    ast[fun].b = ast[body].a;
+
+    --functionDepth;
+    locals = std::move(enclosing);
+    scopeDepth = enclosingDepth;
+}
+
+NodeId AstParser::returnStatement() {
+    NodeId result = node(NodeKind::RETURN);
+    if (functionDepth == 0) parser.error("Can't return from top-level code.");
+    if (!parser.match(TokenType::SEMICOLON)) {
+        NodeId value = expression();
+        ast[result].a = value;
+        parser.consume(TokenType::SEMICOLON, "Expect ';' after return value.");
+    }
+    return result;
+}
+
+NodeId AstParser::statement() {
+    if (parser.match(TokenType::PRINT)) {
+        NodeId print = node(NodeKind::PRINT);
+        NodeId value = expression();
+        ast[print].a = value;
+        parser.consume(TokenType::SEMICOLON, "Expect ';' after value.");
+        return print;
+    }
+    if (parser.match(TokenType::FOR)) return forStatement();
+    if (parser.match(TokenType::IF)) return ifStatement();
+    if (parser.match(TokenType::RETURN)) return returnStatement();
+    if (parser.match(TokenType::WHILE)) return whileStatement();
+    if (parser.match(TokenType::LEFT_BRACE)) {
+        beginScope();
+        NodeId result = block();
+        endScope();
+        return result;
+    }
+    return expressionStatement();
+}
+
+NodeId AstParser::block() {
+    NodeId result = node(NodeKind::BLOCK);
+    NodeId last = NO_NODE;
+    while (!parser.check(TokenType::RIGHT_BRACE) && !parser.check(TokenType::EOFILE)) {
+        NodeId statement = declaration();
+        if (statement == NO_NODE) continue;
+        (last == NO_NODE ? ast[result].a : ast[last].next) = statement;
+        last = statement;
+    }
+    parser.consume(TokenType::RIGHT_BRACE, "Expect, '}' after block.");
+    return result;
+}
+
+NodeId AstParser::expressionStatement() {
+    NodeId value = expression();
+    NodeId result = ast.add({NodeKind::EXPRESSION, value == NO_NODE ? parser.previous : ast[value].token, 0, {}, value});
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after expression");
+    return result;
+}
+
+NodeId AstParser::ifStatement() {
+    NodeId result = node(NodeKind::IF);
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'if'.");
+    NodeId condition = expression();
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
+    NodeId then = statement();
+    NodeId otherwise = parser.match(TokenType::ELSE) ? statement() : NO_NODE;
+
+    Node &statement = ast[result];
+    statement.a = condition;
+    statement.b = then;
+    statement.c = otherwise;
+    return result;
+}
+
+NodeId AstParser::whileStatement() {
+    NodeId result = node(NodeKind::WHILE);
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
+    NodeId condition = expression();
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
+    NodeId body = statement();
+
+    ast[result].a = condition;
+    ast[result].b = body;
+    return result;
+}
+
+NodeId AstParser::forStatement() {
+    NodeId result = node(NodeKind::FOR);
+    beginScope();
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
+    NodeId initializer = NO_NODE;
+    if (parser.match(TokenType::SEMICOLON)) {
+        // No initializer.
+    } else if (parser.match(TokenType::VAR)) {
+        parser.consume(TokenType::IDENTIFIER, "Expect variable name");
+        NodeId decl = node(NodeKind::VAR);
+        if (parser.match(TokenType::IN)) {
+            ast[result].kind = NodeKind::FOR_IN;
+            ast[result].token = ast[decl].token;
+            forInStatement(result);
+            endScope();
+            return result;
+        }
+        initializer = varInitializer(decl);
+    } else {
+        initializer = expressionStatement();
+    }
+
+    NodeId condition = NO_NODE;
+    if (!parser.match(TokenType::SEMICOLON)) {
+        condition = expression();
+        parser.consume(TokenType::SEMICOLON, "Expect ';' after loop conditions.");
+    }
+
+    NodeId increment = NO_NODE;
+    if (!parser.match(TokenType::RIGHT_PAREN)) {
+        increment = expression();
+        parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
+    }
+
+    NodeId body = statement();
+    endScope();
+
+    Node &loop = ast[result];
+    loop.a = initializer;
+    loop.b = condition;
+    loop.c = increment;
+    loop.d = body;
+    return result;
+}
+
+// The map and FOR_IN's cursor take the two slots below the loop variable.
+void AstParser::forInStatement(NodeId loop) {
+    NodeId map = expression();
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
+    for (int hidden = 0; hidden < 2; ++hidden) {
+        if (locals.size() == UINT16_COUNT) {
+            parser.error("Too many local variables in function.");
+        } else {
+            locals.push_back({Token{}, scopeDepth, NO_NODE});
+        }
+    }
+    declareLocal(loop);
+    if (!locals.empty() && locals.back().decl == loop) locals.back().depth = scopeDepth;
+
+    NodeId body = statement();
+    ast[loop].a = map;
+    ast[loop].b = body;
+}
+
+NodeId AstParser::expression() {
+    return parsePrecedence(Precedence::ASSIGNMENT);
+}
+
+// Expressions return NO_NODE only after a syntax error.
+NodeId AstParser::parsePrecedence(Precedence precedence) {
+    parser.advance();
+    PrefixFn prefixRule = rules[to_integral(parser.previous.type)].prefix;
+    if (prefixRule == nullptr) {
+        parser.error("Expect expression");
+        return NO_NODE;
+    }
+
+    bool canAssign = precedence <= Precedence::ASSIGNMENT;
+    NodeId left = (this->*prefixRule)(canAssign);
+
+    while (precedence <= rules[to_integral(parser.current.type)].precedence) {
+        parser.advance();
+        InfixFn infixRule = rules[to_integral(parser.previous.type)].infix;
+        left = (this->*infixRule)(left, canAssign);
+    }
+    return left;
+}
+
+NodeId AstParser::number(bool canAssign) {
+    NodeId result = node(NodeKind::NUMBER);
+    ast[result].number = std::strtod(parser.previous.lexeme.data(), nullptr);
+    return result;
+}
+
+NodeId AstParser::string(bool canAssign) {
+    NodeId result = node(NodeKind::STRING);
+    auto lexeme = parser.previous.lexeme;
+    ast[result].text = lexeme.substr(1, lexeme.size() - 2);
+    return result;
+}
+
+NodeId AstParser::literal(bool canAssign) {
+    switch (parser.previous.type) {
+        case TokenType::FALSE:
+            return node(NodeKind::FALSE);
+        case TokenType::TRUE:
+            return node(NodeKind::TRUE);
+        case TokenType::NIL:
+        default:
+            return node(NodeKind::NIL);
+    }
+}
+
+NodeId AstParser::resolveLocal(const Token &name) {
+    for (auto local = locals.rbegin(); local != locals.rend(); ++local) {
+        if (local->name.lexeme == name.lexeme) {
+            if (local->depth == -1) parser.error("Can't read local variable in its own initializer.");
+            return local->decl;
+        }
+    }
+    return NO_NODE;
+}
+
+NodeId AstParser::variable(bool canAssign) {
+    Token name = parser.previous;
+    NodeId decl = resolveLocal(name);
+    if (canAssign && parser.match(TokenType::EQUAL)) {
+        NodeId value = expression();
+        NodeId result = ast.add({NodeKind::ASSIGN, name, 0, {}, value});
+        ast[result].decl = decl;
+        return result;
+    }
+    NodeId result = ast.add({NodeKind::VARIABLE, name});
+    ast[result].decl = decl;
+    return result;
+}
+
+NodeId AstParser::grouping(bool canAssign) {
+    NodeId result = expression();
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after expression.");
+    return result;
+}
+
+NodeId AstParser::unary(bool canAssign) {
+    Token op = parser.previous;
+    NodeId operand = parsePrecedence(Precedence::UNARY);
+    return ast.add({NodeKind::UNARY, op, 0, {}, operand});
+}
+
+NodeId AstParser::binary(NodeId left, bool canAssign) {
+    Token op = parser.previous;
+    auto precedence = rules[to_integral(op.type)].precedence;
+    NodeId right = parsePrecedence(static_cast<Precedence>(to_integral(precedence) + 1));
+    return ast.add({NodeKind::BINARY, op, 0, {}, left, right});
+}
+
+NodeId AstParser::call(NodeId left, bool canAssign) {
+    NodeId result = node(NodeKind::CALL, left);
+    NodeId last = NO_NODE;
+    int argc = 0;
+    if (!parser.check(TokenType::RIGHT_PAREN)) {
+        do {
+            NodeId argument = expression();
+            if (argc == 255) parser.error("Can't have more than 255 arguments.");
+            argc++;
+            if (argument == NO_NODE) continue;
+            (last == NO_NODE ? ast[result].b : ast[last].next) = argument;
+            last = argument;
+        } while (parser.match(TokenType::COMMA));
+    }
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after arguments.");
+    return result;
+}
+
+NodeId AstParser::dot(NodeId left, bool canAssign) {
+    parser.consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
+    Token name = parser.previous;
+    if (canAssign && parser.match(TokenType::EQUAL)) {
+        NodeId value = expression();
+        return ast.add({NodeKind::SET, name, 0, {}, left, value});
+    }
+    return ast.add({NodeKind::GET, name, 0, {}, left});
+}
+
+NodeId AstParser::map(bool canAssign) {
+    NodeId result = node(NodeKind::MAP);
+    NodeId last = NO_NODE;
+    int count = 0;
+    if (!parser.check(TokenType::RIGHT_BRACE)) {
+        do {
+            NodeId key = expression();
+            parser.consume(TokenType::COLON, "Expect ':' after map key.");
+            NodeId value = expression();
+            if (count == std::numeric_limits<uint16_t>::max()) parser.error("Can't have more than 65535 entries in a map literal.");
+            count++;
+            for (NodeId entry: {key, value}) {
+                if (entry == NO_NODE) continue;
+                (last == NO_NODE ? ast[result].b : ast[last].next) = entry;
+                last = entry;
+            }
+        } while (parser.match(TokenType::COMMA));
+    }
+    parser.consume(TokenType::RIGHT_BRACE, "Expect '}' after map entries.");
+    return result;
+}
+
+NodeId AstParser::index(NodeId left, bool canAssign) {
+    Token bracket = parser.previous;
+    NodeId key = expression();
+    parser.consume(TokenType::RIGHT_BRACKET, "Expect ']' after index.");
+    if (canAssign && parser.match(TokenType::EQUAL)) {
+        NodeId value = expression();
+        return ast.add({NodeKind::SET_INDEX, bracket, 0, {}, left, key, value});
+    }
+    return ast.add({NodeKind::INDEX, bracket, 0, {}, left, key});
+}
+
+NodeId AstParser::logical(NodeId left, bool canAssign) {
+    Token op = parser.previous;
+    NodeId right = parsePrecedence(op.type == TokenType::AND ? Precedence::AND : Precedence::OR);
+    return ast.add({op.type == TokenType::AND ? NodeKind::AND : NodeKind::OR, op, 0, {}, left, right});
+}
@@ -0,0 +1,188 @@
+#ifndef CPPLOX_AST_H
+#define CPPLOX_AST_H
+
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "common.h"
+#include "parser.h"
+
+// Syntax tree for the -O1 pipeline: parse, optimize (optimizer.cpp), then
+// Compiler::generate. Nodes live in one vector and refer to each other by
+// index, so passes rewrite a node in place by overwriting it.
+using NodeId = int32_t;
+constexpr const NodeId NO_NODE = -1;
+
+enum class NodeKind : uint8_t {
+    // Expressions.
+    NUMBER,     // number
+    STRING,     // text
+    TRUE,
+    FALSE,
+    NIL,
+    VARIABLE,   // token is the name
+    ASSIGN,     // token is the name; a = value
+    UNARY,      // token is the operator; a = operand
+    BINARY,     // token is the operator; a, b = operands
+    AND,        // a, b
+    OR,         // a, b
+    CALL,       // token is the '('; a = callee, b = first argument or NO_NODE,
+                // the rest linked through next
+    GET,        // token is the field name; a = object
+    SET,        // token is the field name; a = object, b = value
+    MAP,        // token is the '{'; b = first key or NO_NODE, then its value, the
+                // next key and so on, linked through next
+    INDEX,      // token is the '['; a = map, b = key
+    SET_INDEX,  // token is the '['; a = map, b = key, c = value
+    // Statements. Lists of them are linked through next.
+    PRINT,      // a = value
+    EXPRESSION, // a = value
+    VAR,        // token is the name; a = initializer or NO_NODE
+    BLOCK,      // a = first statement or NO_NODE
+    IF,         // a = condition, b = then, c = else or NO_NODE
+    WHILE,      // a = condition or NO_NODE for "always", b = body
+    FOR,        // a = initializer, b = condition, c = increment, each maybe NO_NODE; d = body
+    FOR_IN,     // token is the loop variable's name; a = map, b = body
+    FUN,        // token is the name; a = first parameter (a VAR) or NO_NODE, b = first
+                // statement of the body or NO_NODE; both lists linked through next
+    RETURN,     // a = value or NO_NODE
+    CLASS       // token is the name
+};
+
+struct Node {
+    NodeKind kind;
+    Token token{};
+    double number{};
+    std::string_view text{};    // without the quotes
+    NodeId a{NO_NODE};
+    NodeId b{NO_NODE};
+    NodeId c{NO_NODE};
+    NodeId d{NO_NODE};
+    NodeId next{NO_NODE};
+    // VARIABLE and ASSIGN: the VAR or FOR_IN node declaring the local, NO_NODE for a global.
+    NodeId decl{NO_NODE};
+    // VAR, FUN and CLASS: declared in a block, not at the top level.
+    bool local{};
+};
+
+struct Ast {
+    std::vector<Node> nodes;
+    // Text of strings made by folding; string literals point into the source.
+    std::deque<std::string> strings;
+    NodeId root{NO_NODE};
+
+    NodeId add(Node node) {
+        nodes.push_back(std::move(node));
+        return static_cast<NodeId>(nodes.size()) - 1;
+    }
+
+    Node &operator[](NodeId id) { return nodes[id]; }
+
+    const Node &operator[](NodeId id) const { return nodes[id]; }
+};
+
+// Builds the tree with the same grammar, scoping rules and error messages as
+// the single-pass Compiler, reporting through the caller's Parser.
+class AstParser {
+    struct AstLocal {
+        Token name;
+        int depth;
+        NodeId decl;
+    };
+
+    Parser &parser;
+    Ast ast;
+    // The innermost function's; a function sees no locals but its own.
+    std::vector<AstLocal> locals;
+    int scopeDepth{};
+    int functionDepth{};
+
+    NodeId declaration();
+
+    NodeId varDeclaration();
+
+    NodeId varInitializer(NodeId decl);
+
+    NodeId classDeclaration();
+
+    NodeId funDeclaration();
+
+    void function(NodeId fun);
+
+    void declareLocal(NodeId decl);
+
+    NodeId returnStatement();
+
+    NodeId statement();
+
+    NodeId block();
+
+    NodeId ifStatement();
+
+    NodeId whileStatement();
+
+    NodeId forStatement();
+
+    void forInStatement(NodeId loop);
+
+    NodeId expressionStatement();
+
+    NodeId expression();
+
+    NodeId parsePrecedence(Precedence precedence);
+
+    NodeId number(bool canAssign);
+
+    NodeId string(bool canAssign);
+
+    NodeId literal(bool canAssign);
+
+    NodeId variable(bool canAssign);
+
+    NodeId grouping(bool canAssign);
+
+    NodeId unary(bool canAssign);
+
+    NodeId binary(NodeId left, bool canAssign);
+
+    NodeId logical(NodeId left, bool canAssign);
+
+    NodeId call(NodeId left, bool canAssign);
+
+    NodeId dot(NodeId left, bool canAssign);
+
+    NodeId map(bool canAssign);
+
+    NodeId index(NodeId left, bool canAssign);
+
+    NodeId node(NodeKind kind, NodeId a = NO_NODE, NodeId b = NO_NODE);
+
+    void beginScope();
+
+    void endScope();
+
+    NodeId resolveLocal(const Token &name);
+
+    using PrefixFn = NodeId (AstParser::*)(bool canAssign);
+    using InfixFn = NodeId (AstParser::*)(NodeId left, bool canAssign);
+
+    struct ParseRule {
+        PrefixFn prefix;
+        InfixFn infix;
+        Precedence precedence;
+    };
+
+    static const std::array<ParseRule, TOKEN_TYPE_COUNT> rules;
+
+public:
+    explicit AstParser(Parser &parser) : parser{parser} {}
+
+    // Expects the parser primed with its first token.
+    Ast parse();
+};
+
+
+#endif //CPPLOX_AST_H
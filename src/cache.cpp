@@ -0,0 +1,376 @@
+#include "cache.h"
+#include "VM.h"
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <fmt/format.h>
+
+#if CPPLOX_HAS_BYTECODE_CACHE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+constexpr uint64_t fnv1a(std::string_view bytes, uint64_t hash = 14695981039346656037ull) {
+    for (auto c: bytes) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a(std::span<const uint8_t> bytes) {
+    return fnv1a({reinterpret_cast<const char *>(bytes.data()), bytes.size()});
+}
+
+#define LOX_OPCODE_NAME(name) #name " "
+// Files written with a different opcode table read as stale.
+constexpr const uint64_t OPCODE_TABLE_HASH = fnv1a(LOX_OPCODES(LOX_OPCODE_NAME));
+#undef LOX_OPCODE_NAME
+
+constexpr const char CACHE_MAGIC[4] = {'L', 'O', 'X', 'C'};
+
+// Followed by the payload: code, line table, constants, global names.
+struct CacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t opcodeTable;
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    uint32_t options;
+    uint32_t registerCount;
+    uint32_t codeSize;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint32_t globalCount;
+    uint64_t payloadSize;
+    uint64_t checksum;          // of the payload
+};
+
+// A FUNCTION constant is followed by its arity, name, the code size, line
+// count and constant count of its chunk, and then that chunk's payload.
+enum class ConstantTag : uint8_t {
+    NUMBER,
+    STRING,
+    FUNCTION
+};
+
+// Functions nested deeper than this read as corrupt rather than being recursed into.
+constexpr const int MAX_FUNCTION_DEPTH = 256;
+
+// Everything that changes the code compiled from the same source.
+static uint32_t compileOptions(const VM &vm) {
+    return to_integral(vm.backend) | to_integral(vm.optLevel) << 8 | static_cast<uint32_t>(vm.peephole) << 16;
+}
+
+static uint64_t cacheKey(uint64_t sourceHash, uint32_t options) {
+    return fnv1a({reinterpret_cast<const char *>(&options), sizeof options}, sourceHash);
+}
+
+struct PayloadWriter {
+    std::vector<uint8_t> bytes;
+
+    void write(const void *data, size_t size) {
+        auto begin = static_cast<const uint8_t *>(data);
+        bytes.insert(bytes.end(), begin, begin + size);
+    }
+
+    template<typename T>
+    void write(T value) {
+        write(&value, sizeof value);
+    }
+
+    void text(std::string_view chars) {
+        write(static_cast<uint32_t>(chars.size()));
+        write(chars.data(), chars.size());
+    }
+};
+
+// Reads past the end leave `ok` false and return zeros.
+struct PayloadReader {
+    std::span<const uint8_t> bytes;
+    size_t position{};
+    bool ok{true};
+
+    const uint8_t *take(size_t size) {
+        if (!ok || size > bytes.size() - position) {
+            ok = false;
+            return nullptr;
+        }
+        auto at = bytes.data() + position;
+        position += size;
+        return at;
+    }
+
+    template<typename T>
+    T read() {
+        T value{};
+        if (auto at = take(sizeof value)) std::memcpy(&value, at, sizeof value);
+        return value;
+    }
+
+    std::string_view text() {
+        auto size = read<uint32_t>();
+        auto at = take(size);
+        return at ? std::string_view{reinterpret_cast<const char *>(at), size} : std::string_view{};
+    }
+
+    // Whether `count` entries of at least `size` bytes each can still follow,
+    // so a count is checked before anything is sized by it.
+    bool fits(uint64_t count, size_t size) {
+        if (count > (bytes.size() - position) / size) ok = false;
+        return ok;
+    }
+};
+
+struct DecodedChunk;
+
+struct DecodedConstant {
+    ConstantTag tag;
+    uint64_t number{};
+    std::string_view text;          // a string's text, or a function's name
+    uint32_t arity{};
+    std::unique_ptr<DecodedChunk> function;
+};
+
+// A chunk read from the payload and checked, before anything reaches the VM.
+struct DecodedChunk {
+    std::span<const uint8_t> code;
+    std::vector<std::pair<int32_t, int32_t>> lines;
+    std::vector<DecodedConstant> constants;
+};
+
+static bool decodeChunk(PayloadReader &reader, uint32_t codeSize, uint32_t lineCount, uint32_t constantCount,
+                        DecodedChunk &chunk, int depth) {
+    auto code = reader.take(codeSize);
+    chunk.code = {code, code != nullptr ? codeSize : 0};
+    if (!reader.fits(lineCount, 2 * sizeof(int32_t))) return false;
+    chunk.lines.resize(lineCount);
+    int64_t lineTotal = 0;
+    for (auto &[line, count]: chunk.lines) {
+        line = reader.read<int32_t>();
+        count = reader.read<int32_t>();
+        lineTotal += count;
+    }
+    if (!reader.fits(constantCount, sizeof(ConstantTag))) return false;
+    chunk.constants.resize(constantCount);
+    for (auto &constant: chunk.constants) {
+        constant.tag = reader.read<ConstantTag>();
+        if (constant.tag == ConstantTag::NUMBER) {
+            constant.number = reader.read<uint64_t>();
+        } else if (constant.tag == ConstantTag::STRING) {
+            constant.text = reader.text();
+        } else if (constant.tag == ConstantTag::FUNCTION && depth < MAX_FUNCTION_DEPTH) {
+            constant.arity = reader.read<uint32_t>();
+            constant.text = reader.text();
+            auto nestedCode = reader.read<uint32_t>();
+            auto nestedLines = reader.read<uint32_t>();
+            auto nestedConstants = reader.read<uint32_t>();
+            constant.function = std::make_unique<DecodedChunk>();
+            if (!decodeChunk(reader, nestedCode, nestedLines, nestedConstants, *constant.function, depth + 1)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return reader.ok && lineTotal == codeSize;
+}
+
+// `owner` is the function the chunk belongs to, nullptr for the script. The
+// constant pools fill in order, and each is reachable by the collector
+// through the script's chunk while it does.
+static void buildChunk(const DecodedChunk &decoded, Chunk &chunk, ObjFunction *owner, VM &vm) {
+    if (owner == nullptr) {
+        chunk.mappedCode = decoded.code;
+    } else {
+        chunk.code.assign(decoded.code.begin(), decoded.code.end());
+    }
+    for (auto [line, count]: decoded.lines) chunk.lines.emplace_back(line).num_instructions = count;
+
+    auto add = [&](Value value) {
+        chunk.constants.push_back(value);
+        if (owner != nullptr && isObj(value)) vm.writeBarrier(owner, asObject(value));
+    };
+    chunk.constants.reserve(decoded.constants.size());
+    for (auto &constant: decoded.constants) {
+        if (constant.tag == ConstantTag::NUMBER) {
+            add(number_val(std::bit_cast<double>(constant.number)));
+        } else if (constant.tag == ConstantTag::STRING) {
+            add(obj_val(vm.copyString(constant.text)));
+        } else {
+            auto function = vm.newFunction();
+            add(obj_val(function));
+            function->arity = static_cast<int>(constant.arity);
+            function->name = vm.copyString(constant.text);
+            vm.writeBarrier(function, function->name);
+            buildChunk(*constant.function, *function->chunk, function, vm);
+        }
+    }
+}
+
+// The code, line table and constants of `chunk`; its sizes go before it,
+// in the header for the script or in the FUNCTION constant for a function.
+static bool encodeChunk(PayloadWriter &payload, const Chunk &chunk) {
+    auto code = chunk.bytes();
+    payload.write(code.data(), code.size());
+    for (auto &line: chunk.lines) {
+        payload.write<int32_t>(line.line_no);
+        payload.write<int32_t>(line.num_instructions);
+    }
+    for (Value constant: chunk.constants) {
+        if (isNumber(constant)) {
+            payload.write(ConstantTag::NUMBER);
+            payload.write(std::bit_cast<uint64_t>(asNumber(constant)));
+        } else if (isString(constant)) {
+            payload.write(ConstantTag::STRING);
+            payload.text(asString(constant)->str());
+        } else if (isFunction(constant)) {
+            auto function = asFunction(constant);
+            payload.write(ConstantTag::FUNCTION);
+            payload.write(static_cast<uint32_t>(function->arity));
+            payload.text(function->name->str());
+            payload.write(static_cast<uint32_t>(function->chunk->bytes().size()));
+            payload.write(static_cast<uint32_t>(function->chunk->lines.size()));
+            payload.write(static_cast<uint32_t>(function->chunk->constants.size()));
+            if (!encodeChunk(payload, *function->chunk)) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::filesystem::path BytecodeCache::defaultDirectory() {
+    if (auto xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg != '\0') {
+        return std::filesystem::path{xdg} / "cpplox";
+    }
+    if (auto home = std::getenv("HOME"); home != nullptr && *home != '\0') {
+        return std::filesystem::path{home} / ".cache" / "cpplox";
+    }
+    return std::filesystem::temp_directory_path() / "cpplox";
+}
+
+std::filesystem::path BytecodeCache::pathFor(uint64_t key) const {
+    return directory / fmt::format("{:016x}.loxc", key);
+}
+
+std::optional<MappedFile> BytecodeCache::load(std::string_view source, VM &vm, Chunk &chunk) const {
+    auto sourceHash = fnv1a(source);
+    auto options = compileOptions(vm);
+    auto file = MappedFile::open(pathFor(cacheKey(sourceHash, options)));
+    if (!file) return std::nullopt;
+
+    auto bytes = file->bytes();
+    CacheHeader header{};
+    if (bytes.size() < sizeof header) return std::nullopt;
+    std::memcpy(&header, bytes.data(), sizeof header);
+    auto payload = bytes.subspan(sizeof header);
+    if (std::memcmp(header.magic, CACHE_MAGIC, sizeof CACHE_MAGIC) != 0 || header.version != CACHE_VERSION ||
+        header.opcodeTable != OPCODE_TABLE_HASH || header.sourceHash != sourceHash ||
+        header.sourceSize != source.size() || header.options != options || header.payloadSize != payload.size() ||
+        header.checksum != fnv1a(payload)) {
+        return std::nullopt;
+    }
+
+    // Decode and check everything before anything reaches the VM.
+    PayloadReader reader{payload};
+    DecodedChunk decoded;
+    if (!decodeChunk(reader, header.codeSize, header.lineCount, header.constantCount, decoded, 0)) return std::nullopt;
+    if (!reader.fits(header.globalCount, sizeof(uint32_t))) return std::nullopt;
+    std::vector<std::string_view> globals(header.globalCount);
+    for (auto &name: globals) name = reader.text();
+    if (!reader.ok || reader.position != payload.size()) return std::nullopt;
+
+    // Slots were numbered from zero as the compiler met the names; the VM
+    // must hand out the same ones.
+    for (size_t slot = 0; slot < globals.size(); ++slot) {
+        if (slot < vm.globalNames.size() ? vm.globalNames[slot]->str() != globals[slot]
+                                         : vm.findGlobal(globals[slot]) != -1) {
+            return std::nullopt;
+        }
+    }
+    for (auto name: globals) vm.resolveGlobal(name);
+
+    chunk.registerCount = static_cast<int>(header.registerCount);
+    buildChunk(decoded, chunk, nullptr, vm);
+    return file;
+}
+
+bool BytecodeCache::store(std::string_view source, const VM &vm, const Chunk &chunk) const {
+    PayloadWriter payload;
+    if (!encodeChunk(payload, chunk)) return false;
+    for (auto name: vm.globalNames) payload.text(name->str());
+
+    auto sourceHash = fnv1a(source);
+    auto options = compileOptions(vm);
+    CacheHeader header{};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof CACHE_MAGIC);
+    header.version = CACHE_VERSION;
+    header.opcodeTable = OPCODE_TABLE_HASH;
+    header.sourceHash = sourceHash;
+    header.sourceSize = source.size();
+    header.options = options;
+    header.registerCount = static_cast<uint32_t>(chunk.registerCount);
+    header.codeSize = static_cast<uint32_t>(chunk.bytes().size());
+    header.lineCount = static_cast<uint32_t>(chunk.lines.size());
+    header.constantCount = static_cast<uint32_t>(chunk.constants.size());
+    header.globalCount = static_cast<uint32_t>(vm.globalNames.size());
+    header.payloadSize = payload.bytes.size();
+    header.checksum = fnv1a(payload.bytes);
+
+    // Written aside and renamed into place, so no reader sees half a file.
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    auto path = pathFor(cacheKey(sourceHash, options));
+    auto temporary = path;
+    temporary += fmt::format(".{}.tmp", getpid());
+    {
+        std::ofstream file{temporary, std::ios::binary | std::ios::trunc};
+        file.write(reinterpret_cast<const char *>(&header), sizeof header);
+        file.write(reinterpret_cast<const char *>(payload.bytes.data()), static_cast<std::streamsize>(payload.bytes.size()));
+        if (!file.flush()) {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error) std::filesystem::remove(temporary, error);
+    return !error;
+}
+
+#if CPPLOX_HAS_BYTECODE_CACHE
+
+std::optional<MappedFile> MappedFile::open(const std::filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return std::nullopt;
+    struct stat status{};
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        close(fd);
+        return std::nullopt;
+    }
+    auto size = static_cast<size_t>(status.st_size);
+    void *memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) return std::nullopt;
+    return MappedFile{memory, size};
+}
+
+MappedFile::~MappedFile() {
+    if (memory != nullptr) munmap(memory, size);
+}
+
+#else
+
+std::optional<MappedFile> MappedFile::open(const std::filesystem::path &) {
+    return std::nullopt;
+}
+
+MappedFile::~MappedFile() = default;
+
+#endif
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+        : memory{std::exchange(other.memory, nullptr)}, size{other.size} {}
@@ -0,0 +1,71 @@
+#ifndef CPPLOX_CACHE_H
+#define CPPLOX_CACHE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string_view>
+#include "chunk.h"
+
+struct VM;
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CPPLOX_HAS_BYTECODE_CACHE 1
+#else
+#define CPPLOX_HAS_BYTECODE_CACHE 0
+#endif
+
+// Bumped whenever the file layout changes. Changes to the opcode table are
+// caught on their own (cache.cpp hashes the opcode names).
+constexpr const uint32_t CACHE_VERSION = 2;
+
+// A whole file, mapped read-only for as long as this lives.
+class MappedFile {
+public:
+    // Nothing when the file cannot be opened or mapped, or the platform has no mmap.
+    static std::optional<MappedFile> open(const std::filesystem::path &path);
+
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&) = delete;
+    ~MappedFile();
+
+    [[nodiscard]] std::span<const uint8_t> bytes() const { return {static_cast<const uint8_t *>(memory), size}; }
+
+private:
+    MappedFile(void *memory, size_t size) : memory{memory}, size{size} {}
+
+    void *memory;
+    size_t size;
+};
+
+// Compiled chunks kept on disk between runs: one .loxc file per source text
+// and set of compile options, named after a hash of both. A file holds the
+// code, the line table, the constant pool (strings as their text, functions
+// as their own code, lines and constants) and the names of the globals the
+// code addresses by slot, in slot order.
+class BytecodeCache {
+public:
+    explicit BytecodeCache(std::filesystem::path directory) : directory{std::move(directory)} {}
+
+    // $XDG_CACHE_HOME/cpplox, or ~/.cache/cpplox.
+    static std::filesystem::path defaultDirectory();
+
+    // Fills `chunk` from the entry for `source`, interning its strings and
+    // resolving its globals in `vm`. The script's code is not copied:
+    // chunk.mappedCode points into the returned mapping, which must outlive
+    // the chunk. Functions get their own copy, as they may outlive it.
+    // Nothing on a miss, or when the entry is stale or corrupt.
+    std::optional<MappedFile> load(std::string_view source, VM &vm, Chunk &chunk) const;
+
+    // Writes the entry for `source`, replacing any old one. False if it could not.
+    bool store(std::string_view source, const VM &vm, const Chunk &chunk) const;
+
+private:
+    [[nodiscard]] std::filesystem::path pathFor(uint64_t key) const;
+
+    std::filesystem::path directory;
+};
+
+
+#endif //CPPLOX_CACHE_H
@@ -1,5 +1,37 @@
 #include "chunk.h"
 #include "magic_enum.hpp"
+#include <algorithm>
+#include <bit>
+
+Chunk::Chunk(std::pmr::memory_resource *resource) : code{resource}, constants{resource}, lines{resource}, constantIndex{resource} {}
+
+void Chunk::reserve(size_t bytes) {
+    code.reserve(bytes);
+    lines.reserve(bytes / 8);
+}
+
+// Drops the code from `size` on, with its line entries. Used by the
+// compiler when it replaces instructions it just emitted by a fused one.
+void Chunk::truncate(size_t size) {
+    auto removed = code.size() - size;
+    code.resize(size);
+    while (removed > 0) {
+        auto &last = lines.back();
+        auto count = std::min<size_t>(removed, last.num_instructions);
+        last.num_instructions -= static_cast<int>(count);
+        removed -= count;
+        if (last.num_instructions == 0) lines.pop_back();
+    }
+}
+
+void Chunk::clear() {
+    code.clear();
+    mappedCode = {};
+    constants.clear();
+    lines.clear();
+    constantIndex.clear();
+    registerCount = 0;
+}
 
 auto Chunk::writeChunk(uint8_t opcode, int line) -> void {
     code.push_back(opcode);
@@ -16,9 +48,22 @@ auto Chunk::writeChunk(OP opcode, int line) -> void {
 }
 
 
-auto Chunk::addConstant(Value value) -> uint8_t {
+// A constant's identity: a number's bit pattern, or a string's address,
+// strings being interned.
+static uint64_t identity(Value value) {
+#if CPPLOX_NAN_BOXING
+    return value.bits;
+#else
+    return isNumber(value) ? std::bit_cast<uint64_t>(asNumber(value)) : reinterpret_cast<uintptr_t>(asObject(value));
+#endif
+}
+
+auto Chunk::addConstant(Value value) -> int {
+    auto [it, inserted] = constantIndex.try_emplace(identity(value), static_cast<int>(constants.size()));
+    // Without NaN boxing a number and a string can share an identity.
+    if (!inserted && isNumber(constants[it->second]) == isNumber(value)) return it->second;
     constants.push_back(value);
-    return static_cast<uint8_t>(constants.size() - 1);
+    return static_cast<int>(constants.size()) - 1;
 }
 
 auto Chunk::getLine(size_t index) const -> int {
@@ -34,6 +79,13 @@ auto Chunk::getLine(size_t index) const -> int {
 
 void Chunk::writeConstant(Value value, int line) {
     auto index = addConstant(value);
-    writeChunk(OP::CONSTANT, line);
-    writeChunk(index, line);
+    if (index <= UINT8_MAX) {
+        writeChunk(OP::CONSTANT, line);
+        writeChunk(static_cast<uint8_t>(index), line);
+        return;
+    }
+    writeChunk(OP::CONSTANT_LONG, line);
+    writeChunk(static_cast<uint8_t>(index >> 16), line);
+    writeChunk(static_cast<uint8_t>(index >> 8), line);
+    writeChunk(static_cast<uint8_t>(index), line);
 }
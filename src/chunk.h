@@ -3,47 +3,247 @@
 
 
 #include <vector>
+#include <memory_resource>
+#include <unordered_map>
 #include <cstdint>
+#include <span>
 #include "value.h"
 #include "fmt/format.h"
 #include "magic_enum.hpp"
 
+// The single opcode table. Every consumer that needs one entry per opcode
+// (the enum, the threaded dispatch tables in VM.cpp) is generated from it.
+// POP_JUMP_IF_FALSE through ADD_TO_LOCAL are superinstructions the compiler
+// fuses from the most frequently executed pairs (see cpplox_bench --pairs).
+// POPN and POP_JUMP_IF_TRUE only come out of the peephole pass.
+// The _LONG forms take wider operands, for chunks past the one-byte limits:
+// a 24-bit constant index, 16-bit local and global slots, and a signed 32-bit
+// jump distance that jump relaxation (peephole.cpp) falls back to.
+// ADD_NUMBERS through ADD_TO_LOCAL_NUMBER are never emitted: the VM quickens
+// generic opcodes into them once it has seen their operand types.
+// CALL and TAIL_CALL take the argument count; the callee sits below the
+// arguments. TAIL_CALL only comes out of `return f(...);` in a function.
+// CLASS, GET_FIELD and SET_FIELD take a 24-bit name constant. The field
+// instructions then carry their inline cache, FIELD_CACHE_ENTRIES entries
+// that are compiled empty (all zero) and filled in as the code runs; the
+// _MONO forms are what the VM quickens a site to while one shape is cached.
+// BUILD_MAP takes the 16-bit number of key/value pairs pushed before it.
+// FOR_IN takes the 16-bit slot of a for-in loop's map, which its cursor and
+// loop variable follow; it moves to the next key and pushes whether there
+// was one.
+#define LOX_OPCODES(X)           \
+    X(CONSTANT)                  \
+    X(NIL)                       \
+    X(TRUE)                      \
+    X(FALSE)                     \
+    X(NOT)                       \
+    X(NEGATE)                    \
+    X(EQUAL)                     \
+    X(NOT_EQUAL)                 \
+    X(GREATER)                   \
+    X(GREATER_EQUAL)             \
+    X(LESS)                      \
+    X(LESS_EQUAL)                \
+    X(ADD)                       \
+    X(SUBTRACT)                  \
+    X(MULTIPLY)                  \
+    X(DIVIDE)                    \
+    X(PRINT)                     \
+    X(POP)                       \
+    X(DEFINE_GLOBAL_SLOT)        \
+    X(GET_LOCAL)                 \
+    X(SET_LOCAL)                 \
+    X(GET_GLOBAL_SLOT)           \
+    X(SET_GLOBAL_SLOT)           \
+    X(JUMP)                      \
+    X(JUMP_IF_TRUE)              \
+    X(JUMP_IF_FALSE)             \
+    X(LOOP)                      \
+    X(POP_JUMP_IF_FALSE)         \
+    X(JUMP_IF_NOT_LESS)          \
+    X(JUMP_IF_NOT_LESS_EQUAL)    \
+    X(JUMP_IF_NOT_GREATER)       \
+    X(JUMP_IF_NOT_GREATER_EQUAL) \
+    X(SET_LOCAL_POP)             \
+    X(ADD_TO_LOCAL)              \
+    X(POPN)                      \
+    X(POP_JUMP_IF_TRUE)          \
+    X(CONSTANT_LONG)             \
+    X(DEFINE_GLOBAL_SLOT_LONG)   \
+    X(GET_LOCAL_LONG)            \
+    X(SET_LOCAL_LONG)            \
+    X(GET_GLOBAL_SLOT_LONG)      \
+    X(SET_GLOBAL_SLOT_LONG)      \
+    X(JUMP_LONG)                 \
+    X(ADD_NUMBERS)               \
+    X(ADD_TEXT)                  \
+    X(EQUAL_NUMBERS)             \
+    X(NOT_EQUAL_NUMBERS)         \
+    X(ADD_TO_LOCAL_NUMBER)       \
+    X(CALL)                      \
+    X(TAIL_CALL)                 \
+    X(CLASS)                     \
+    X(GET_FIELD)                 \
+    X(SET_FIELD)                 \
+    X(GET_FIELD_MONO)            \
+    X(SET_FIELD_MONO)            \
+    X(BUILD_MAP)                 \
+    X(GET_INDEX)                 \
+    X(SET_INDEX)                 \
+    X(FOR_IN)                    \
+    X(RETURN)
+
 enum class OP : uint8_t {
-    CONSTANT,
-    NIL,
-    TRUE,
-    FALSE,
-    NOT,
-    NEGATE,
-    EQUAL,
-    NOT_EQUAL,
-    GREATER,
-    GREATER_EQUAL,
-    LESS,
-    LESS_EQUAL,
-    ADD,
-    SUBTRACT,
-    MULTIPLY,
-    DIVIDE,
-    PRINT,
-    POP,
-    DEFINE_GLOBAL,
-    GET_LOCAL,
-    SET_LOCAL,
-    GET_GLOBAL,
-    SET_GLOBAL,
-    JUMP,
-    JUMP_IF_TRUE,
-    JUMP_IF_FALSE,
-    LOOP,
-    RETURN
+#define LOX_OPCODE_ENUM(name) name,
+    LOX_OPCODES(LOX_OPCODE_ENUM)
+#undef LOX_OPCODE_ENUM
+};
+
+#define LOX_OPCODE_COUNT(name) +1
+constexpr const auto OP_COUNT{0 LOX_OPCODES(LOX_OPCODE_COUNT)};
+#undef LOX_OPCODE_COUNT
+
+// The register backend's instruction set. Each instruction is four bytes: the
+// opcode and operands A, B and C, where B and C can also be read together as
+// one big-endian 16-bit operand Bx (signed for jumps, counted in
+// instructions). A is the destination. Registers are stack slots, locals
+// first and temporaries above them. Every binary opcode is directly followed
+// by its K form, which takes C from the constant pool instead of a register.
+#define LOX_REGISTER_OPCODES(X) \
+    X(MOVE)                     \
+    X(LOADK)                    \
+    X(LOADNIL)                  \
+    X(LOADTRUE)                 \
+    X(LOADFALSE)                \
+    X(NOT)                      \
+    X(NEGATE)                   \
+    X(EQUAL)                    \
+    X(EQUALK)                   \
+    X(NOT_EQUAL)                \
+    X(NOT_EQUALK)               \
+    X(GREATER)                  \
+    X(GREATERK)                 \
+    X(GREATER_EQUAL)            \
+    X(GREATER_EQUALK)           \
+    X(LESS)                     \
+    X(LESSK)                    \
+    X(LESS_EQUAL)               \
+    X(LESS_EQUALK)              \
+    X(ADD)                      \
+    X(ADDK)                     \
+    X(SUBTRACT)                 \
+    X(SUBTRACTK)                \
+    X(MULTIPLY)                 \
+    X(MULTIPLYK)                \
+    X(DIVIDE)                   \
+    X(DIVIDEK)                  \
+    X(PRINT)                    \
+    X(DEFINE_GLOBAL)            \
+    X(GET_GLOBAL)               \
+    X(SET_GLOBAL)               \
+    X(JUMP)                     \
+    X(JUMP_IF_TRUE)             \
+    X(JUMP_IF_FALSE)            \
+    X(RETURN)
+
+enum class ROP : uint8_t {
+#define LOX_OPCODE_ENUM(name) name,
+    LOX_REGISTER_OPCODES(LOX_OPCODE_ENUM)
+#undef LOX_OPCODE_ENUM
 };
 
+constexpr const auto REGISTER_INSTRUCTION_SIZE{4};
+
+// Inline cache entries of a field instruction, in native byte order: a get
+// caches the shape seen and the field's index, a set the shape seen, the
+// shape after the store (another one when the store adds the field) and the
+// index.
+constexpr const int FIELD_CACHE_ENTRIES = 4;
+constexpr const int GET_CACHE_ENTRY_SIZE = 6;
+constexpr const int SET_CACHE_ENTRY_SIZE = 10;
+
 template<typename E>
 constexpr auto to_integral(E e) -> typename std::underlying_type<E>::type {
     return static_cast<typename std::underlying_type<E>::type>(e);
 }
 
+// Opcode plus operand bytes.
+constexpr int instructionLength(OP op) {
+    switch (op) {
+        case OP::CONSTANT:
+        case OP::DEFINE_GLOBAL_SLOT:
+        case OP::GET_LOCAL:
+        case OP::SET_LOCAL:
+        case OP::GET_GLOBAL_SLOT:
+        case OP::SET_GLOBAL_SLOT:
+        case OP::SET_LOCAL_POP:
+        case OP::POPN:
+        case OP::CALL:
+        case OP::TAIL_CALL:
+            return 2;
+        case OP::JUMP:
+        case OP::JUMP_IF_TRUE:
+        case OP::JUMP_IF_FALSE:
+        case OP::LOOP:
+        case OP::POP_JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_TRUE:
+        case OP::JUMP_IF_NOT_LESS:
+        case OP::JUMP_IF_NOT_LESS_EQUAL:
+        case OP::JUMP_IF_NOT_GREATER:
+        case OP::JUMP_IF_NOT_GREATER_EQUAL:
+        case OP::ADD_TO_LOCAL:
+        case OP::ADD_TO_LOCAL_NUMBER:
+        case OP::DEFINE_GLOBAL_SLOT_LONG:
+        case OP::GET_LOCAL_LONG:
+        case OP::SET_LOCAL_LONG:
+        case OP::GET_GLOBAL_SLOT_LONG:
+        case OP::SET_GLOBAL_SLOT_LONG:
+        case OP::BUILD_MAP:
+        case OP::FOR_IN:
+            return 3;
+        case OP::CONSTANT_LONG:
+        case OP::CLASS:
+            return 4;
+        case OP::JUMP_LONG:
+            return 5;
+        case OP::GET_FIELD:
+        case OP::GET_FIELD_MONO:
+            return 4 + FIELD_CACHE_ENTRIES * GET_CACHE_ENTRY_SIZE;
+        case OP::SET_FIELD:
+        case OP::SET_FIELD_MONO:
+            return 4 + FIELD_CACHE_ENTRIES * SET_CACHE_ENTRY_SIZE;
+        default:
+            return 1;
+    }
+}
+
+constexpr const int MAX_INSTRUCTION_LENGTH = instructionLength(OP::SET_FIELD);
+
+// The form of an opcode taking a one-byte slot that takes a 16-bit one.
+constexpr OP longForm(OP op) {
+    switch (op) {
+        case OP::DEFINE_GLOBAL_SLOT: return OP::DEFINE_GLOBAL_SLOT_LONG;
+        case OP::GET_LOCAL:          return OP::GET_LOCAL_LONG;
+        case OP::SET_LOCAL:          return OP::SET_LOCAL_LONG;
+        case OP::GET_GLOBAL_SLOT:    return OP::GET_GLOBAL_SLOT_LONG;
+        case OP::SET_GLOBAL_SLOT:    return OP::SET_GLOBAL_SLOT_LONG;
+        default:                     return op;
+    }
+}
+
+// Multi-byte operands are big-endian.
+constexpr uint16_t readShort(const uint8_t *bytes) {
+    return static_cast<uint16_t>(bytes[0] << 8 | bytes[1]);
+}
+
+constexpr uint32_t readTriple(const uint8_t *bytes) {
+    return static_cast<uint32_t>(bytes[0]) << 16 | bytes[1] << 8 | bytes[2];
+}
+
+constexpr int32_t readInt(const uint8_t *bytes) {
+    return static_cast<int32_t>(static_cast<uint32_t>(bytes[0]) << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3]);
+}
+
 template<>
 struct fmt::formatter<OP> {
     template<typename ParseContext>
@@ -57,6 +257,19 @@ struct fmt::formatter<OP> {
     }
 };
 
+template<>
+struct fmt::formatter<ROP> {
+    template<typename ParseContext>
+    constexpr auto parse(ParseContext &ctx) {
+        return ctx.begin();
+    }
+
+    template<typename FormatContext>
+    auto format(ROP const &opcode, FormatContext &ctx) {
+        return fmt::format_to(ctx.out(), "ROP::{}", magic_enum::enum_name(opcode));
+    }
+};
+
 struct Chunk {
     struct line_info {
         const int line_no;
@@ -65,13 +278,36 @@ struct Chunk {
         explicit line_info(int line_no) : line_no(line_no), num_instructions(1) {}
     };
 
-    std::vector<uint8_t> code;
-    std::vector<Value> constants;
-    std::vector<line_info> lines;
+    // Storage comes from the given resource; VM::interpret passes its per-run
+    // arena so a whole compile-and-run is released at once.
+    explicit Chunk(std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+
+    std::pmr::vector<uint8_t> code;
+    // Set instead of code when the chunk was loaded from the bytecode cache:
+    // the bytes stay in the mapped file.
+    std::span<const uint8_t> mappedCode;
+    std::pmr::vector<Value> constants;
+    std::pmr::vector<line_info> lines;
+    // Constant pool index by identity: equal numbers share an entry, and so
+    // do equal strings, which are interned.
+    std::pmr::unordered_map<uint64_t, int> constantIndex;
+    // Register code only: the number of registers its frame needs.
+    int registerCount{};
+
+    void reserve(size_t bytes);
+
+    [[nodiscard]] std::span<const uint8_t> bytes() const {
+        return mappedCode.empty() ? std::span<const uint8_t>{code} : mappedCode;
+    }
+
+    void truncate(size_t size);
+
+    // Back to empty, for a chunk that is to be filled again.
+    void clear();
 
     auto writeChunk(uint8_t, int line) -> void;
     auto writeChunk(OP opcode, int line) -> void;
-    auto addConstant(Value value) -> uint8_t;
+    auto addConstant(Value value) -> int;
     [[nodiscard]] auto getLine(size_t index) const -> int;
     void writeConstant(Value d, int line);
 };
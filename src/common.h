@@ -1,9 +1,97 @@
 #ifndef CPPLOX_COMMON_H
 #define CPPLOX_COMMON_H
 
-constexpr const bool DEBUG_TRACE_EXECUTION{true};
-constexpr const bool DEBUG_PRINT_CODE{true};
+#include <cstdint>
+
+#ifndef CPPLOX_DEBUG_TRACE_EXECUTION
+#define CPPLOX_DEBUG_TRACE_EXECUTION 1
+#endif
+
+#ifndef CPPLOX_DEBUG_PRINT_CODE
+#define CPPLOX_DEBUG_PRINT_CODE 1
+#endif
+
+#ifndef CPPLOX_DEBUG_STRESS_GC
+#define CPPLOX_DEBUG_STRESS_GC 0
+#endif
+
+#ifndef CPPLOX_DEBUG_LOG_GC
+#define CPPLOX_DEBUG_LOG_GC 0
+#endif
+
+constexpr const bool DEBUG_TRACE_EXECUTION{CPPLOX_DEBUG_TRACE_EXECUTION};
+constexpr const bool DEBUG_PRINT_CODE{CPPLOX_DEBUG_PRINT_CODE};
+constexpr const bool DEBUG_STRESS_GC{CPPLOX_DEBUG_STRESS_GC};
+constexpr const bool DEBUG_LOG_GC{CPPLOX_DEBUG_LOG_GC};
 
 constexpr const auto UINT8_COUNT{UINT8_MAX + 1};
+constexpr const auto UINT16_COUNT{UINT16_MAX + 1};
+
+// How VM::run moves from one instruction to the next.
+enum class Dispatch {
+    SWITCH,         // one switch, one shared indirect branch
+    COMPUTED_GOTO,  // direct threading through a label table
+    TAIL_CALL       // one handler function per opcode, chained by tail calls
+};
+
+// Which compiler and execution loop VM::interpret uses.
+enum class Backend {
+    STACK,      // stack code, run by the engine chosen by Dispatch
+    REGISTER    // three-address register code with its own loop
+};
+
+// Which native code generator, if any, runs stack code.
+enum class Jit {
+    NONE,
+    BASELINE,   // the whole chunk is translated before it runs (jit.cpp)
+    TRACE       // hot loops are recorded and compiled as they are found (trace.cpp)
+};
+
+// What the stack compiler does between parsing and emitting bytecode.
+enum class OptLevel {
+    O0,         // nothing: bytecode straight from the parser (compiler.cpp)
+    O1          // parse to an Ast, optimize it (optimizer.cpp), then emit
+};
+
+#if defined(CPPLOX_DISPATCH_TAIL_CALL)
+constexpr const Dispatch DEFAULT_DISPATCH{Dispatch::TAIL_CALL};
+#elif defined(CPPLOX_DISPATCH_COMPUTED_GOTO)
+constexpr const Dispatch DEFAULT_DISPATCH{Dispatch::COMPUTED_GOTO};
+#else
+constexpr const Dispatch DEFAULT_DISPATCH{Dispatch::SWITCH};
+#endif
+
+// Labels-as-values is a GNU extension; without it the threaded engine runs the switch.
+#if defined(__GNUC__)
+#define CPPLOX_HAS_COMPUTED_GOTO 1
+#else
+#define CPPLOX_HAS_COMPUTED_GOTO 0
+#endif
+
+// The tail-call engine is only safe when every handler-to-handler call is
+// guaranteed (musttail) or at least expected (optimised build) to be a jump.
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define CPPLOX_MUSTTAIL [[clang::musttail]]
+#elif __has_cpp_attribute(gnu::musttail)
+#define CPPLOX_MUSTTAIL [[gnu::musttail]]
+#endif
+#endif
+
+#if defined(CPPLOX_MUSTTAIL)
+#define CPPLOX_HAS_TAIL_CALL 1
+#elif defined(__OPTIMIZE__)
+#define CPPLOX_MUSTTAIL
+#define CPPLOX_HAS_TAIL_CALL 1
+#else
+#define CPPLOX_MUSTTAIL
+#define CPPLOX_HAS_TAIL_CALL 0
+#endif
+
+#if defined(__GNUC__)
+#define CPPLOX_ALWAYS_INLINE [[gnu::always_inline]] inline
+#else
+#define CPPLOX_ALWAYS_INLINE inline
+#endif
 
 #endif //CPPLOX_COMMON_H
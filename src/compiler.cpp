@@ -2,145 +2,213 @@
 #include "scanner.h"
 #include <fmt/core.h>
 #include <cstdint>
+#include <algorithm>
 #include "common.h"
 #include "Disassembler.h"
+#include "optimizer.h"
+#include "peephole.h"
+
+// Indexed by TokenType; the entries must stay in enum order.
+const std::array<Compiler::ParseRule, TOKEN_TYPE_COUNT> Compiler::rules{{
+        {&Compiler::grouping, &Compiler::call,   Precedence::CALL}, // TokenType::LEFT_PAREN
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::RIGHT_PAREN
+        {&Compiler::map,      nullptr,           Precedence::NONE}, // TokenType::LEFT_BRACE
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::RIGHT_BRACE
+        {nullptr,             &Compiler::index,  Precedence::CALL}, // TokenType::LEFT_BRACKET
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::RIGHT_BRACKET
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::COLON
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::COMMA
+        {nullptr,             &Compiler::dot,    Precedence::CALL}, // TokenType::DOT
+        {&Compiler::unary,    &Compiler::binary, Precedence::TERM}, // TokenType::MINUS
+        {nullptr,             &Compiler::binary, Precedence::TERM}, // TokenType::PLUS
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::SEMICOLON
+        {nullptr,             &Compiler::binary, Precedence::FACTOR}, // TokenType::SLASH
+        {nullptr,             &Compiler::binary, Precedence::FACTOR}, // TokenType::STAR
+        {&Compiler::unary,    nullptr,           Precedence::NONE}, // TokenType::BANG
+        {nullptr,             &Compiler::binary, Precedence::EQUALITY}, // TokenType::BANG_EQUAL
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::EQUAL
+        {nullptr,             &Compiler::binary, Precedence::EQUALITY}, // TokenType::EQUAL_EQUAL
+        {nullptr,             &Compiler::binary, Precedence::COMPARISON}, // TokenType::GREATER
+        {nullptr,             &Compiler::binary, Precedence::COMPARISON}, // TokenType::GREATER_EQUAL
+        {nullptr,             &Compiler::binary, Precedence::COMPARISON}, // TokenType::LESS
+        {nullptr,             &Compiler::binary, Precedence::COMPARISON}, // TokenType::LESS_EQUAL
+        {&Compiler::variable, nullptr,           Precedence::NONE}, // TokenType::IDENTIFIER
+        {&Compiler::string,   nullptr,           Precedence::NONE}, // TokenType::STRING
+        {&Compiler::number,   nullptr,           Precedence::NONE}, // TokenType::NUMBER
+        {nullptr,             &Compiler::and_,   Precedence::AND}, // TokenType::AND
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::CLASS
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::ELSE
+        {&Compiler::literal,  nullptr,           Precedence::NONE}, // TokenType::FALSE
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::FOR
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::FUN
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::IF
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::IN
+        {&Compiler::literal,  nullptr,           Precedence::NONE}, // TokenType::NIL
+        {nullptr,             &Compiler::or_,    Precedence::OR}, // TokenType::OR
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::PRINT
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::RETURN
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::SUPER
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::THIS
+        {&Compiler::literal,  nullptr,           Precedence::NONE}, // TokenType::TRUE
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::VAR
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::WHILE
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::ERROR
+        {nullptr,             nullptr,           Precedence::NONE}, // TokenType::EOFILE
+}};
 
 Compiler::Compiler(std::string_view source, VM* vm) :
-        scanner{source}, parser{}, vm{vm}, rules{
-        {TokenType::LEFT_PAREN,    {&Compiler::grouping, nullptr,           Precedence::NONE}},
-        {TokenType::RIGHT_PAREN,   {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::LEFT_BRACE,    {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::RIGHT_BRACE,   {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::COMMA,         {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::DOT,           {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::MINUS,         {&Compiler::unary,    &Compiler::binary, Precedence::TERM}},
-        {TokenType::PLUS,          {nullptr,             &Compiler::binary, Precedence::TERM}},
-        {TokenType::SEMICOLON,     {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::SLASH,         {nullptr,             &Compiler::binary, Precedence::FACTOR}},
-        {TokenType::STAR,          {nullptr,             &Compiler::binary, Precedence::FACTOR}},
-        {TokenType::BANG,          {&Compiler::unary,    nullptr,           Precedence::NONE}},
-        {TokenType::BANG_EQUAL,    {nullptr,             &Compiler::binary, Precedence::EQUALITY}},
-        {TokenType::EQUAL,         {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::EQUAL_EQUAL,   {nullptr,             &Compiler::binary, Precedence::EQUALITY}},
-        {TokenType::GREATER,       {nullptr,             &Compiler::binary, Precedence::COMPARISON}},
-        {TokenType::GREATER_EQUAL, {nullptr,             &Compiler::binary, Precedence::COMPARISON}},
-        {TokenType::LESS,          {nullptr,             &Compiler::binary, Precedence::COMPARISON}},
-        {TokenType::LESS_EQUAL,    {nullptr,             &Compiler::binary, Precedence::COMPARISON}},
-        {TokenType::IDENTIFIER,    {&Compiler::variable, nullptr,           Precedence::NONE}},
-        {TokenType::STRING,        {&Compiler::string,   nullptr,           Precedence::NONE}},
-        {TokenType::NUMBER,        {&Compiler::number,   nullptr,           Precedence::NONE}},
-        {TokenType::AND,           {nullptr,             &Compiler::and_,   Precedence::AND}},
-        {TokenType::CLASS,         {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::ELSE,          {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::FALSE,         {&Compiler::literal,  nullptr,           Precedence::NONE}},
-        {TokenType::FOR,           {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::FUN,           {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::IF,            {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::NIL,           {&Compiler::literal,  nullptr,           Precedence::NONE}},
-        {TokenType::OR,            {nullptr,             &Compiler::or_,    Precedence::OR}},
-        {TokenType::PRINT,         {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::RETURN,        {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::SUPER,         {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::THIS,          {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::TRUE,          {&Compiler::literal,  nullptr,           Precedence::NONE}},
-        {TokenType::VAR,           {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::WHILE,         {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::ERROR,         {nullptr,             nullptr,           Precedence::NONE}},
-        {TokenType::EOFILE,        {nullptr,             nullptr,           Precedence::NONE}},
-}, compilingChunk{} {}
+        parser{source}, compilingChunk{}, vm{vm} {}
 
 bool Compiler::compile(Chunk *chunk) {
     compilingChunk = chunk;
-    advance();
+    parser.advance();
 
-    while (!match(TokenType::EOFILE)) {
-        declaration();
+    if (vm->optLevel == OptLevel::O1) {
+        Ast ast = AstParser{parser}.parse();
+        if (!parser.hadError) {
+            optimize(ast);
+            generateList(ast, ast.root);
+        }
+    } else {
+        while (!parser.match(TokenType::EOFILE)) {
+            declaration();
+        }
     }
 
-//    consume(TokenType::EOFILE, "Expect end of expression");
+//    parser.consume(TokenType::EOFILE, "Expect end of expression");
 //
     endCompiler();
     return !parser.hadError;
 }
 
-void Compiler::consume(TokenType type, std::string_view message) {
-    if (parser.current.type == type) {
-        advance();
-        return;
-    }
-
-    errorAtCurrent(message);
+Chunk *Compiler::currentChunk() {
+    return compilingChunk;
 }
 
-bool Compiler::match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
-    return true;
+void Compiler::emitByte(uint8_t byte) {
+    currentChunk()->writeChunk(byte, parser.previous.line);
 }
 
-bool Compiler::check(TokenType type) const {
-    return parser.current.type == type;
+void Compiler::emitByte(OP opcode) {
+    std::copy_backward(recent.begin(), recent.end() - 1, recent.end());
+    recent[0] = static_cast<int>(compilingChunk->code.size());
+    emitByte(to_integral(opcode));
 }
 
-void Compiler::advance() {
-    parser.previous = parser.current;
-
-    for (;;) {
-        parser.current = scanner.scanToken();
-        if (parser.current.type != TokenType::ERROR) break;
+// A function that runs off its end returns nil.
+void Compiler::emitReturn() {
+    if (function != nullptr) emitByte(OP::NIL);
+    emitByte(OP::RETURN);
+}
 
-        errorAtCurrent(parser.current.lexeme);
+// Returns the value just compiled. If that is a call's result, the call
+// becomes a tail call, which returns the callee's result for us.
+void Compiler::emitReturnValue() {
+    if (canFuse(1) && recentOp(0) == OP::CALL) {
+        compilingChunk->code[recent[0]] = to_integral(OP::TAIL_CALL);
+        return;
     }
+    emitByte(OP::RETURN);
 }
 
-void Compiler::error(std::string_view message) {
-    errorAt(parser.previous, message);
+void Compiler::emitBytes(OP opcode, uint8_t byte) {
+    emitByte(opcode);
+    emitByte(byte);
 }
 
-void Compiler::errorAt(const Token &token, std::string_view message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token.line);
-
-    if (token.type == TokenType::EOFILE) {
-        fprintf(stderr, " at end");
-    } else if (token.type == TokenType::ERROR) {
-        // Nothing.
-    } else {
-        fmt::print(stderr, " at {}", token.lexeme);
+// Emits `opcode` with a one-byte operand when `index` fits, and otherwise
+// its long form with a 16-bit one.
+void Compiler::emitIndexed(OP opcode, int index) {
+    if (index <= std::numeric_limits<uint8_t>::max()) {
+        emitBytes(opcode, index);
+        return;
     }
+    emitByte(longForm(opcode));
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
+}
 
-    fmt::print(stderr, ": {}\n", message);
-    parser.hadError = true;
+void Compiler::emitShort(OP opcode, int operand) {
+    emitByte(opcode);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
 }
 
-void Compiler::errorAtCurrent(std::string_view message) {
-    errorAt(parser.current, message);
+// Emits `opcode` with a 24-bit name constant, followed by its inline cache,
+// if it has one, empty.
+void Compiler::emitNamed(OP opcode, int constant) {
+    emitByte(opcode);
+    emitByte((constant >> 16) & 0xff);
+    emitByte((constant >> 8) & 0xff);
+    emitByte(constant & 0xff);
+    for (int i = 4; i < instructionLength(opcode); ++i) emitByte(0);
 }
 
-Chunk *Compiler::currentChunk() {
-    return compilingChunk;
+void Compiler::emitConstant(Value value) {
+    emitConstantIndex(makeConstant(value));
 }
 
-void Compiler::emitByte(uint8_t byte) {
-    currentChunk()->writeChunk(byte, parser.previous.line);
+void Compiler::emitConstantIndex(int constant) {
+    if (constant <= std::numeric_limits<uint8_t>::max()) {
+        emitBytes(OP::CONSTANT, constant);
+        return;
+    }
+    emitByte(OP::CONSTANT_LONG);
+    emitByte((constant >> 16) & 0xff);
+    emitByte((constant >> 8) & 0xff);
+    emitByte(constant & 0xff);
 }
 
-void Compiler::emitByte(OP opcode) {
-    emitByte(to_integral(opcode));
+bool Compiler::canFuse(int count) const {
+    return recent[count - 1] != -1 && lastJumpTarget <= recent[count - 1];
 }
 
-void Compiler::emitReturn() {
-    emitByte(OP::RETURN);
+OP Compiler::recentOp(int index) const {
+    return static_cast<OP>(compilingChunk->code[recent[index]]);
 }
 
-void Compiler::emitBytes(OP opcode, uint8_t byte) {
-    emitByte(opcode);
-    emitByte(byte);
+// Pops an expression statement's value. `local = value; POP` becomes
+// SET_LOCAL_POP, and `local = local + constant; POP` becomes ADD_TO_LOCAL.
+void Compiler::emitPop() {
+    if (!canFuse(1) || recentOp(0) != OP::SET_LOCAL) {
+        emitByte(OP::POP);
+        return;
+    }
+
+    auto &code = compilingChunk->code;
+    auto slot = code[recent[0] + 1];
+    if (canFuse(4) && recentOp(3) == OP::GET_LOCAL && code[recent[3] + 1] == slot &&
+        recentOp(2) == OP::CONSTANT && recentOp(1) == OP::ADD) {
+        auto constant = code[recent[2] + 1];
+        compilingChunk->truncate(recent[3]);
+        recent = {-1, -1, -1, -1};
+        emitBytes(OP::ADD_TO_LOCAL, slot);
+        emitByte(constant);
+        return;
+    }
+
+    code[recent[0]] = to_integral(OP::SET_LOCAL_POP);
 }
 
-void Compiler::emitConstant(Value value) {
-    emitBytes(OP::CONSTANT, makeConstant(value));
+// Emits the jump out of a condition, which pops the condition. A comparison
+// right before it is folded in, so the boolean is never materialised.
+int Compiler::emitConditionJump() {
+    if (canFuse(1)) {
+        OP fused;
+        switch (recentOp(0)) {
+            case OP::LESS:          fused = OP::JUMP_IF_NOT_LESS; break;
+            case OP::LESS_EQUAL:    fused = OP::JUMP_IF_NOT_LESS_EQUAL; break;
+            case OP::GREATER:       fused = OP::JUMP_IF_NOT_GREATER; break;
+            case OP::GREATER_EQUAL: fused = OP::JUMP_IF_NOT_GREATER_EQUAL; break;
+            default:                fused = OP::POP_JUMP_IF_FALSE; break;
+        }
+        if (fused != OP::POP_JUMP_IF_FALSE) {
+            compilingChunk->truncate(recent[0]);
+            recent = {-1, -1, -1, -1};
+        }
+        return emitJump(fused);
+    }
+    return emitJump(OP::POP_JUMP_IF_FALSE);
 }
 
 int Compiler::emitJump(OP op) {
@@ -151,24 +219,73 @@ int Compiler::emitJump(OP op) {
 }
 
 void Compiler::emitLoop(unsigned long start) {
-    emitByte(OP::LOOP);
-
-    auto offset = compilingChunk->code.size() - start + 2;
-    if (offset > std::numeric_limits<uint16_t>::max()) error("Loop body too large");
+    auto offset = compilingChunk->code.size() - start + 3;
+    if (offset <= std::numeric_limits<uint16_t>::max()) {
+        emitByte(OP::LOOP);
+        emitByte((offset >> 8) & 0xff);
+        emitByte(offset & 0xff);
+        return;
+    }
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    // The distance back is known, so a long loop needs no relaxing.
+    auto distance = -static_cast<int32_t>(offset + 2);
+    emitByte(OP::JUMP_LONG);
+    for (int shift = 24; shift >= 0; shift -= 8) emitByte((distance >> shift) & 0xff);
 }
 
 void Compiler::endCompiler() {
     emitReturn();
+    if (!parser.hadError) {
+        if (vm->peephole) {
+            vm->peepholeStats += peephole(*currentChunk(), farJumps);
+        } else if (!farJumps.empty()) {
+            relaxJumps(*currentChunk(), farJumps);
+        }
+    }
     if constexpr (DEBUG_PRINT_CODE) {
         if (!parser.hadError) {
-            Disassembler::disassembleChunk(*currentChunk(), "Code");
+            Disassembler::disassembleChunk(*currentChunk(), function != nullptr ? function->name->str() : "Code");
         }
     }
 }
 
+// Switches to compiling a new function. Its constant goes into the enclosing
+// pool first: from there on the collector can reach it and everything its
+// own pool collects.
+EnclosingFunction Compiler::beginFunction(const Token &name) {
+    auto nested = vm->newFunction();
+    int constant = makeConstant(obj_val(nested));
+    nested->name = copyString(name.lexeme);
+    vm->writeBarrier(nested, nested->name);
+
+    EnclosingFunction enclosing{compilingChunk, function, std::move(current), recent, lastJumpTarget,
+                                std::move(farJumps), constant};
+    compilingChunk = nested->chunk;
+    function = nested;
+    current = {};
+    recent = {-1, -1, -1, -1};
+    lastJumpTarget = 0;
+    farJumps = {};
+
+    beginScope();
+    current.push() = Local{Token{}, 0}; // slot 0 holds the callee
+    return enclosing;
+}
+
+// Finishes the function's chunk and leaves the function on the enclosing
+// function's stack.
+void Compiler::endFunction(EnclosingFunction &enclosing) {
+    endCompiler();
+
+    compilingChunk = enclosing.chunk;
+    function = enclosing.function;
+    current = std::move(enclosing.locals);
+    recent = enclosing.recent;
+    lastJumpTarget = enclosing.lastJumpTarget;
+    farJumps = std::move(enclosing.farJumps);
+    emitConstantIndex(enclosing.constant);
+}
+
 void Compiler::beginScope() {
     current.scopeDepth++;
 }
@@ -183,38 +300,95 @@ void Compiler::endScope() {
 }
 
 void Compiler::declaration() {
-    if (match(TokenType::VAR)) {
+    if (parser.match(TokenType::CLASS)) {
+        classDeclaration();
+    } else if (parser.match(TokenType::FUN)) {
+        funDeclaration();
+    } else if (parser.match(TokenType::VAR)) {
         varDeclaration();
     } else {
         statement();
     }
 
-    if (parser.panicMode) synchronize();
+    if (parser.panicMode) parser.synchronize();
 }
 
 void Compiler::varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name");
+    varInitializer(parseVariable("Expect variable name"));
+}
 
-    if (match(TokenType::EQUAL)) {
+void Compiler::varInitializer(int global) {
+    if (parser.match(TokenType::EQUAL)) {
         expression();
     } else {
         emitByte(OP::NIL);
     }
-    consume(TokenType::SEMICOLON, "Expect ';' after variable declaration");
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after variable declaration");
 
     defineVariable(global);
 }
 
+// Classes are records: no methods, no initializer, and instances gain
+// fields by assignment.
+void Compiler::classDeclaration() {
+    int global = parseVariable("Expect class name.");
+    emitNamed(OP::CLASS, identifierConstant(parser.previous));
+    defineVariable(global);
+    parser.consume(TokenType::LEFT_BRACE, "Expect '{' before class body.");
+    parser.consume(TokenType::RIGHT_BRACE, "Expect '}' after class body.");
+}
+
+// The name is initialized before the body, so the function can refer to itself.
+void Compiler::funDeclaration() {
+    int global = parseVariable("Expect function name.");
+    markInitialized();
+    functionBody(parser.previous);
+    defineVariable(global);
+}
+
+void Compiler::functionBody(const Token &name) {
+    auto enclosing = beginFunction(name);
+
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
+    if (!parser.check(TokenType::RIGHT_PAREN)) {
+        do {
+            if (++function->arity > 255) parser.errorAtCurrent("Can't have more than 255 parameters.");
+            parser.consume(TokenType::IDENTIFIER, "Expect parameter name.");
+            declareVariable();
+            markInitialized();
+        } while (parser.match(TokenType::COMMA));
+    }
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
+    parser.consume(TokenType::LEFT_BRACE, "Expect '{' before function body.");
+    block();
+
+    endFunction(enclosing);
+}
+
+void Compiler::returnStatement() {
+    if (function == nullptr) parser.error("Can't return from top-level code.");
+
+    if (parser.match(TokenType::SEMICOLON)) {
+        emitReturn();
+        return;
+    }
+    expression();
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after return value.");
+    emitReturnValue();
+}
+
 void Compiler::statement() {
-    if (match(TokenType::PRINT)) {
+    if (parser.match(TokenType::PRINT)) {
         printStatement();
-    } else if (match(TokenType::FOR)) {
+    } else if (parser.match(TokenType::FOR)) {
         forStatement();
-    } else if (match(TokenType::IF)) {
+    } else if (parser.match(TokenType::IF)) {
         ifStatement();
-    } else if (match(TokenType::WHILE)) {
+    } else if (parser.match(TokenType::RETURN)) {
+        returnStatement();
+    } else if (parser.match(TokenType::WHILE)) {
         whileStatement();
-    } else if (match(TokenType::LEFT_BRACE)) {
+    } else if (parser.match(TokenType::LEFT_BRACE)) {
         beginScope();
         block();
         endScope();
@@ -225,37 +399,14 @@ void Compiler::statement() {
 
 void Compiler::printStatement() {
     expression();
-    consume(TokenType::SEMICOLON, "Expect ';' after value.");
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after value.");
     emitByte(OP::PRINT);
 }
 
 void Compiler::expressionStatement() {
     expression();
-    consume(TokenType::SEMICOLON, "Expect ';' after expression");
-    emitByte(OP::POP);
-}
-
-void Compiler::synchronize() {
-    parser.panicMode = false;
-
-    while (parser.current.type != TokenType::EOFILE) {
-        if (parser.previous.type == TokenType::SEMICOLON) return;
-        switch (parser.current.type) {
-            case TokenType::CLASS:
-            case TokenType::FUN:
-            case TokenType::VAR:
-            case TokenType::FOR:
-            case TokenType::IF:
-            case TokenType::WHILE:
-            case TokenType::PRINT:
-            case TokenType::RETURN:
-                return;
-
-            default:
-                ; // do nothin
-        }
-        advance();
-    }
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after expression");
+    emitPop();
 }
 
 void Compiler::expression() {
@@ -263,10 +414,10 @@ void Compiler::expression() {
 }
 
 void Compiler::block() {
-    while(!check(TokenType::RIGHT_BRACE) && !check(TokenType::EOFILE)) {
+    while(!parser.check(TokenType::RIGHT_BRACE) && !parser.check(TokenType::EOFILE)) {
         declaration();
     }
-    consume(TokenType::RIGHT_BRACE, "Expect, '}' after block.");
+    parser.consume(TokenType::RIGHT_BRACE, "Expect, '}' after block.");
 }
 
 void Compiler::declareVariable() {
@@ -282,7 +433,7 @@ void Compiler::declareVariable() {
         }
 
         if (identifiersEqual(name, local.name)) {
-            error("Already a variable with this name in this scope.");
+            parser.error("Already a variable with this name in this scope.");
         }
     }
 
@@ -290,12 +441,12 @@ void Compiler::declareVariable() {
 }
 
 void Compiler::addLocal(Token name) {
-    if (current.localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+    if (current.localCount == UINT16_COUNT) {
+        parser.error("Too many local variables in function.");
         return;
     }
 
-    Local& local = current.locals[current.localCount++];
+    Local& local = current.push();
     local.name = name;
     local.depth = -1;
 }
@@ -323,22 +474,22 @@ void Compiler::namedVariable(Token name, bool canAssign) {
         getOp = OP::GET_LOCAL;
         setOp = OP::SET_LOCAL;
     } else {
-        arg = identifierConstant(name);
-        getOp = OP::GET_GLOBAL;
-        setOp = OP::SET_GLOBAL;
+        arg = globalSlot(name);
+        getOp = OP::GET_GLOBAL_SLOT;
+        setOp = OP::SET_GLOBAL_SLOT;
     }
 
-    if (canAssign && match(TokenType::EQUAL)) {
+    if (canAssign && parser.match(TokenType::EQUAL)) {
         expression();
-        emitBytes(setOp, arg);
+        emitIndexed(setOp, arg);
     } else {
-        emitBytes(getOp, arg);
+        emitIndexed(getOp, arg);
     }
 }
 
 void Compiler::grouping(bool canAssign) {
     expression();
-    consume(TokenType::RIGHT_PAREN, "Expect ')' after expression.");
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 void Compiler::unary(bool canAssign) {
@@ -361,42 +512,35 @@ void Compiler::unary(bool canAssign) {
 
 void Compiler::binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
-    ParseRule *rule = getRule(operatorType);
+    const ParseRule *rule = getRule(operatorType);
     parsePrecedence(static_cast<Precedence>(to_integral(rule->precedence) + 1));
 
+    emitByte(binaryOp(operatorType));
+}
+
+OP Compiler::binaryOp(TokenType operatorType) {
     switch (operatorType) {
         case TokenType::BANG_EQUAL:
-            emitByte(OP::NOT_EQUAL);
-            break;
+            return OP::NOT_EQUAL;
         case TokenType::EQUAL_EQUAL:
-            emitByte(OP::EQUAL);
-            break;
+            return OP::EQUAL;
         case TokenType::GREATER:
-            emitByte(OP::GREATER);
-            break;
+            return OP::GREATER;
         case TokenType::GREATER_EQUAL:
-            emitByte(OP::GREATER_EQUAL);
-            break;
+            return OP::GREATER_EQUAL;
         case TokenType::LESS:
-            emitByte(OP::LESS);
-            break;
+            return OP::LESS;
         case TokenType::LESS_EQUAL:
-            emitByte(OP::LESS_EQUAL);
-            break;
+            return OP::LESS_EQUAL;
         case TokenType::PLUS:
-            emitByte(OP::ADD);
-            break;
+            return OP::ADD;
         case TokenType::MINUS:
-            emitByte(OP::SUBTRACT);
-            break;
+            return OP::SUBTRACT;
         case TokenType::STAR:
-            emitByte(OP::MULTIPLY);
-            break;
+            return OP::MULTIPLY;
         case TokenType::SLASH:
-            emitByte(OP::DIVIDE);
-            break;
         default:
-            return; // unreachable
+            return OP::DIVIDE;
     }
 }
 
@@ -433,20 +577,77 @@ void Compiler::or_(bool canAssign) {
     patchJump(endJump);
 }
 
-uint8_t Compiler::makeConstant(Value value) {
+void Compiler::call(bool canAssign) {
+    uint8_t argc = argumentList();
+    emitBytes(OP::CALL, argc);
+}
+
+void Compiler::dot(bool canAssign) {
+    parser.consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
+    int name = identifierConstant(parser.previous);
+    if (canAssign && parser.match(TokenType::EQUAL)) {
+        expression();
+        emitNamed(OP::SET_FIELD, name);
+    } else {
+        emitNamed(OP::GET_FIELD, name);
+    }
+}
+
+void Compiler::map(bool canAssign) {
+    int count = 0;
+    if (!parser.check(TokenType::RIGHT_BRACE)) {
+        do {
+            expression();
+            parser.consume(TokenType::COLON, "Expect ':' after map key.");
+            expression();
+            if (count == std::numeric_limits<uint16_t>::max()) parser.error("Can't have more than 65535 entries in a map literal.");
+            count++;
+        } while (parser.match(TokenType::COMMA));
+    }
+    parser.consume(TokenType::RIGHT_BRACE, "Expect '}' after map entries.");
+    emitShort(OP::BUILD_MAP, count);
+}
+
+void Compiler::index(bool canAssign) {
+    expression();
+    parser.consume(TokenType::RIGHT_BRACKET, "Expect ']' after index.");
+    if (canAssign && parser.match(TokenType::EQUAL)) {
+        expression();
+        emitByte(OP::SET_INDEX);
+    } else {
+        emitByte(OP::GET_INDEX);
+    }
+}
+
+uint8_t Compiler::argumentList() {
+    uint8_t argc = 0;
+    if (!parser.check(TokenType::RIGHT_PAREN)) {
+        do {
+            expression();
+            if (argc == 255) parser.error("Can't have more than 255 arguments.");
+            argc++;
+        } while (parser.match(TokenType::COMMA));
+    }
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after arguments.");
+    return argc;
+}
+
+int Compiler::makeConstant(Value value) {
     int constant = currentChunk()->addConstant(value);
-    if (constant > std::numeric_limits<uint8_t>::max()) {
-        error("Too many constants in one chunk.");
+    if (constant >= 1 << 24) {
+        parser.error("Too many constants in one chunk.");
         return 0;
     }
+    // A function's pool is an object field like any other.
+    if (function != nullptr && isObj(value)) vm->writeBarrier(function, asObject(value));
     return constant;
 }
 
 void Compiler::parsePrecedence(Precedence precedence) {
-    advance();
+    parser.advance();
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
     if (prefixRule == nullptr) {
-        error("Expect expression");
+        parser.error("Expect expression");
         return;
     }
 
@@ -454,16 +655,25 @@ void Compiler::parsePrecedence(Precedence precedence) {
     (this->*prefixRule)(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
+        parser.advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
         (this->*infixRule)(canAssign);
     }
 }
 
-uint8_t Compiler::identifierConstant(const Token& token) {
+int Compiler::identifierConstant(const Token& token) {
     return makeConstant(obj_val(copyString(token.lexeme)));
 }
 
+int Compiler::globalSlot(const Token &name) {
+    int slot = vm->resolveGlobal(name.lexeme);
+    if (slot > std::numeric_limits<uint16_t>::max()) {
+        parser.error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
 bool Compiler::identifiersEqual(const Token &a, const Token &b) {
     return a.lexeme == b.lexeme;
 }
@@ -473,7 +683,7 @@ int Compiler::resolveLocal(Token &name){
         auto &local = current.locals[i];
         if (identifiersEqual(name, local.name)) {
             if (local.depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                parser.error("Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -482,83 +692,91 @@ int Compiler::resolveLocal(Token &name){
     return -1;
 }
 
-uint8_t Compiler::parseVariable(std::string_view message) {
-    consume(TokenType::IDENTIFIER, message);
+int Compiler::parseVariable(std::string_view message) {
+    parser.consume(TokenType::IDENTIFIER, message);
 
     declareVariable();
     if (current.scopeDepth > 0) return 0;
 
-    return identifierConstant(parser.previous);
+    return globalSlot(parser.previous);
 }
 
-Compiler::ParseRule *Compiler::getRule(TokenType type) {
-    return &rules[type];
+const Compiler::ParseRule *Compiler::getRule(TokenType type) {
+    return &rules[to_integral(type)];
 }
 
 ObjString* Compiler::copyString(std::string_view value) {
-    auto [it, val] = vm->strings.emplace(value);
-    auto view = std::string_view(*it);
-    auto obj = new ObjString(ObjType::STRING, vm->objects, view);
-    vm->objects = obj;
-    return obj;
+    return vm->copyString(value);
 }
 
-void Compiler::defineVariable(uint8_t global) {
+void Compiler::defineVariable(int global) {
     if (current.scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP::DEFINE_GLOBAL, global);
+    emitIndexed(OP::DEFINE_GLOBAL_SLOT, global);
 }
 
 void Compiler::markInitialized() {
+    if (current.scopeDepth == 0) return;
     current.locals[current.localCount - 1].depth = current.scopeDepth;
 }
 
 void Compiler::ifStatement() {
-    consume(TokenType::LEFT_PAREN, "Expect '(' after 'if'.");
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'if'.");
     expression();
-    consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP::JUMP_IF_FALSE);
-    emitByte(OP::POP);
+    int thenJump = emitConditionJump();
     statement();
-    int elseJump = emitJump(OP::JUMP);
-    patchJump(thenJump);
-    emitByte(OP::POP);
 
-    if (match(TokenType::ELSE)) statement();
-    patchJump(elseJump);
+    if (parser.match(TokenType::ELSE)) {
+        int elseJump = emitJump(OP::JUMP);
+        patchJump(thenJump);
+        statement();
+        patchJump(elseJump);
+    } else {
+        patchJump(thenJump);
+    }
 }
 
 void Compiler::forStatement() {
     beginScope();
-    consume(TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TokenType::SEMICOLON)) {
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
+    if (parser.match(TokenType::SEMICOLON)) {
         // Non initializer.
-    } else if (match(TokenType::VAR)) {
-        varDeclaration();
+    } else if (parser.match(TokenType::VAR)) {
+        parser.consume(TokenType::IDENTIFIER, "Expect variable name");
+        Token name = parser.previous;
+        if (parser.match(TokenType::IN)) {
+            forInLoop(name);
+            endScope();
+            return;
+        }
+        declareVariable();
+        varInitializer(0);
     } else {
         expressionStatement();
     }
 
     auto loopStart = compilingChunk->code.size();
+    lastJumpTarget = static_cast<int>(loopStart);
     int exitJump = -1;
-    if (!match(TokenType::SEMICOLON)) {
+    if (!parser.match(TokenType::SEMICOLON)) {
         expression();
-        consume(TokenType::SEMICOLON, "Expect ';' after loop conditions.");
+        parser.consume(TokenType::SEMICOLON, "Expect ';' after loop conditions.");
 
-        exitJump = emitJump(OP::JUMP_IF_FALSE);
-        emitByte(OP::POP);
+        exitJump = emitConditionJump();
     }
 
-    if (!match(TokenType::RIGHT_PAREN)) {
+    if (!parser.match(TokenType::RIGHT_PAREN)) {
         int bodyJump = emitJump(OP::JUMP);
         auto incrementStart = compilingChunk->code.size();
+        lastJumpTarget = static_cast<int>(incrementStart);
         expression();
-        emitByte(OP::POP);
-        consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
+        emitPop();
+        parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
 
         emitLoop(loopStart);
         loopStart = incrementStart;
@@ -568,36 +786,315 @@ void Compiler::forStatement() {
     statement();
     emitLoop(loopStart);
 
-    if (exitJump != -1) {
-        patchJump(exitJump);
-        emitByte(OP::POP);
-    }
+    if (exitJump != -1) patchJump(exitJump);
     endScope();
 }
 
+// for (var key in map) body
+void Compiler::forInLoop(const Token &name) {
+    expression();
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
+    int slot = forInLocals(name);
+
+    auto loopStart = compilingChunk->code.size();
+    lastJumpTarget = static_cast<int>(loopStart);
+    emitShort(OP::FOR_IN, slot);
+    int exitJump = emitJump(OP::POP_JUMP_IF_FALSE);
+    statement();
+    emitLoop(loopStart);
+    patchJump(exitJump);
+}
+
+// The map just pushed becomes a hidden local, followed by the slot cursor
+// FOR_IN advances and the loop variable it assigns. Returns the map's slot.
+int Compiler::forInLocals(const Token &name) {
+    int slot = current.localCount;
+    addLocal(Token{});
+    markInitialized();
+    emitConstant(number_val(0));
+    addLocal(Token{});
+    markInitialized();
+    emitByte(OP::NIL);
+    addLocal(name);
+    markInitialized();
+    return slot;
+}
+
 void Compiler::whileStatement() {
     auto loopStart = compilingChunk->code.size();
-    consume(TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
+    lastJumpTarget = static_cast<int>(loopStart);
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
-    consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP::JUMP_IF_FALSE);
-    emitByte(OP::POP);
+    int exitJump = emitConditionJump();
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP::POP);
 }
 
 void Compiler::patchJump(int offset) {
-    auto jumpsize = compilingChunk->code.size() - offset - 2;
+    auto target = static_cast<int>(compilingChunk->code.size());
+    auto jumpsize = target - offset - 2;
 
     if (jumpsize > std::numeric_limits<uint16_t>::max()) {
-        error("Too much code to jump over.");
+        farJumps[offset - 1] = target;
+        jumpsize = 0;
     }
 
     compilingChunk->code[offset] = (jumpsize >> 8) & 0xff;
     compilingChunk->code[offset + 1] = jumpsize & 0xff;
+    lastJumpTarget = target;
+}
+
+
+// -O1: bytecode from the optimized tree, through the same emitters (and so
+// the same superinstruction fusing) as the single-pass path. Emitters take
+// the line from parser.previous, so each node's token becomes the previous
+// token before its bytes go out.
+
+void Compiler::generateList(const Ast &ast, NodeId first) {
+    for (NodeId id = first; id != NO_NODE; id = ast[id].next) generate(ast, id);
+}
+
+void Compiler::generate(const Ast &ast, NodeId id) {
+    const Node &node = ast[id];
+    switch (node.kind) {
+        case NodeKind::PRINT:
+            generateExpression(ast, node.a);
+            parser.previous = node.token;
+            emitByte(OP::PRINT);
+            break;
+        case NodeKind::EXPRESSION:
+            generateExpression(ast, node.a);
+            parser.previous = node.token;
+            emitPop();
+            break;
+        case NodeKind::VAR: {
+            parser.previous = node.token;
+            declareVariable();
+            int global = current.scopeDepth > 0 ? 0 : globalSlot(node.token);
+            if (node.a != NO_NODE) {
+                generateExpression(ast, node.a);
+            } else {
+                emitByte(OP::NIL);
+            }
+            defineVariable(global);
+            break;
+        }
+        case NodeKind::FUN: {
+            parser.previous = node.token;
+            declareVariable();
+            int global = current.scopeDepth > 0 ? 0 : globalSlot(node.token);
+            markInitialized();
+            auto enclosing = beginFunction(node.token);
+            for (NodeId parameter = node.a; parameter != NO_NODE; parameter = ast[parameter].next) {
+                ++function->arity;
+                parser.previous = ast[parameter].token;
+                declareVariable();
+                markInitialized();
+            }
+            generateList(ast, node.b);
+            endFunction(enclosing);
+            defineVariable(global);
+            break;
+        }
+        case NodeKind::CLASS: {
+            parser.previous = node.token;
+            declareVariable();
+            int global = current.scopeDepth > 0 ? 0 : globalSlot(node.token);
+            emitNamed(OP::CLASS, identifierConstant(node.token));
+            defineVariable(global);
+            break;
+        }
+        case NodeKind::RETURN:
+            if (node.a == NO_NODE) {
+                parser.previous = node.token;
+                emitReturn();
+            } else {
+                generateExpression(ast, node.a);
+                parser.previous = node.token;
+                emitReturnValue();
+            }
+            break;
+        case NodeKind::BLOCK:
+            beginScope();
+            generateList(ast, node.a);
+            endScope();
+            break;
+        case NodeKind::IF: {
+            generateExpression(ast, node.a);
+            int thenJump = emitConditionJump();
+            generate(ast, node.b);
+            if (node.c != NO_NODE) {
+                int elseJump = emitJump(OP::JUMP);
+                patchJump(thenJump);
+                generate(ast, node.c);
+                patchJump(elseJump);
+            } else {
+                patchJump(thenJump);
+            }
+            break;
+        }
+        case NodeKind::WHILE: {
+            auto loopStart = compilingChunk->code.size();
+            lastJumpTarget = static_cast<int>(loopStart);
+            int exitJump = -1;
+            if (node.a != NO_NODE) {
+                generateExpression(ast, node.a);
+                exitJump = emitConditionJump();
+            }
+            generate(ast, node.b);
+            emitLoop(loopStart);
+            if (exitJump != -1) patchJump(exitJump);
+            break;
+        }
+        case NodeKind::FOR: {
+            beginScope();
+            if (node.a != NO_NODE) generate(ast, node.a);
+
+            auto loopStart = compilingChunk->code.size();
+            lastJumpTarget = static_cast<int>(loopStart);
+            int exitJump = -1;
+            if (node.b != NO_NODE) {
+                generateExpression(ast, node.b);
+                exitJump = emitConditionJump();
+            }
+
+            if (node.c != NO_NODE) {
+                int bodyJump = emitJump(OP::JUMP);
+                auto incrementStart = compilingChunk->code.size();
+                lastJumpTarget = static_cast<int>(incrementStart);
+                generateExpression(ast, node.c);
+                emitPop();
+                emitLoop(loopStart);
+                loopStart = incrementStart;
+                patchJump(bodyJump);
+            }
+
+            generate(ast, node.d);
+            emitLoop(loopStart);
+
+            if (exitJump != -1) patchJump(exitJump);
+            endScope();
+            break;
+        }
+        case NodeKind::FOR_IN: {
+            beginScope();
+            generateExpression(ast, node.a);
+            parser.previous = node.token;
+            int slot = forInLocals(node.token);
+
+            auto loopStart = compilingChunk->code.size();
+            lastJumpTarget = static_cast<int>(loopStart);
+            emitShort(OP::FOR_IN, slot);
+            int exitJump = emitJump(OP::POP_JUMP_IF_FALSE);
+            generate(ast, node.b);
+            emitLoop(loopStart);
+            patchJump(exitJump);
+            endScope();
+            break;
+        }
+        default:
+            break;
+    }
 }
 
+void Compiler::generateExpression(const Ast &ast, NodeId id) {
+    const Node &node = ast[id];
+    switch (node.kind) {
+        case NodeKind::NUMBER:
+            parser.previous = node.token;
+            emitConstant(number_val(node.number));
+            break;
+        case NodeKind::STRING:
+            parser.previous = node.token;
+            emitConstant(obj_val(copyString(node.text)));
+            break;
+        case NodeKind::TRUE:
+        case NodeKind::FALSE:
+        case NodeKind::NIL:
+            parser.previous = node.token;
+            emitByte(node.kind == NodeKind::TRUE ? OP::TRUE : node.kind == NodeKind::FALSE ? OP::FALSE : OP::NIL);
+            break;
+        case NodeKind::VARIABLE:
+        case NodeKind::ASSIGN: {
+            if (node.kind == NodeKind::ASSIGN) generateExpression(ast, node.a);
+            parser.previous = node.token;
+            Token name = node.token;
+            int arg = resolveLocal(name);
+            bool local = arg != -1;
+            if (!local) arg = globalSlot(name);
+            OP op;
+            if (node.kind == NodeKind::ASSIGN) {
+                op = local ? OP::SET_LOCAL : OP::SET_GLOBAL_SLOT;
+            } else {
+                op = local ? OP::GET_LOCAL : OP::GET_GLOBAL_SLOT;
+            }
+            emitIndexed(op, arg);
+            break;
+        }
+        case NodeKind::UNARY:
+            generateExpression(ast, node.a);
+            parser.previous = node.token;
+            emitByte(node.token.type == TokenType::MINUS ? OP::NEGATE : OP::NOT);
+            break;
+        case NodeKind::BINARY:
+            generateExpression(ast, node.a);
+            generateExpression(ast, node.b);
+            parser.previous = node.token;
+            emitByte(binaryOp(node.token.type));
+            break;
+        case NodeKind::AND:
+        case NodeKind::OR: {
+            generateExpression(ast, node.a);
+            parser.previous = node.token;
+            int endJump = emitJump(node.kind == NodeKind::AND ? OP::JUMP_IF_FALSE : OP::JUMP_IF_TRUE);
+            emitByte(OP::POP);
+            generateExpression(ast, node.b);
+            patchJump(endJump);
+            break;
+        }
+        case NodeKind::CALL: {
+            generateExpression(ast, node.a);
+            int argc = 0;
+            for (NodeId argument = node.b; argument != NO_NODE; argument = ast[argument].next, ++argc) {
+                generateExpression(ast, argument);
+            }
+            parser.previous = node.token;
+            emitBytes(OP::CALL, argc);
+            break;
+        }
+        case NodeKind::GET:
+            generateExpression(ast, node.a);
+            parser.previous = node.token;
+            emitNamed(OP::GET_FIELD, identifierConstant(node.token));
+            break;
+        case NodeKind::SET:
+            generateExpression(ast, node.a);
+            generateExpression(ast, node.b);
+            parser.previous = node.token;
+            emitNamed(OP::SET_FIELD, identifierConstant(node.token));
+            break;
+        case NodeKind::MAP: {
+            int count = 0;
+            for (NodeId entry = node.b; entry != NO_NODE; entry = ast[entry].next, ++count) {
+                generateExpression(ast, entry);
+            }
+            parser.previous = node.token;
+            emitShort(OP::BUILD_MAP, count / 2);
+            break;
+        }
+        case NodeKind::INDEX:
+        case NodeKind::SET_INDEX:
+            generateExpression(ast, node.a);
+            generateExpression(ast, node.b);
+            if (node.kind == NodeKind::SET_INDEX) generateExpression(ast, node.c);
+            parser.previous = node.token;
+            emitByte(node.kind == NodeKind::INDEX ? OP::GET_INDEX : OP::SET_INDEX);
+            break;
+        default:
+            break;
+    }
+}
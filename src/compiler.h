@@ -5,59 +5,67 @@
 #include <string_view>
 #include "chunk.h"
 #include "scanner.h"
+#include "parser.h"
+#include "ast.h"
 #include "VM.h"
 #include "common.h"
 #include <type_traits>
-#include <map>
+#include <array>
+#include <vector>
 #include <cstdint>
 
 
-enum class Precedence {
-    NONE,
-    ASSIGNMENT,  // =
-    OR,          // or
-    AND,         // and
-    EQUALITY,    // == !=
-    COMPARISON,  // < > <= >=
-    TERM,        // + -
-    FACTOR,      // * /
-    UNARY,       // ! -
-    CALL,        // . ()
-    PRIMARY
-};
-
-
-struct Parser {
-    Token current{};
-    Token previous{};
-    bool hadError{};
-    bool panicMode{};
-};
-
 struct Local {
     Token name;
     int depth{};
 };
 
 struct CompilerLocals {
-    Local locals[UINT8_COUNT];
+    // Entries past localCount are left over from closed scopes.
+    std::vector<Local> locals;
     int localCount{};
     int scopeDepth{};
+
+    Local &push() {
+        if (localCount == static_cast<int>(locals.size())) locals.emplace_back();
+        return locals[localCount++];
+    }
+};
+
+// The state the compiler keeps for the function being compiled, parked
+// while a function nested in it is compiled.
+struct EnclosingFunction {
+    Chunk *chunk;
+    ObjFunction *function;
+    CompilerLocals locals;
+    std::array<int, 4> recent;
+    int lastJumpTarget;
+    FarJumps farJumps;
+    // The nested function's index in the enclosing constant pool.
+    int constant;
 };
 
 class Compiler {
     Parser parser;
-    Scanner scanner;
     Chunk *compilingChunk;
     VM *vm;
+    // The function being compiled, nullptr for the script.
+    ObjFunction *function{};
     CompilerLocals current{};
+    // Start offsets of the last few instructions, newest first (-1 if
+    // unknown), and the highest offset any jump lands on. Fusing may only
+    // swallow instructions that no jump lands inside of.
+    std::array<int, 4> recent{-1, -1, -1, -1};
+    int lastJumpTarget{};
+    // Forward jumps too long for their 16-bit operand; endCompiler relaxes them.
+    FarJumps farJumps;
 
 //    Compiler functions
-    void advance();
+    void endCompiler();
 
-    void consume(TokenType type, std::string_view message);
+    EnclosingFunction beginFunction(const Token &name);
 
-    void endCompiler();
+    void endFunction(EnclosingFunction &enclosing);
 
     void beginScope();
 
@@ -82,21 +90,27 @@ class Compiler {
 
     void binary(bool canAssign);
 
+    static OP binaryOp(TokenType operatorType);
+
     void literal(bool canAssign);
 
     void and_(bool canAssign);
 
     void or_(bool canAssign);
 
-    uint8_t makeConstant(Value value);
+    void call(bool canAssign);
 
-    void string(bool canAssign);
+    void dot(bool canAssign);
 
-    void error(std::string_view message);
+    void map(bool canAssign);
 
-    void errorAt(const Token &token, std::string_view message);
+    void index(bool canAssign);
 
-    void errorAtCurrent(std::string_view message);
+    uint8_t argumentList();
+
+    int makeConstant(Value value);
+
+    void string(bool canAssign);
 
     void emitByte(uint8_t byte);
 
@@ -104,12 +118,37 @@ class Compiler {
 
     void emitReturn();
 
+    void emitReturnValue();
+
     void emitBytes(OP opcode, uint8_t byte);
 
+    void emitIndexed(OP opcode, int index);
+
+    void emitShort(OP opcode, int operand);
+
+    void emitNamed(OP opcode, int constant);
+
     void emitConstant(Value value);
 
+    void emitConstantIndex(int constant);
+
+    bool canFuse(int count) const;
+
+    OP recentOp(int index) const;
+
+    void emitPop();
+
+    int emitConditionJump();
+
     Chunk *currentChunk();
 
+//  Code generation from an optimized Ast (-O1)
+    void generateList(const Ast &ast, NodeId first);
+
+    void generate(const Ast &ast, NodeId id);
+
+    void generateExpression(const Ast &ast, NodeId id);
+
     using ParseFn = void (Compiler::*)(bool canAssign);
 
     struct ParseRule {
@@ -118,9 +157,9 @@ class Compiler {
         Precedence precedence;
     };
 
-    std::map<TokenType, ParseRule> rules;
+    static const std::array<ParseRule, TOKEN_TYPE_COUNT> rules;
 
-    ParseRule *getRule(TokenType type);
+    static const ParseRule *getRule(TokenType type);
 
 public:
     explicit Compiler(std::string_view source, VM *vm);
@@ -135,25 +174,31 @@ public:
 
     void printStatement();
 
-    bool match(TokenType type);
+    void expressionStatement();
 
-    [[nodiscard]] bool check(TokenType type) const;
+    void varDeclaration();
 
-    void expressionStatement();
+    void varInitializer(int global);
 
-    void synchronize();
+    void classDeclaration();
 
-    void varDeclaration();
+    void funDeclaration();
+
+    void functionBody(const Token &name);
 
-    uint8_t parseVariable(std::string_view message);
+    void returnStatement();
 
-    uint8_t identifierConstant(const Token &token);
+    int parseVariable(std::string_view message);
+
+    int identifierConstant(const Token &token);
+
+    int globalSlot(const Token &name);
 
     static bool identifiersEqual(const Token &a, const Token &b);
 
     int resolveLocal(Token &name);
 
-    void defineVariable(uint8_t global);
+    void defineVariable(int global);
 
     void variable(bool canAssign);
 
@@ -172,6 +217,10 @@ public:
     void emitLoop(unsigned long start);
 
     void forStatement();
+
+    void forInLoop(const Token &name);
+
+    int forInLocals(const Token &name);
 };
 
 
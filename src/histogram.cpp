@@ -0,0 +1,36 @@
+#include "histogram.h"
+#include <bit>
+#include <fmt/core.h>
+
+void PauseHistogram::record(uint64_t nanos) {
+    auto bucket = nanos == 0 ? 0 : std::bit_width(nanos) - 1;
+    if (bucket >= buckets.size()) bucket = buckets.size() - 1;
+    buckets[bucket]++;
+    count++;
+    totalNanos += nanos;
+    if (nanos > maxNanos) maxNanos = nanos;
+}
+
+uint64_t PauseHistogram::percentile(double p) const {
+    if (count == 0) return 0;
+
+    auto target = static_cast<uint64_t>(static_cast<double>(count) * p / 100.0);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        seen += buckets[bucket];
+        if (seen > target || seen == count) return uint64_t{2} << bucket;
+    }
+    return maxNanos;
+}
+
+void PauseHistogram::print(FILE *out, std::string_view title) const {
+    fmt::print(out, "{}: {} pauses, total {:.3f} ms, max {:.3f} us, p50 < {:.3f} us, p99 < {:.3f} us\n",
+               title, count, static_cast<double>(totalNanos) / 1e6, static_cast<double>(maxNanos) / 1e3,
+               static_cast<double>(percentile(50)) / 1e3, static_cast<double>(percentile(99)) / 1e3);
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        if (buckets[bucket] == 0) continue;
+        fmt::print(out, "  [{:>10.3f}, {:>10.3f}) us {:>8}\n",
+                   static_cast<double>(uint64_t{1} << bucket) / 1e3,
+                   static_cast<double>(uint64_t{2} << bucket) / 1e3, buckets[bucket]);
+    }
+}
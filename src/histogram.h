@@ -0,0 +1,25 @@
+#ifndef CPPLOX_HISTOGRAM_H
+#define CPPLOX_HISTOGRAM_H
+
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <string_view>
+
+// Log2-bucketed histogram of pause times. Bucket i counts pauses in
+// [2^i, 2^(i+1)) nanoseconds.
+struct PauseHistogram {
+    std::array<uint64_t, 48> buckets{};
+    uint64_t count{};
+    uint64_t totalNanos{};
+    uint64_t maxNanos{};
+
+    void record(uint64_t nanos);
+    // Upper bound of the bucket containing the given percentile (0-100).
+    [[nodiscard]] uint64_t percentile(double p) const;
+    void print(FILE *out, std::string_view title) const;
+};
+
+
+#endif //CPPLOX_HISTOGRAM_H
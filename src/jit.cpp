@@ -0,0 +1,451 @@
+#include "jit.h"
+#include <utility>
+#include <vector>
+
+#if CPPLOX_HAS_JIT
+
+// While JIT code runs, RBX caches vm.stackTop, R12 holds the VM, R13
+// &vm.stackTop, R14 the stack (locals) and R15 the constant pool. All are
+// callee-saved, so they survive calls into the runtime; RBX is written back
+// around every such call.
+
+// The slow paths of compare-and-branch instructions report a taken branch
+// with this value, next to the Step codes.
+constexpr const int BRANCH_TAKEN = 3;
+
+using JitEntry = int (*)(VM *vm, Value **stackTop, Value *stack, const Value *constants);
+
+static int jitStep(VM *vm, uint8_t *at) {
+    return static_cast<int>(vm->executeAt(at));
+}
+
+static int jitBranch(VM *vm, uint8_t *at) {
+    if (auto step = vm->executeAt(at); step != Step::CONTINUE) return static_cast<int>(step);
+    return vm->ip == at + 3 ? static_cast<int>(Step::CONTINUE) : BRANCH_TAKEN;
+}
+
+// Translates one chunk, instruction by instruction.
+struct JitTranslator {
+    X64Assembler as;
+    VM &vm;
+    uint8_t *code;
+    std::vector<int> native;                     // bytecode offset -> machine code offset
+    std::vector<std::pair<int, int>> branches;   // (rel32 position, bytecode target)
+    std::vector<int> exits;                      // rel32 positions of jumps to the epilogue
+
+    explicit JitTranslator(VM &vm) : vm{vm}, code{vm.code}, native(vm.chunk->bytes().size(), -1) {}
+
+    void push(Reg reg) {
+        as.store(Reg::RBX, 0, reg);
+        as.add(Reg::RBX, int8_t{8});
+    }
+
+    void branchTo(int rel32, int target) { branches.emplace_back(rel32, target); }
+
+    // Runs the instruction at `at` in the interpreter and leaves on anything
+    // but CONTINUE.
+    void callStep(uint8_t *at) {
+        as.store(Reg::R13, 0, Reg::RBX);
+        as.mov(Reg::RDI, Reg::R12);
+        as.mov(Reg::RSI, reinterpret_cast<uint64_t>(at));
+        as.call(reinterpret_cast<const void *>(&jitStep));
+        as.load(Reg::RBX, Reg::R13, 0);
+        as.testEax();
+        exits.push_back(as.jcc(Cond::NE));
+    }
+
+    void callBranch(uint8_t *at, int target) {
+        as.store(Reg::R13, 0, Reg::RBX);
+        as.mov(Reg::RDI, Reg::R12);
+        as.mov(Reg::RSI, reinterpret_cast<uint64_t>(at));
+        as.call(reinterpret_cast<const void *>(&jitBranch));
+        as.load(Reg::RBX, Reg::R13, 0);
+        as.cmpEax(BRANCH_TAKEN);
+        branchTo(as.jcc(Cond::E), target);
+        as.testEax();
+        exits.push_back(as.jcc(Cond::NE));
+    }
+
+    // Jumps to the returned rel32 unless RAX holds a number. Expects QNAN in RCX.
+    int guardNumber() {
+        as.mov(Reg::RDX, Reg::RAX);
+        as.and_(Reg::RDX, Reg::RCX);
+        as.cmp(Reg::RDX, Reg::RCX);
+        return as.jcc(Cond::E);
+    }
+
+    // Checks the top two stack slots and loads them into xmm0 (a) and xmm1 (b).
+    std::pair<int, int> loadNumbers() {
+        as.mov(Reg::RCX, QNAN);
+        as.load(Reg::RAX, Reg::RBX, -16);
+        int first = guardNumber();
+        as.load(Reg::RAX, Reg::RBX, -8);
+        int second = guardNumber();
+        as.movsdLoad(0, Reg::RBX, -16);
+        as.movsdLoad(1, Reg::RBX, -8);
+        return {first, second};
+    }
+
+    void arithmetic(uint8_t *at, uint8_t opcode) {
+        auto [first, second] = loadNumbers();
+        as.sse(0xF2, opcode, 0, 1);
+        as.movsdStore(Reg::RBX, -16, 0);
+        as.sub(Reg::RBX, int8_t{8});
+        int done = as.jmp();
+        as.bind(first);
+        as.bind(second);
+        callStep(at);
+        as.bind(done);
+    }
+
+    // ucomisd sets the flags like an unsigned compare, and unordered operands
+    // (NaN) fail both A and AE, as every ordered comparison must.
+    void compareFlags(bool swap) {
+        if (swap) {
+            as.sse(0x66, 0x2E, 1, 0);
+        } else {
+            as.sse(0x66, 0x2E, 0, 1);
+        }
+    }
+
+    void comparison(uint8_t *at, bool swap, Cond cond) {
+        auto [first, second] = loadNumbers();
+        compareFlags(swap);
+        as.setcc(cond);
+        as.movzxEaxAl();
+        as.mov(Reg::RCX, FALSE_BITS);
+        as.add(Reg::RAX, Reg::RCX);
+        as.store(Reg::RBX, -16, Reg::RAX);
+        as.sub(Reg::RBX, int8_t{8});
+        int done = as.jmp();
+        as.bind(first);
+        as.bind(second);
+        callStep(at);
+        as.bind(done);
+    }
+
+    void compareBranch(uint8_t *at, int target, bool swap, Cond unless) {
+        auto [first, second] = loadNumbers();
+        as.sub(Reg::RBX, int8_t{16});
+        compareFlags(swap);
+        branchTo(as.jcc(unless), target);
+        int done = as.jmp();
+        as.bind(first);
+        as.bind(second);
+        callBranch(at, target);
+        as.bind(done);
+    }
+
+    // Branches to `target` when RAX is falsey.
+    void jumpIfFalsey(int target) {
+        as.mov(Reg::RCX, FALSE_BITS);
+        as.cmp(Reg::RAX, Reg::RCX);
+        branchTo(as.jcc(Cond::E), target);
+        as.mov(Reg::RCX, NIL_BITS);
+        as.cmp(Reg::RAX, Reg::RCX);
+        branchTo(as.jcc(Cond::E), target);
+    }
+
+    void jumpIfTruthy(int target) {
+        as.mov(Reg::RCX, FALSE_BITS);
+        as.cmp(Reg::RAX, Reg::RCX);
+        int isFalse = as.jcc(Cond::E);
+        as.mov(Reg::RCX, NIL_BITS);
+        as.cmp(Reg::RAX, Reg::RCX);
+        int isNil = as.jcc(Cond::E);
+        branchTo(as.jmp(), target);
+        as.bind(isFalse);
+        as.bind(isNil);
+    }
+
+    // The compiler resolves every global, so vm.globals does not grow while
+    // the chunk runs and its slots can be addressed directly. Stores still go
+    // through the runtime for the write barrier.
+    void getGlobal(uint8_t *at, int slot) {
+        as.mov(Reg::RCX, reinterpret_cast<uint64_t>(&vm.globals[slot]));
+        as.load(Reg::RAX, Reg::RCX, 0);
+        as.mov(Reg::RCX, undefined_val().bits);
+        as.cmp(Reg::RAX, Reg::RCX);
+        int undefined = as.jcc(Cond::E);
+        push(Reg::RAX);
+        int done = as.jmp();
+        as.bind(undefined);
+        callStep(at);
+        as.bind(done);
+    }
+
+    void addToLocal(uint8_t *at, uint8_t slot, uint8_t constant) {
+        // The pool never changes while the chunk runs, so only the local
+        // needs a guard.
+        if (!isNumber(vm.chunk->constants[constant])) {
+            callStep(at);
+            return;
+        }
+        as.mov(Reg::RCX, QNAN);
+        as.load(Reg::RAX, Reg::R14, slot * 8);
+        int slow = guardNumber();
+        as.movsdLoad(0, Reg::R14, slot * 8);
+        as.movsdLoad(1, Reg::R15, constant * 8);
+        as.sse(0xF2, 0x58, 0, 1);
+        as.movsdStore(Reg::R14, slot * 8, 0);
+        int done = as.jmp();
+        as.bind(slow);
+        callStep(at);
+        as.bind(done);
+    }
+
+    bool translate() {
+        as.push(Reg::RBX);
+        as.push(Reg::R12);
+        as.push(Reg::R13);
+        as.push(Reg::R14);
+        as.push(Reg::R15);
+        as.mov(Reg::R12, Reg::RDI);
+        as.mov(Reg::R13, Reg::RSI);
+        as.mov(Reg::R14, Reg::RDX);
+        as.mov(Reg::R15, Reg::RCX);
+        as.load(Reg::RBX, Reg::R13, 0);
+
+        auto size = static_cast<int>(native.size());
+        for (int offset = 0; offset < size;) {
+            native[offset] = as.size();
+            uint8_t *at = code + offset;
+            auto jumpTarget = [&](int sign) {
+                return offset + 3 + sign * readShort(at + 1);
+            };
+
+            switch (static_cast<OP>(*at)) {
+                case OP::CONSTANT:
+                    as.load(Reg::RAX, Reg::R15, at[1] * 8);
+                    push(Reg::RAX);
+                    offset += 2;
+                    break;
+                case OP::NIL:
+                    as.mov(Reg::RAX, NIL_BITS);
+                    push(Reg::RAX);
+                    offset += 1;
+                    break;
+                case OP::TRUE:
+                    as.mov(Reg::RAX, TRUE_BITS);
+                    push(Reg::RAX);
+                    offset += 1;
+                    break;
+                case OP::FALSE:
+                    as.mov(Reg::RAX, FALSE_BITS);
+                    push(Reg::RAX);
+                    offset += 1;
+                    break;
+                case OP::POP:
+                    as.sub(Reg::RBX, int8_t{8});
+                    offset += 1;
+                    break;
+                case OP::POPN:
+                    as.sub(Reg::RBX, at[1] * 8);
+                    offset += 2;
+                    break;
+                case OP::GET_LOCAL:
+                    as.load(Reg::RAX, Reg::R14, at[1] * 8);
+                    push(Reg::RAX);
+                    offset += 2;
+                    break;
+                case OP::SET_LOCAL:
+                    as.load(Reg::RAX, Reg::RBX, -8);
+                    as.store(Reg::R14, at[1] * 8, Reg::RAX);
+                    offset += 2;
+                    break;
+                case OP::SET_LOCAL_POP:
+                    as.sub(Reg::RBX, int8_t{8});
+                    as.load(Reg::RAX, Reg::RBX, 0);
+                    as.store(Reg::R14, at[1] * 8, Reg::RAX);
+                    offset += 2;
+                    break;
+                case OP::NOT:
+                case OP::NEGATE:
+                case OP::EQUAL:
+                case OP::NOT_EQUAL:
+                case OP::PRINT:
+                    callStep(at);
+                    offset += 1;
+                    break;
+                case OP::GET_GLOBAL_SLOT:
+                    getGlobal(at, at[1]);
+                    offset += 2;
+                    break;
+                case OP::DEFINE_GLOBAL_SLOT:
+                case OP::SET_GLOBAL_SLOT:
+                    callStep(at);
+                    offset += 2;
+                    break;
+                case OP::ADD:
+                    arithmetic(at, 0x58);
+                    offset += 1;
+                    break;
+                case OP::SUBTRACT:
+                    arithmetic(at, 0x5C);
+                    offset += 1;
+                    break;
+                case OP::MULTIPLY:
+                    arithmetic(at, 0x59);
+                    offset += 1;
+                    break;
+                case OP::DIVIDE:
+                    arithmetic(at, 0x5E);
+                    offset += 1;
+                    break;
+                case OP::LESS:
+                    comparison(at, true, Cond::A);
+                    offset += 1;
+                    break;
+                case OP::LESS_EQUAL:
+                    comparison(at, true, Cond::AE);
+                    offset += 1;
+                    break;
+                case OP::GREATER:
+                    comparison(at, false, Cond::A);
+                    offset += 1;
+                    break;
+                case OP::GREATER_EQUAL:
+                    comparison(at, false, Cond::AE);
+                    offset += 1;
+                    break;
+                case OP::JUMP:
+                    branchTo(as.jmp(), jumpTarget(1));
+                    offset += 3;
+                    break;
+                case OP::LOOP:
+                    branchTo(as.jmp(), jumpTarget(-1));
+                    offset += 3;
+                    break;
+                case OP::JUMP_IF_FALSE:
+                    as.load(Reg::RAX, Reg::RBX, -8);
+                    jumpIfFalsey(jumpTarget(1));
+                    offset += 3;
+                    break;
+                case OP::JUMP_IF_TRUE:
+                    as.load(Reg::RAX, Reg::RBX, -8);
+                    jumpIfTruthy(jumpTarget(1));
+                    offset += 3;
+                    break;
+                case OP::POP_JUMP_IF_FALSE:
+                    as.sub(Reg::RBX, int8_t{8});
+                    as.load(Reg::RAX, Reg::RBX, 0);
+                    jumpIfFalsey(jumpTarget(1));
+                    offset += 3;
+                    break;
+                case OP::POP_JUMP_IF_TRUE:
+                    as.sub(Reg::RBX, int8_t{8});
+                    as.load(Reg::RAX, Reg::RBX, 0);
+                    jumpIfTruthy(jumpTarget(1));
+                    offset += 3;
+                    break;
+                case OP::JUMP_IF_NOT_LESS:
+                    compareBranch(at, jumpTarget(1), true, Cond::BE);
+                    offset += 3;
+                    break;
+                case OP::JUMP_IF_NOT_LESS_EQUAL:
+                    compareBranch(at, jumpTarget(1), true, Cond::B);
+                    offset += 3;
+                    break;
+                case OP::JUMP_IF_NOT_GREATER:
+                    compareBranch(at, jumpTarget(1), false, Cond::BE);
+                    offset += 3;
+                    break;
+                case OP::JUMP_IF_NOT_GREATER_EQUAL:
+                    compareBranch(at, jumpTarget(1), false, Cond::B);
+                    offset += 3;
+                    break;
+                case OP::ADD_TO_LOCAL:
+                    addToLocal(at, at[1], at[2]);
+                    offset += 3;
+                    break;
+                case OP::CONSTANT_LONG:
+                    as.load(Reg::RAX, Reg::R15, static_cast<int32_t>(readTriple(at + 1) * 8));
+                    push(Reg::RAX);
+                    offset += 4;
+                    break;
+                case OP::GET_LOCAL_LONG:
+                    as.load(Reg::RAX, Reg::R14, readShort(at + 1) * 8);
+                    push(Reg::RAX);
+                    offset += 3;
+                    break;
+                case OP::SET_LOCAL_LONG:
+                    as.load(Reg::RAX, Reg::RBX, -8);
+                    as.store(Reg::R14, readShort(at + 1) * 8, Reg::RAX);
+                    offset += 3;
+                    break;
+                case OP::GET_GLOBAL_SLOT_LONG:
+                    getGlobal(at, readShort(at + 1));
+                    offset += 3;
+                    break;
+                case OP::DEFINE_GLOBAL_SLOT_LONG:
+                case OP::SET_GLOBAL_SLOT_LONG:
+                    callStep(at);
+                    offset += 3;
+                    break;
+                case OP::CLASS:
+                case OP::GET_FIELD:
+                case OP::GET_FIELD_MONO:
+                case OP::SET_FIELD:
+                case OP::SET_FIELD_MONO:
+                case OP::BUILD_MAP:
+                case OP::GET_INDEX:
+                case OP::SET_INDEX:
+                case OP::FOR_IN:
+                    callStep(at);
+                    offset += instructionLength(static_cast<OP>(*at));
+                    break;
+                case OP::JUMP_LONG:
+                    branchTo(as.jmp(), offset + 5 + readInt(at + 1));
+                    offset += 5;
+                    break;
+                case OP::RETURN:
+                    as.movEax(static_cast<uint32_t>(Step::RETURN));
+                    exits.push_back(as.jmp());
+                    offset += 1;
+                    break;
+                default:
+                    return false;
+            }
+        }
+
+        for (auto [rel32, target]: branches) {
+            if (target < 0 || target >= size || native[target] < 0) return false;
+            as.patch(rel32, native[target]);
+        }
+        for (auto rel32: exits) as.bind(rel32);
+
+        as.store(Reg::R13, 0, Reg::RBX);
+        as.pop(Reg::R15);
+        as.pop(Reg::R14);
+        as.pop(Reg::R13);
+        as.pop(Reg::R12);
+        as.pop(Reg::RBX);
+        as.ret();
+        return true;
+    }
+};
+
+std::optional<JitCode> JitCode::compile(VM &vm) {
+    JitTranslator translator{vm};
+    if (!translator.translate()) return std::nullopt;
+    auto memory = ExecutableMemory::map(translator.as.bytes);
+    if (!memory) return std::nullopt;
+    return JitCode{std::move(*memory)};
+}
+
+Step JitCode::run(VM &vm) const {
+    auto entry = reinterpret_cast<JitEntry>(memory.address());
+    return static_cast<Step>(entry(&vm, &vm.stackTop, vm.stack.data(), vm.chunk->constants.data()));
+}
+
+#else
+
+std::optional<JitCode> JitCode::compile(VM &) {
+    return std::nullopt;
+}
+
+Step JitCode::run(VM &) const {
+    return Step::ERROR;
+}
+
+#endif
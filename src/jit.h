@@ -0,0 +1,31 @@
+#ifndef CPPLOX_JIT_H
+#define CPPLOX_JIT_H
+
+
+#include <optional>
+#include "VM.h"
+#include "native.h"
+
+// Baseline template JIT for stack code. Each instruction of the running chunk
+// becomes a fixed machine-code snippet and bytecode jumps become native
+// branches. Numeric fast paths are inlined behind a type guard; everything
+// else, including every error, calls back into VM::execute for that one
+// instruction, so runtime errors and their line numbers are the
+// interpreter's own.
+class JitCode {
+public:
+    // Translates vm.chunk, reading the per-run copy at vm.code. Returns
+    // nothing when the code contains an opcode the JIT does not translate
+    // or executable memory cannot be had; the caller then interprets.
+    static std::optional<JitCode> compile(VM &vm);
+
+    Step run(VM &vm) const;
+
+private:
+    explicit JitCode(ExecutableMemory memory) : memory{std::move(memory)} {}
+
+    ExecutableMemory memory;
+};
+
+
+#endif //CPPLOX_JIT_H
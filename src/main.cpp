@@ -1,9 +1,33 @@
 #include "chunk.h"
 #include "VM.h"
 #include <fmt/core.h>
+#include <charconv>
+#include <vector>
 
-static void repl() {
+struct Options {
+    bool gcStats{false};
+    bool peepholeStats{false};
+    uint64_t gcPauseTarget{GC_PAUSE_TARGET_NANOS};
+    Backend backend{Backend::STACK};
+    OptLevel optLevel{OptLevel::O0};
+    bool peephole{true};
+    Jit jit{Jit::NONE};
+    bool cache{false};
+    std::filesystem::path cacheDirectory{BytecodeCache::defaultDirectory()};
+    bool precompile{false};
+};
+
+static void configure(VM &vm, const Options &options) {
+    vm.gcPauseTarget = options.gcPauseTarget;
+    vm.backend = options.backend;
+    vm.optLevel = options.optLevel;
+    vm.peephole = options.peephole;
+    vm.jit = options.jit;
+}
+
+static void repl(const Options &options) {
     VM vm;
+    configure(vm, options);
     char line[1024];
     for (;;) {
         fmt::print("> ");
@@ -14,6 +38,9 @@ static void repl() {
 
         vm.interpret(line);
     }
+
+    if (options.gcStats) vm.printGCStats();
+    if (options.peepholeStats) vm.printPeepholeStats();
 }
 
 static char* readFile(const char* path) {
@@ -44,24 +71,91 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+static void runFile(const char* path, const Options &options) {
     VM vm;
+    configure(vm, options);
+    if (options.cache) vm.bytecodeCache.emplace(options.cacheDirectory);
     std::unique_ptr<char> source{readFile(path)};
     InterpretResult result = vm.interpret(std::string_view{source.get()});
 
+    if (options.gcStats) vm.printGCStats();
+    if (options.peepholeStats) vm.printPeepholeStats();
+
     if (result == InterpretResult::COMPILE_ERROR) exit(65);
     if (result == InterpretResult::RUNTIME_ERROR) exit(70);
 }
 
+// Compiles each file into the cache, so a later run with --cache starts
+// from bytecode. Each gets a fresh VM, as it would when run.
+static void precompile(const std::vector<const char*> &paths, const Options &options) {
+    bool failed = false;
+    for (auto path: paths) {
+        VM vm;
+        configure(vm, options);
+        vm.bytecodeCache.emplace(options.cacheDirectory);
+        std::unique_ptr<char> source{readFile(path)};
+        if (vm.precompile(std::string_view{source.get()}) != InterpretResult::OK) failed = true;
+    }
+    if (failed) exit(65);
+}
+
+[[noreturn]] static void usage() {
+    fmt::print(stderr, "Usage: clox [--gc-stats] [--gc-pause=<us>] [--backend=stack|register] [-O0|-O1] [--no-peephole] [--peephole-stats] [--jit[=baseline|trace]] [--cache] [--cache-dir=<dir>] [path]\n"
+                       "       clox --precompile [--cache-dir=<dir>] [options] path...\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
-    VM vm{};
+    Options options;
+    std::vector<const char*> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg{argv[i]};
+        if (arg == "--gc-stats") {
+            options.gcStats = true;
+        } else if (arg.starts_with("--gc-pause=")) {
+            auto value = arg.substr(std::string_view{"--gc-pause="}.size());
+            uint64_t micros{};
+            if (std::from_chars(value.data(), value.data() + value.size(), micros).ec != std::errc{}) usage();
+            options.gcPauseTarget = micros * 1000;
+        } else if (arg == "--backend=stack") {
+            options.backend = Backend::STACK;
+        } else if (arg == "--backend=register") {
+            options.backend = Backend::REGISTER;
+        } else if (arg == "-O0") {
+            options.optLevel = OptLevel::O0;
+        } else if (arg == "-O1") {
+            options.optLevel = OptLevel::O1;
+        } else if (arg == "--no-peephole") {
+            options.peephole = false;
+        } else if (arg == "--peephole-stats") {
+            options.peepholeStats = true;
+        } else if (arg == "--jit" || arg == "--jit=baseline") {
+            options.jit = Jit::BASELINE;
+        } else if (arg == "--jit=trace") {
+            options.jit = Jit::TRACE;
+        } else if (arg == "--cache") {
+            options.cache = true;
+        } else if (arg.starts_with("--cache-dir=")) {
+            options.cache = true;
+            options.cacheDirectory = arg.substr(std::string_view{"--cache-dir="}.size());
+        } else if (arg == "--precompile") {
+            options.precompile = true;
+        } else if (arg.starts_with("-")) {
+            usage();
+        } else {
+            paths.push_back(argv[i]);
+        }
+    }
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    if (options.precompile) {
+        if (paths.empty()) usage();
+        precompile(paths, options);
+    } else if (paths.size() > 1) {
+        usage();
+    } else if (paths.empty()) {
+        repl(options);
     } else {
-        fmt::print(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(paths.front(), options);
     }
 }
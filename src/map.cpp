@@ -0,0 +1,35 @@
+#include "map.h"
+#include <bit>
+
+// Murmur3's finalizer. Small integers differ only in a double's high bits,
+// which it spreads over the low ones the slot index is taken from.
+static uint32_t mixBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ULL;
+    bits ^= bits >> 33;
+    return static_cast<uint32_t>(bits);
+}
+
+uint32_t hashKey(Value key) {
+    if (isString(key)) return asString(key)->hash;
+    if (isNumber(key)) return mixBits(std::bit_cast<uint64_t>(asNumber(key)));
+    if (isBool(key)) return mixBits(asBool(key) ? 3 : 2);
+    return mixBits(1);
+}
+
+Value* findEntry(ObjMap* map, Value key) {
+    uint32_t mask = map->capacity - 1;
+    Value* entries = mapEntries(map);
+    for (uint32_t index = hashKey(key) & mask;; index = (index + 1) & mask) {
+        Value* entry = &entries[2 * index];
+        if (sameKey(entry[0], key) || isUndefined(entry[0])) return entry;
+    }
+}
+
+uint32_t mapCapacity(uint32_t count) {
+    uint32_t capacity = MAP_MIN_CAPACITY;
+    while (count * MAP_MAX_LOAD_DEN > capacity * MAP_MAX_LOAD_NUM) capacity *= 2;
+    return capacity;
+}
@@ -0,0 +1,66 @@
+#ifndef CPPLOX_MAP_H
+#define CPPLOX_MAP_H
+
+
+#include <cmath>
+#include <cstdint>
+#include "value.h"
+
+// Slots in a map's first entries array. Capacities are powers of two.
+constexpr const uint32_t MAP_MIN_CAPACITY = 8;
+// Doubling past this would overflow the 32-bit value count of the entries.
+constexpr const uint32_t MAP_MAX_CAPACITY = 1u << 30;
+constexpr const uint32_t MAP_MAX_LOAD_NUM = 3;
+constexpr const uint32_t MAP_MAX_LOAD_DEN = 4;
+
+// A map's slots, each two values: the key, then its value.
+inline Value* mapEntries(ObjMap* map) {
+    return overflowFields(map->entries);
+}
+
+// Numbers but NaN, which equals nothing, interned strings, booleans and nil.
+// Ropes must be flattened first.
+inline bool isMapKey(Value key) {
+    if (isNumber(key)) return !std::isnan(asNumber(key));
+    return isString(key) || isBool(key) || isNil(key);
+}
+
+// The key as maps store it: -0 becomes 0, so that keys equal as Lox values
+// are the same Value and probing compares them without valuesEqual.
+inline Value canonicalKey(Value key) {
+    return isNumber(key) && asNumber(key) == 0 ? number_val(0) : key;
+}
+
+inline bool sameKey(Value a, Value b) {
+#if CPPLOX_NAN_BOXING
+    return a.bits == b.bits;
+#else
+    return a == b;
+#endif
+}
+
+// Stable for the key's lifetime. A string's pointer is not, since the
+// collector moves young strings, so strings hash to their cached text hash.
+uint32_t hashKey(Value key);
+
+// The slot holding the canonical `key`, or the free slot where it belongs.
+// The map must have slots. Never allocates.
+Value* findEntry(ObjMap* map, Value key);
+
+// The value stored under `key`, or nullptr.
+inline Value* findValue(ObjMap* map, Value key) {
+    if (map->capacity == 0) return nullptr;
+    Value* entry = findEntry(map, key);
+    return isUndefined(entry[0]) ? nullptr : entry + 1;
+}
+
+// Whether adding a key would take the map past its load factor.
+inline bool mapIsFull(const ObjMap* map) {
+    return (uint64_t{map->count} + 1) * MAP_MAX_LOAD_DEN > uint64_t{map->capacity} * MAP_MAX_LOAD_NUM;
+}
+
+// The capacity a map needs for `count` keys.
+uint32_t mapCapacity(uint32_t count);
+
+
+#endif //CPPLOX_MAP_H
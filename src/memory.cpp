@@ -0,0 +1,368 @@
+#include "VM.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fmt/core.h>
+
+static uint64_t nanosSince(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+void VM::minorCollect() {
+    auto start = std::chrono::steady_clock::now();
+
+    for (Value *slot = stack.data(); slot < stackTop; ++slot) {
+        *slot = evacuate(*slot);
+    }
+    if (chunk != nullptr) {
+        for (auto &constant: chunk->constants) {
+            constant = evacuate(constant);
+        }
+    }
+    for (auto &shape: shapes) {
+        shape.key = static_cast<ObjString *>(evacuateObject(shape.key));
+    }
+    // Global names are mostly compiler literals, already old, but a name a
+    // script built at runtime before declaring it may still be young.
+    for (auto &name: globalNames) {
+        auto moved = static_cast<ObjString *>(evacuateObject(name));
+        if (moved == name) continue;
+        globalSlots.find(name)->key = moved;
+        name = moved;
+    }
+    for (auto slot: rememberedGlobals) {
+        globals[slot] = evacuate(globals[slot]);
+        globalRemembered[slot] = 0;
+    }
+    rememberedGlobals.clear();
+    for (auto object: rememberedObjects) {
+        object->isRemembered = false;
+        scavengeObject(object);
+    }
+    rememberedObjects.clear();
+
+    // Promoted objects may still point into the nursery; keep evacuating
+    // until every survivor has been copied out.
+    while (!scavengeQueue.empty()) {
+        Obj *object = scavengeQueue.back();
+        scavengeQueue.pop_back();
+        scavengeObject(object);
+    }
+
+    youngStrings.clear();
+    nursery.reset();
+
+    minorPauses.record(nanosSince(start));
+}
+
+Value VM::evacuate(Value value) {
+    if (!isYoung(value)) return value;
+    return obj_val(promote(asObject(value)));
+}
+
+Obj *VM::evacuateObject(Obj *object) {
+    if (object == nullptr || !nursery.contains(object)) return object;
+    return promote(object);
+}
+
+void VM::scavengeObject(Obj *object) {
+    switch (object->type) {
+        case ObjType::STRING:
+            break;
+        case ObjType::ROPE: {
+            auto rope = static_cast<ObjRope *>(object);
+            rope->left = evacuateObject(rope->left);
+            rope->right = evacuateObject(rope->right);
+            rope->flat = static_cast<ObjString *>(evacuateObject(rope->flat));
+            break;
+        }
+        case ObjType::FUNCTION: {
+            auto function = static_cast<ObjFunction *>(object);
+            function->name = static_cast<ObjString *>(evacuateObject(function->name));
+            for (auto &constant: function->chunk->constants) {
+                constant = evacuate(constant);
+            }
+            break;
+        }
+        case ObjType::CLASS: {
+            auto klass = static_cast<ObjClass *>(object);
+            klass->name = static_cast<ObjString *>(evacuateObject(klass->name));
+            break;
+        }
+        case ObjType::INSTANCE: {
+            // Inline slots past the field count hold nothing.
+            auto instance = static_cast<ObjInstance *>(object);
+            auto count = std::min(shapes[instance->shape].fieldCount, instance->capacity);
+            for (uint32_t i = 0; i < count; ++i) {
+                inlineFields(instance)[i] = evacuate(inlineFields(instance)[i]);
+            }
+            instance->overflow = static_cast<ObjFields *>(evacuateObject(instance->overflow));
+            break;
+        }
+        case ObjType::FIELDS: {
+            auto fields = static_cast<ObjFields *>(object);
+            for (uint32_t i = 0; i < fields->capacity; ++i) {
+                overflowFields(fields)[i] = evacuate(overflowFields(fields)[i]);
+            }
+            break;
+        }
+        case ObjType::MAP: {
+            auto map = static_cast<ObjMap *>(object);
+            map->entries = static_cast<ObjFields *>(evacuateObject(map->entries));
+            break;
+        }
+        case ObjType::NATIVE: {
+            auto native = static_cast<ObjNative *>(object);
+            native->name = static_cast<ObjString *>(evacuateObject(native->name));
+            break;
+        }
+    }
+}
+
+// Copies a young object, inline payload included, into the old generation.
+// The nursery copy keeps a forwarding pointer in Obj::next so later
+// references resolve to the same promoted object.
+Obj *VM::promote(Obj *object) {
+    if (object->isMarked) return object->next;
+
+    auto size = objectSize(object);
+    auto promoted = static_cast<Obj *>(std::memcpy(::operator new(size), object, size));
+    promoted->isMarked = false;
+    promoted->isRemembered = false;
+    switch (promoted->type) {
+        case ObjType::STRING:
+            strings.insert(static_cast<ObjString *>(promoted));
+            break;
+        case ObjType::ROPE:
+        case ObjType::INSTANCE:
+        case ObjType::FIELDS:
+        case ObjType::MAP:
+            scavengeQueue.push_back(promoted);
+            break;
+        case ObjType::FUNCTION:
+        case ObjType::CLASS:
+        case ObjType::NATIVE:
+            break; // never young
+    }
+
+    linkObject(promoted);
+    object->isMarked = true;
+    object->next = promoted;
+    return promoted;
+}
+
+// Adds a new old-generation object to the heap. Objects created while the
+// collector is marking are shaded gray so they survive the cycle and their
+// references still get traced.
+void VM::linkObject(Obj *object) {
+    object->next = objects;
+    objects = object;
+
+    auto size = objectSize(object);
+    bytesAllocated += size;
+    allocationDebt += size;
+
+    if (gcPhase == GCPhase::MARK) {
+        object->isMarked = true;
+        grayStack.push_back(object);
+    }
+}
+
+// Allocation pacing: crossing nextGC starts a cycle, and every
+// GC_SLICE_BYTES allocated while one is running pays for one slice of it.
+void VM::payAllocation(size_t size) {
+    if (gcPhase == GCPhase::IDLE) {
+        if (bytesAllocated + size > nextGC) {
+            auto start = std::chrono::steady_clock::now();
+            startCycle();
+            majorPauses.record(nanosSince(start));
+        }
+        return;
+    }
+
+    if (allocationDebt + size >= GC_SLICE_BYTES) {
+        allocationDebt = 0;
+        gcSlice();
+    }
+}
+
+// Does collector work until the cycle ends or the pause target is reached.
+void VM::gcSlice() {
+    auto start = std::chrono::steady_clock::now();
+
+    for (int work = 1; gcStep(); ++work) {
+        if (work % 16 == 0 && nanosSince(start) >= gcPauseTarget) break;
+    }
+
+    majorPauses.record(nanosSince(start));
+}
+
+// Performs one unit of collector work. Returns false once the cycle is over.
+bool VM::gcStep() {
+    switch (gcPhase) {
+        case GCPhase::MARK:
+            if (grayStack.empty()) {
+                remark();
+            } else {
+                Obj *object = grayStack.back();
+                grayStack.pop_back();
+                blackenObject(object);
+            }
+            return true;
+        case GCPhase::SWEEP: {
+            if (sweepList == nullptr) {
+                finishCycle();
+                return false;
+            }
+
+            Obj *object = sweepList;
+            sweepList = object->next;
+            if (object->isMarked) {
+                object->isMarked = false;
+                object->next = objects;
+                objects = object;
+            } else {
+                bytesAllocated -= objectSize(object);
+                freeObject(object);
+            }
+            return true;
+        }
+        case GCPhase::IDLE:
+        default:
+            return false;
+    }
+}
+
+void VM::startCycle() {
+    if constexpr (DEBUG_LOG_GC) fmt::print("-- gc begin ({} bytes)\n", bytesAllocated);
+
+    gcPhase = GCPhase::MARK;
+    for (auto value: globals) {
+        markValue(value);
+    }
+    markRoots();
+}
+
+// The atomic end of marking. The stack and constant pools are not behind a
+// barrier, so they are scanned again here. Then the intern table drops its
+// unreached strings and the unswept heap is split off for the sweeper.
+void VM::remark() {
+    minorCollect();
+    markRoots();
+    traceReferences();
+    strings.removeUnmarked();
+
+    sweepList = objects;
+    objects = nullptr;
+    gcPhase = GCPhase::SWEEP;
+}
+
+void VM::finishCycle() {
+    gcPhase = GCPhase::IDLE;
+    allocationDebt = 0;
+    nextGC = static_cast<size_t>(static_cast<double>(bytesAllocated) * gcGrowFactor);
+    if (nextGC < GC_INITIAL_THRESHOLD) nextGC = GC_INITIAL_THRESHOLD;
+
+    if constexpr (DEBUG_LOG_GC) fmt::print("-- gc end ({} bytes) next at {}\n", bytesAllocated, nextGC);
+}
+
+// Runs a whole cycle to completion without yielding to the program.
+void VM::collectGarbage() {
+    auto start = std::chrono::steady_clock::now();
+
+    if (gcPhase == GCPhase::IDLE) startCycle();
+    while (gcStep()) {}
+
+    majorPauses.record(nanosSince(start));
+}
+
+void VM::markRoots() {
+    for (Value *slot = stack.data(); slot < stackTop; ++slot) {
+        markValue(*slot);
+    }
+    if (chunk != nullptr) {
+        for (auto value: chunk->constants) {
+            markValue(value);
+        }
+    }
+    for (auto name: globalNames) {
+        markObject(name);
+    }
+    for (auto &shape: shapes) {
+        markObject(shape.key);
+    }
+}
+
+void VM::markValue(Value value) {
+    if (isObj(value)) markObject(asObject(value));
+}
+
+// Young objects are left to the nursery: they are promoted, already gray,
+// by the minor collection at the start of remark.
+void VM::markObject(Obj *object) {
+    if (object == nullptr || object->isMarked || nursery.contains(object)) return;
+    object->isMarked = true;
+    grayStack.push_back(object);
+}
+
+void VM::traceReferences() {
+    while (!grayStack.empty()) {
+        Obj *object = grayStack.back();
+        grayStack.pop_back();
+        blackenObject(object);
+    }
+}
+
+void VM::blackenObject(Obj *object) {
+    switch (object->type) {
+        case ObjType::STRING:
+            break; // no outgoing references
+        case ObjType::ROPE: {
+            auto rope = static_cast<ObjRope *>(object);
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject(rope->flat);
+            break;
+        }
+        case ObjType::FUNCTION: {
+            auto function = static_cast<ObjFunction *>(object);
+            markObject(function->name);
+            for (auto value: function->chunk->constants) {
+                markValue(value);
+            }
+            break;
+        }
+        case ObjType::CLASS:
+            markObject(static_cast<ObjClass *>(object)->name);
+            break;
+        case ObjType::INSTANCE: {
+            auto instance = static_cast<ObjInstance *>(object);
+            markObject(instance->klass);
+            auto count = std::min(shapes[instance->shape].fieldCount, instance->capacity);
+            for (uint32_t i = 0; i < count; ++i) {
+                markValue(inlineFields(instance)[i]);
+            }
+            markObject(instance->overflow);
+            break;
+        }
+        case ObjType::FIELDS: {
+            auto fields = static_cast<ObjFields *>(object);
+            for (uint32_t i = 0; i < fields->capacity; ++i) {
+                markValue(overflowFields(fields)[i]);
+            }
+            break;
+        }
+        case ObjType::MAP:
+            markObject(static_cast<ObjMap *>(object)->entries);
+            break;
+        case ObjType::NATIVE:
+            markObject(static_cast<ObjNative *>(object)->name);
+            break;
+    }
+}
+
+void VM::printGCStats() const {
+    minorPauses.print(stderr, "minor gc");
+    majorPauses.print(stderr, "major gc");
+}
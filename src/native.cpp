@@ -0,0 +1,33 @@
+#include "native.h"
+#include <utility>
+
+#if CPPLOX_HAS_JIT
+#include <sys/mman.h>
+
+std::optional<ExecutableMemory> ExecutableMemory::map(const std::vector<uint8_t> &code) {
+    void *memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return std::nullopt;
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, code.size());
+        return std::nullopt;
+    }
+    return ExecutableMemory{memory, code.size()};
+}
+
+ExecutableMemory::~ExecutableMemory() {
+    if (memory != nullptr) munmap(memory, size);
+}
+
+#else
+
+std::optional<ExecutableMemory> ExecutableMemory::map(const std::vector<uint8_t> &) {
+    return std::nullopt;
+}
+
+ExecutableMemory::~ExecutableMemory() = default;
+
+#endif
+
+ExecutableMemory::ExecutableMemory(ExecutableMemory &&other) noexcept
+        : memory{std::exchange(other.memory, nullptr)}, size{other.size} {}
@@ -0,0 +1,281 @@
+#ifndef CPPLOX_NATIVE_H
+#define CPPLOX_NATIVE_H
+
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <vector>
+#include "chunk.h"
+
+// Both JITs emit x86-64 System V code and rely on the NaN-boxed Value layout.
+#if defined(__x86_64__) && defined(__linux__) && CPPLOX_NAN_BOXING
+#define CPPLOX_HAS_JIT 1
+#else
+#define CPPLOX_HAS_JIT 0
+#endif
+
+// A block of machine code, mapped read+execute for as long as it lives.
+class ExecutableMemory {
+public:
+    // Nothing when the platform has no JIT or the mapping fails.
+    static std::optional<ExecutableMemory> map(const std::vector<uint8_t> &code);
+
+    ExecutableMemory(ExecutableMemory &&other) noexcept;
+    ExecutableMemory &operator=(ExecutableMemory &&) = delete;
+    ~ExecutableMemory();
+
+    [[nodiscard]] void *address() const { return memory; }
+
+private:
+    ExecutableMemory(void *memory, size_t size) : memory{memory}, size{size} {}
+
+    void *memory;
+    size_t size;
+};
+
+// Machine registers by encoding number.
+enum class Reg : uint8_t {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R12 = 12, R13 = 13, R14 = 14, R15 = 15
+};
+
+// Condition codes, as the low nibble of Jcc and SETcc.
+enum class Cond : uint8_t {
+    B = 0x2,
+    AE = 0x3,
+    E = 0x4,
+    NE = 0x5,
+    BE = 0x6,
+    A = 0x7,
+    P = 0xA,
+    NP = 0xB
+};
+
+// Just enough of an x86-64 encoder for the JITs. XMM registers are plain
+// ints 0-15. Forward jumps return the position of their rel32 field, to be
+// patched once the target is known.
+struct X64Assembler {
+    std::vector<uint8_t> bytes;
+
+    [[nodiscard]] int size() const { return static_cast<int>(bytes.size()); }
+
+    void byte(uint8_t value) { bytes.push_back(value); }
+
+    void u32(uint32_t value) {
+        for (int shift = 0; shift < 32; shift += 8) byte(static_cast<uint8_t>(value >> shift));
+    }
+
+    void u64(uint64_t value) {
+        for (int shift = 0; shift < 64; shift += 8) byte(static_cast<uint8_t>(value >> shift));
+    }
+
+    static uint8_t low(Reg reg) { return to_integral(reg) & 7; }
+
+    static bool high(Reg reg) { return to_integral(reg) >= 8; }
+
+    void rexW(Reg reg, Reg rm) { byte(0x48 | (high(reg) ? 4 : 0) | (high(rm) ? 1 : 0)); }
+
+    // REX without W, only when an operand needs it (SSE forms).
+    void rex(int reg, int rm) {
+        if (reg >= 8 || rm >= 8) byte(0x40 | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0));
+    }
+
+    // ModRM (plus SIB) for [base + disp].
+    void memory(int reg, Reg base, int32_t disp) {
+        bool short_disp = disp >= -128 && disp <= 127;
+        byte((short_disp ? 0x40 : 0x80) | (reg & 7) << 3 | low(base));
+        if (low(base) == 4) byte(0x24);
+        if (short_disp) {
+            byte(static_cast<uint8_t>(disp));
+        } else {
+            u32(static_cast<uint32_t>(disp));
+        }
+    }
+
+    void push(Reg reg) {
+        if (high(reg)) byte(0x41);
+        byte(0x50 | low(reg));
+    }
+
+    void pop(Reg reg) {
+        if (high(reg)) byte(0x41);
+        byte(0x58 | low(reg));
+    }
+
+    void mov(Reg dst, Reg src) {
+        rexW(src, dst);
+        byte(0x89);
+        byte(0xC0 | low(src) << 3 | low(dst));
+    }
+
+    void mov(Reg dst, uint64_t imm) {
+        byte(0x48 | (high(dst) ? 1 : 0));
+        byte(0xB8 | low(dst));
+        u64(imm);
+    }
+
+    void load(Reg dst, Reg base, int32_t disp) {
+        rexW(dst, base);
+        byte(0x8B);
+        memory(low(dst), base, disp);
+    }
+
+    void store(Reg base, int32_t disp, Reg src) {
+        rexW(src, base);
+        byte(0x89);
+        memory(low(src), base, disp);
+    }
+
+    void add(Reg dst, Reg src) { arithmetic(0x01, dst, src); }
+
+    void and_(Reg dst, Reg src) { arithmetic(0x21, dst, src); }
+
+    void xor_(Reg dst, Reg src) { arithmetic(0x31, dst, src); }
+
+    void cmp(Reg a, Reg b) { arithmetic(0x39, a, b); }
+
+    void arithmetic(uint8_t opcode, Reg dst, Reg src) {
+        rexW(src, dst);
+        byte(opcode);
+        byte(0xC0 | low(src) << 3 | low(dst));
+    }
+
+    void add(Reg dst, int8_t imm) { immediate(0, dst, imm); }
+
+    void or_(Reg dst, int8_t imm) { immediate(1, dst, imm); }
+
+    void sub(Reg dst, int8_t imm) { immediate(5, dst, imm); }
+
+    void xor_(Reg dst, int8_t imm) { immediate(6, dst, imm); }
+
+    void sub(Reg dst, int32_t imm) {
+        rexW(Reg::RAX, dst);
+        byte(0x81);
+        byte(0xC0 | 5 << 3 | low(dst));
+        u32(static_cast<uint32_t>(imm));
+    }
+
+    void immediate(uint8_t extension, Reg dst, int8_t imm) {
+        rexW(Reg::RAX, dst);
+        byte(0x83);
+        byte(0xC0 | extension << 3 | low(dst));
+        byte(static_cast<uint8_t>(imm));
+    }
+
+    void movsdLoad(int xmm, Reg base, int32_t disp) {
+        byte(0xF2);
+        rex(xmm, to_integral(base));
+        byte(0x0F);
+        byte(0x10);
+        memory(xmm, base, disp);
+    }
+
+    void movsdStore(Reg base, int32_t disp, int xmm) {
+        byte(0xF2);
+        rex(xmm, to_integral(base));
+        byte(0x0F);
+        byte(0x11);
+        memory(xmm, base, disp);
+    }
+
+    // Register-to-register SSE: addsd 58, mulsd 59, subsd 5C, divsd 5E
+    // (prefix F2); ucomisd 2E, movapd 28 (prefix 66).
+    void sse(uint8_t prefix, uint8_t opcode, int dst, int src) {
+        byte(prefix);
+        rex(dst, src);
+        byte(0x0F);
+        byte(opcode);
+        byte(static_cast<uint8_t>(0xC0 | (dst & 7) << 3 | (src & 7)));
+    }
+
+    void movapd(int dst, int src) {
+        if (dst != src) sse(0x66, 0x28, dst, src);
+    }
+
+    void movq(int xmm, Reg src) {
+        byte(0x66);
+        byte(0x48 | (xmm >= 8 ? 4 : 0) | (high(src) ? 1 : 0));
+        byte(0x0F);
+        byte(0x6E);
+        byte(0xC0 | (xmm & 7) << 3 | low(src));
+    }
+
+    void movq(Reg dst, int xmm) {
+        byte(0x66);
+        byte(0x48 | (xmm >= 8 ? 4 : 0) | (high(dst) ? 1 : 0));
+        byte(0x0F);
+        byte(0x7E);
+        byte(0xC0 | (xmm & 7) << 3 | low(dst));
+    }
+
+    // SETcc into al (or cl).
+    void setcc(Cond cond, Reg dst = Reg::RAX) {
+        byte(0x0F);
+        byte(0x90 | to_integral(cond));
+        byte(0xC0 | low(dst));
+    }
+
+    void andAlCl() {
+        byte(0x20);
+        byte(0xC8);
+    }
+
+    void orAlCl() {
+        byte(0x08);
+        byte(0xC8);
+    }
+
+    void movzxEaxAl() {
+        byte(0x0F);
+        byte(0xB6);
+        byte(0xC0);
+    }
+
+    void movEax(uint32_t imm) {
+        byte(0xB8);
+        u32(imm);
+    }
+
+    void testEax() {
+        byte(0x85);
+        byte(0xC0);
+    }
+
+    void cmpEax(int8_t imm) {
+        byte(0x83);
+        byte(0xF8);
+        byte(static_cast<uint8_t>(imm));
+    }
+
+    void call(const void *function) {
+        mov(Reg::RAX, reinterpret_cast<uint64_t>(function));
+        byte(0xFF);
+        byte(0xD0);
+    }
+
+    void ret() { byte(0xC3); }
+
+    int jmp() {
+        byte(0xE9);
+        u32(0);
+        return size() - 4;
+    }
+
+    int jcc(Cond cond) {
+        byte(0x0F);
+        byte(0x80 | to_integral(cond));
+        u32(0);
+        return size() - 4;
+    }
+
+    void patch(int at, int target) {
+        auto rel = static_cast<int32_t>(target - (at + 4));
+        std::memcpy(&bytes[at], &rel, sizeof(rel));
+    }
+
+    void bind(int at) { patch(at, size()); }
+};
+
+
+#endif //CPPLOX_NATIVE_H
@@ -0,0 +1,26 @@
+#include "nursery.h"
+
+static constexpr size_t alignUp(size_t size) {
+    constexpr auto alignment = alignof(std::max_align_t);
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+Nursery::Nursery(size_t capacity) :
+        memory{new std::byte[capacity]}, top{memory.get()}, end{memory.get() + capacity} {}
+
+void *Nursery::allocate(size_t size) {
+    size = alignUp(size);
+    if (static_cast<size_t>(end - top) < size) return nullptr;
+
+    auto result = top;
+    top += size;
+    return result;
+}
+
+bool Nursery::accepts(size_t size) const {
+    return alignUp(size) <= static_cast<size_t>(end - memory.get()) / 8;
+}
+
+void Nursery::reset() {
+    top = memory.get();
+}
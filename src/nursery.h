@@ -0,0 +1,35 @@
+#ifndef CPPLOX_NURSERY_H
+#define CPPLOX_NURSERY_H
+
+
+#include <cstddef>
+#include <memory>
+#include "object.h"
+
+// Young generation: a fixed block that objects are bump-allocated from.
+// Everything still reachable is promoted to the old generation by a minor
+// collection, after which the whole block is reused. Objects are trivially
+// destructible, so dropping the dead ones costs nothing.
+struct Nursery {
+    explicit Nursery(size_t capacity);
+
+    void *allocate(size_t size);
+    // Whether an object of this size belongs in the nursery at all. Large
+    // objects are allocated straight into the old generation instead of being
+    // copied on promotion.
+    [[nodiscard]] bool accepts(size_t size) const;
+    [[nodiscard]] bool contains(const Obj *object) const {
+        auto address = reinterpret_cast<const std::byte *>(object);
+        return address >= memory.get() && address < top;
+    }
+
+    void reset();
+
+private:
+    std::unique_ptr<std::byte[]> memory;
+    std::byte *top;
+    std::byte *end;
+};
+
+
+#endif //CPPLOX_NURSERY_H
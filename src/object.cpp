@@ -1,17 +1,149 @@
 
 #include <fmt/core.h>
 #include "object.h"
+#include "chunk.h"
+#include "map.h"
+#include <unordered_set>
+#include <vector>
 
-ObjString::ObjString(ObjType type, Obj* next, std::string_view view) : Obj{type, next}, str{view} {
+
+uint32_t hashString(std::string_view chars) {
+    uint32_t hash = 2166136261u;
+    for (auto c: chars) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+size_t textLength(const Obj* text) {
+    if (text->type == ObjType::STRING) return static_cast<const ObjString*>(text)->length;
+    return static_cast<const ObjRope*>(text)->length;
+}
+
+void appendText(std::string& out, const Obj* text) {
+    std::vector<const Obj*> pending{text};
+    while (!pending.empty()) {
+        auto piece = pending.back();
+        pending.pop_back();
+        if (piece->type == ObjType::STRING) {
+            out += static_cast<const ObjString*>(piece)->str();
+            continue;
+        }
+
+        auto rope = static_cast<const ObjRope*>(piece);
+        if (rope->flat != nullptr) {
+            out += rope->flat->str();
+        } else {
+            pending.push_back(rope->right);
+            pending.push_back(rope->left);
+        }
+    }
 }
 
+// Without recursion, like appendText, since maps can nest as deeply as a
+// loop makes them. A map inside itself prints as {...} there.
+static void printMap(ObjMap* outermost) {
+    struct Level {
+        ObjMap* map;
+        uint32_t next;  // the next slot to look at
+        bool first;
+    };
+    std::vector<Level> levels;
+    std::unordered_set<const ObjMap*> open;
+
+    auto enter = [&](ObjMap* map) {
+        if (!open.insert(map).second) {
+            fmt::print("{{...}}");
+            return;
+        }
+        fmt::print("{{");
+        levels.push_back({map, 0, true});
+    };
+
+    enter(outermost);
+    while (!levels.empty()) {
+        auto& level = levels.back();
+        while (level.next < level.map->capacity && isUndefined(mapEntries(level.map)[2 * level.next])) ++level.next;
+        if (level.next == level.map->capacity) {
+            fmt::print("}}");
+            open.erase(level.map);
+            levels.pop_back();
+            continue;
+        }
+
+        Value* entry = &mapEntries(level.map)[2 * level.next++];
+        if (!level.first) fmt::print(", ");
+        level.first = false;
+        printValue(entry[0]);
+        fmt::print(": ");
+        if (isMap(entry[1])) {
+            enter(asMap(entry[1]));
+        } else {
+            printValue(entry[1]);
+        }
+    }
+}
 
 void printObject(Obj* obj) {
     switch (obj->type) {
         case ObjType::STRING:
-            fmt::print("{}", static_cast<ObjString*>(obj)->str);
+            fmt::print("{}", static_cast<ObjString*>(obj)->str());
+            break;
+        case ObjType::ROPE: {
+            std::string text;
+            text.reserve(textLength(obj));
+            appendText(text, obj);
+            fmt::print("{}", text);
+            break;
+        }
+        case ObjType::FUNCTION:
+            fmt::print("<fn {}>", static_cast<ObjFunction*>(obj)->name->str());
+            break;
+        case ObjType::CLASS:
+            fmt::print("{}", static_cast<ObjClass*>(obj)->name->str());
+            break;
+        case ObjType::INSTANCE:
+            fmt::print("{} instance", static_cast<ObjInstance*>(obj)->klass->name->str());
+            break;
+        case ObjType::MAP:
+            printMap(static_cast<ObjMap*>(obj));
+            break;
+        case ObjType::NATIVE:
+            fmt::print("<native fn>");
             break;
         default:
             break; // unreachable
     }
-}
\ No newline at end of file
+}
+
+size_t objectSize(Obj* obj) {
+    switch (obj->type) {
+        case ObjType::STRING:
+            return sizeof(ObjString) + stringPayload(static_cast<ObjString*>(obj)->length);
+        case ObjType::ROPE:
+            return sizeof(ObjRope);
+        case ObjType::FUNCTION:
+            return sizeof(ObjFunction);
+        case ObjType::CLASS:
+            return sizeof(ObjClass);
+        case ObjType::INSTANCE:
+            return sizeof(ObjInstance) + static_cast<ObjInstance*>(obj)->capacity * sizeof(Value);
+        case ObjType::FIELDS:
+            return sizeof(ObjFields) + static_cast<ObjFields*>(obj)->capacity * sizeof(Value);
+        case ObjType::MAP:
+            return sizeof(ObjMap);
+        case ObjType::NATIVE:
+            return sizeof(ObjNative);
+        default:
+            return 0; // unreachable
+    }
+}
+
+// Every object type is trivially destructible, so freeing is just returning
+// the storage that allocateObject took from operator new, and for a function
+// the chunk it owns.
+void freeObject(Obj* obj) {
+    if (obj->type == ObjType::FUNCTION) delete static_cast<ObjFunction*>(obj)->chunk;
+    ::operator delete(obj);
+}
@@ -1,26 +1,137 @@
-
 #ifndef CPPLOX_OBJECT_H
 #define CPPLOX_OBJECT_H
 
 
+#include <cstdint>
 #include <string>
 
 enum class ObjType{
-    STRING
+    STRING,
+    ROPE,
+    FUNCTION,
+    CLASS,
+    INSTANCE,
+    FIELDS,
+    MAP,
+    NATIVE
 };
 
+struct Chunk;
+struct VM;
+
 struct Obj {
     ObjType type;
     Obj* next;
+    bool isMarked{false};
+    bool isRemembered{false};
 };
 
+// Strings are interned: there is exactly one ObjString per distinct text, so
+// identity is equality. The FNV-1a hash is computed once at creation. The
+// characters (plus a terminating NUL) follow the header in the same
+// allocation.
 struct ObjString : public Obj {
-    std::string_view str;
+    uint32_t length;
+    uint32_t hash;
+
+    [[nodiscard]] const char* chars() const {
+        return reinterpret_cast<const char*>(this + 1);
+    }
+
+    [[nodiscard]] std::string_view str() const {
+        return {chars(), length};
+    }
+};
+
+// A lazy concatenation of two strings or ropes. The text is only assembled,
+// once, when the VM needs it as a real string; after that the rope just
+// forwards to the interned result and drops its pieces.
+struct ObjRope : public Obj {
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+    size_t length;
+};
+
+// A compiled `fun` declaration. Its chunk is allocated apart from the
+// script's per-run arena, since the function can outlive the run that
+// compiled it (a global in the REPL), and is deleted with the function.
+struct ObjFunction : public Obj {
+    int arity;
+    ObjString* name;
+    Chunk* chunk;
+};
+
+// A `class` declaration: a record type with no methods. Calling it makes an
+// empty instance. It tracks the most fields any of its instances has had,
+// and new instances get that many inline.
+struct ObjClass : public Obj {
+    ObjString* name;
+    uint32_t fieldCapacity;
+};
+
+struct ObjFields;
+
+// The shape (shape.h) names an instance's fields and gives their order. The
+// first `capacity` values follow the header in the same allocation, and any
+// beyond those are in `overflow`.
+struct ObjInstance : public Obj {
+    ObjClass* klass;
+    uint32_t shape;
+    uint32_t capacity;
+    ObjFields* overflow;
+};
+
+// The fields of an instance that outgrew its inline ones, or the slots of a
+// map. The values follow the header; those past the instance's field count
+// are nil.
+struct ObjFields : public Obj {
+    uint32_t capacity;
+};
 
-    ObjString(ObjType type, Obj* obj, std::string_view view);
+// A hash map from numbers, strings, booleans and nil to any value, with open
+// addressing and linear probing (map.h). `entries` holds `capacity` slots,
+// each a key and its value; a free slot's key is undefined_val(). Maps only
+// grow, and until the first store an empty map has no slots at all.
+struct ObjMap : public Obj {
+    uint32_t count;
+    uint32_t capacity;
+    ObjFields* entries;
 };
 
+// Runs a function written in C++. The arguments are the top `argc` values on
+// the stack, with the native below them; it replaces all of them by its
+// result, or reports a runtime error and returns false.
+using NativeFn = bool (*)(VM& vm, int argc);
+
+struct ObjNative : public Obj {
+    NativeFn function;
+    int arity;
+    ObjString* name;
+};
+
+inline bool isText(const Obj* obj) {
+    return obj->type == ObjType::STRING || obj->type == ObjType::ROPE;
+}
+
+size_t textLength(const Obj* text);
+
+// Appends the characters of a string or rope without recursion, so ropes
+// built by long loops cannot overflow the native stack.
+void appendText(std::string& out, const Obj* text);
+
+uint32_t hashString(std::string_view chars);
+
+// Number of bytes stored inline after an ObjString header for `length` chars.
+constexpr size_t stringPayload(size_t length) {
+    return length + 1;
+}
+
 void printObject(Obj* obj);
 
+void freeObject(Obj* obj);
+
+size_t objectSize(Obj* obj);
+
 
 #endif //CPPLOX_OBJECT_H
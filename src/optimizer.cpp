@@ -0,0 +1,389 @@
+#include "optimizer.h"
+
+// Passes rewrite nodes in place and never add any, so references into
+// ast.nodes stay valid while a pass runs.
+struct Optimizer {
+    Ast &ast;
+    // Indexed by the VAR node of a local: VARIABLE nodes still reading it.
+    std::vector<int> reads{};
+
+    static bool isConstant(const Node &node) {
+        switch (node.kind) {
+            case NodeKind::NUMBER:
+            case NodeKind::STRING:
+            case NodeKind::TRUE:
+            case NodeKind::FALSE:
+            case NodeKind::NIL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    static bool isTruthy(const Node &node) {
+        return node.kind != NodeKind::FALSE && node.kind != NodeKind::NIL;
+    }
+
+    // valuesEqual on constants; strings are interned, so equal text is the same string.
+    static bool equal(const Node &a, const Node &b) {
+        if (a.kind != b.kind) return false;
+        if (a.kind == NodeKind::NUMBER) return a.number == b.number;
+        if (a.kind == NodeKind::STRING) return a.text == b.text;
+        return true;
+    }
+
+    // Overwrites a node, keeping its place in a statement list.
+    void replace(NodeId id, Node replacement) {
+        replacement.next = ast[id].next;
+        ast[id] = std::move(replacement);
+    }
+
+    void replace(NodeId id, NodeId with) {
+        replace(id, Node{ast[with]});
+    }
+
+    void removeStatement(NodeId id) {
+        replace(id, Node{NodeKind::BLOCK, ast[id].token});
+    }
+
+    void makeNumber(NodeId id, double value) {
+        replace(id, Node{NodeKind::NUMBER, ast[id].token, value});
+    }
+
+    void makeBool(NodeId id, bool value) {
+        replace(id, Node{value ? NodeKind::TRUE : NodeKind::FALSE, ast[id].token});
+    }
+
+//  Constant folding
+
+    void fold(NodeId id) {
+        if (id == NO_NODE) return;
+        switch (ast[id].kind) {
+            case NodeKind::ASSIGN:
+            case NodeKind::GET:
+                fold(ast[id].a);
+                break;
+            case NodeKind::SET:
+            case NodeKind::INDEX:
+                fold(ast[id].a);
+                fold(ast[id].b);
+                break;
+            case NodeKind::SET_INDEX:
+                fold(ast[id].a);
+                fold(ast[id].b);
+                fold(ast[id].c);
+                break;
+            case NodeKind::UNARY:
+                foldUnary(id);
+                break;
+            case NodeKind::BINARY:
+                foldBinary(id);
+                break;
+            case NodeKind::AND:
+            case NodeKind::OR:
+                foldLogical(id);
+                break;
+            case NodeKind::CALL:
+            case NodeKind::MAP:
+                fold(ast[id].a);
+                for (NodeId argument = ast[id].b; argument != NO_NODE; argument = ast[argument].next) fold(argument);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void foldUnary(NodeId id) {
+        fold(ast[id].a);
+        const Node &operand = ast[ast[id].a];
+        if (!isConstant(operand)) return;
+        if (ast[id].token.type == TokenType::BANG) {
+            makeBool(id, !isTruthy(operand));
+        } else if (operand.kind == NodeKind::NUMBER) {
+            makeNumber(id, -operand.number);
+        }
+    }
+
+    // Operands of the wrong type are left alone: the runtime reports those.
+    void foldBinary(NodeId id) {
+        fold(ast[id].a);
+        fold(ast[id].b);
+        const Node &left = ast[ast[id].a];
+        const Node &right = ast[ast[id].b];
+        if (!isConstant(left) || !isConstant(right)) return;
+
+        TokenType type = ast[id].token.type;
+        if (type == TokenType::EQUAL_EQUAL || type == TokenType::BANG_EQUAL) {
+            makeBool(id, equal(left, right) == (type == TokenType::EQUAL_EQUAL));
+            return;
+        }
+        if (type == TokenType::PLUS && left.kind == NodeKind::STRING && right.kind == NodeKind::STRING) {
+            std::string &text = ast.strings.emplace_back(left.text);
+            text += right.text;
+            Node folded{NodeKind::STRING, ast[id].token};
+            folded.text = text;
+            replace(id, folded);
+            return;
+        }
+        if (left.kind != NodeKind::NUMBER || right.kind != NodeKind::NUMBER) return;
+
+        double a = left.number;
+        double b = right.number;
+        switch (type) {
+            case TokenType::PLUS:          makeNumber(id, a + b); break;
+            case TokenType::MINUS:         makeNumber(id, a - b); break;
+            case TokenType::STAR:          makeNumber(id, a * b); break;
+            case TokenType::SLASH:         makeNumber(id, a / b); break;
+            case TokenType::GREATER:       makeBool(id, a > b); break;
+            case TokenType::GREATER_EQUAL: makeBool(id, a >= b); break;
+            case TokenType::LESS:          makeBool(id, a < b); break;
+            case TokenType::LESS_EQUAL:    makeBool(id, a <= b); break;
+            default:                       break;
+        }
+    }
+
+    // A constant left operand decides which operand is the result.
+    void foldLogical(NodeId id) {
+        fold(ast[id].a);
+        fold(ast[id].b);
+        const Node &left = ast[ast[id].a];
+        if (!isConstant(left)) return;
+        bool isLeft = isTruthy(left) == (ast[id].kind == NodeKind::OR);
+        replace(id, isLeft ? ast[id].a : ast[id].b);
+    }
+
+//  Folding and branch pruning over statements
+
+    void statements(NodeId first) {
+        for (NodeId id = first; id != NO_NODE; id = ast[id].next) statement(id);
+    }
+
+    void statement(NodeId id) {
+        switch (ast[id].kind) {
+            case NodeKind::PRINT:
+            case NodeKind::EXPRESSION:
+            case NodeKind::VAR:
+            case NodeKind::RETURN:
+                fold(ast[id].a);
+                break;
+            case NodeKind::FUN:
+                statements(ast[id].b);
+                break;
+            case NodeKind::BLOCK:
+                statements(ast[id].a);
+                break;
+            case NodeKind::IF: {
+                fold(ast[id].a);
+                statement(ast[id].b);
+                if (ast[id].c != NO_NODE) statement(ast[id].c);
+                const Node &condition = ast[ast[id].a];
+                if (!isConstant(condition)) break;
+                if (isTruthy(condition)) {
+                    replace(id, ast[id].b);
+                } else if (ast[id].c != NO_NODE) {
+                    replace(id, ast[id].c);
+                } else {
+                    removeStatement(id);
+                }
+                break;
+            }
+            case NodeKind::WHILE: {
+                fold(ast[id].a);
+                statement(ast[id].b);
+                const Node &condition = ast[ast[id].a];
+                if (!isConstant(condition)) break;
+                if (isTruthy(condition)) {
+                    ast[id].a = NO_NODE;
+                } else {
+                    removeStatement(id);
+                }
+                break;
+            }
+            case NodeKind::FOR: {
+                if (ast[id].a != NO_NODE) statement(ast[id].a);
+                fold(ast[id].b);
+                fold(ast[id].c);
+                statement(ast[id].d);
+                if (ast[id].b == NO_NODE || !isConstant(ast[ast[id].b])) break;
+                if (isTruthy(ast[ast[id].b])) {
+                    ast[id].b = NO_NODE;
+                } else {
+                    // Only the initializer runs, still in the loop's scope.
+                    Node block{NodeKind::BLOCK, ast[id].token};
+                    block.a = ast[id].a;
+                    replace(id, block);
+                }
+                break;
+            }
+            case NodeKind::FOR_IN:
+                fold(ast[id].a);
+                statement(ast[id].b);
+                break;
+            default:
+                break;
+        }
+    }
+
+//  Dead-store elimination
+
+    void countReads(NodeId first) {
+        for (NodeId id = first; id != NO_NODE; id = ast[id].next) {
+            const Node &node = ast[id];
+            if (node.kind == NodeKind::VARIABLE && node.decl != NO_NODE) reads[node.decl]++;
+            for (NodeId child: {node.a, node.b, node.c, node.d}) {
+                if (child != NO_NODE) countReads(child);
+            }
+        }
+    }
+
+    [[nodiscard]] bool isDead(NodeId decl) const {
+        return decl != NO_NODE && reads[decl] == 0;
+    }
+
+    // Evaluating the expression can neither fail nor change anything.
+    // Reading a global can fail, if it is undefined. A call can do anything,
+    // except touch the caller's locals.
+    [[nodiscard]] bool isPure(NodeId id) const {
+        const Node &node = ast[id];
+        switch (node.kind) {
+            case NodeKind::VARIABLE:
+                return node.decl != NO_NODE;
+            case NodeKind::UNARY:
+                return node.token.type == TokenType::BANG && isPure(node.a);
+            case NodeKind::AND:
+            case NodeKind::OR:
+                return isPure(node.a) && isPure(node.b);
+            default:
+                return isConstant(node);
+        }
+    }
+
+    [[nodiscard]] bool readsLocal(NodeId id, NodeId decl) const {
+        if (id == NO_NODE) return false;
+        const Node &node = ast[id];
+        if (node.kind == NodeKind::VARIABLE) return node.decl == decl;
+        if (node.kind == NodeKind::CALL || node.kind == NodeKind::MAP) {
+            for (NodeId argument = node.b; argument != NO_NODE; argument = ast[argument].next) {
+                if (readsLocal(argument, decl)) return true;
+            }
+            return readsLocal(node.a, decl);
+        }
+        return readsLocal(node.a, decl) || readsLocal(node.b, decl) || readsLocal(node.c, decl);
+    }
+
+    // Whether statement `first` only stores a value into a local that the
+    // statement right after it overwrites without reading.
+    [[nodiscard]] bool isOverwritten(NodeId first, NodeId second) const {
+        const Node &a = ast[first];
+        const Node &b = ast[second];
+        if (a.kind != NodeKind::EXPRESSION || b.kind != NodeKind::EXPRESSION) return false;
+        const Node &store = ast[a.a];
+        const Node &overwrite = ast[b.a];
+        return store.kind == NodeKind::ASSIGN && store.decl != NO_NODE && isPure(store.a) &&
+               overwrite.kind == NodeKind::ASSIGN && overwrite.decl == store.decl && !readsLocal(overwrite.a, store.decl);
+    }
+
+    // Stores to dead locals become just their values.
+    bool removeStores(NodeId id) {
+        if (id == NO_NODE) return false;
+        bool changed = false;
+        while (ast[id].kind == NodeKind::ASSIGN && isDead(ast[id].decl)) {
+            replace(id, ast[id].a);
+            changed = true;
+        }
+        changed |= removeStores(ast[id].a);
+        if (ast[id].kind == NodeKind::CALL || ast[id].kind == NodeKind::MAP) {
+            for (NodeId argument = ast[id].b; argument != NO_NODE; argument = ast[argument].next) {
+                changed |= removeStores(argument);
+            }
+        } else {
+            changed |= removeStores(ast[id].b);
+            changed |= removeStores(ast[id].c);
+        }
+        return changed;
+    }
+
+    bool eliminateList(NodeId first) {
+        bool changed = false;
+        for (NodeId id = first; id != NO_NODE; id = ast[id].next) {
+            changed |= eliminate(id);
+            if (ast[id].next != NO_NODE && isOverwritten(id, ast[id].next)) {
+                removeStatement(id);
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool eliminate(NodeId id) {
+        Node &node = ast[id];
+        bool changed = false;
+        switch (node.kind) {
+            case NodeKind::PRINT:
+                return removeStores(node.a);
+            case NodeKind::EXPRESSION:
+                changed = removeStores(node.a);
+                if (isPure(ast[id].a)) {
+                    removeStatement(id);
+                    changed = true;
+                }
+                return changed;
+            case NodeKind::VAR:
+                if (node.a != NO_NODE) changed = removeStores(node.a);
+                if (!ast[id].local || !isDead(id)) return changed;
+                // Keep the initializer's side effects, if any.
+                if (ast[id].a == NO_NODE || isPure(ast[id].a)) {
+                    removeStatement(id);
+                } else {
+                    Node value{NodeKind::EXPRESSION, ast[id].token};
+                    value.a = ast[id].a;
+                    replace(id, value);
+                }
+                return true;
+            case NodeKind::BLOCK:
+                return eliminateList(node.a);
+            case NodeKind::IF:
+                changed |= removeStores(node.a);
+                changed |= eliminate(node.b);
+                if (node.c != NO_NODE) changed |= eliminate(node.c);
+                return changed;
+            case NodeKind::WHILE:
+                changed |= removeStores(node.a);
+                changed |= eliminate(node.b);
+                return changed;
+            case NodeKind::FOR:
+                if (node.a != NO_NODE) changed |= eliminate(node.a);
+                changed |= removeStores(node.b);
+                changed |= removeStores(node.c);
+                changed |= eliminate(node.d);
+                return changed;
+            case NodeKind::FOR_IN:
+                changed |= removeStores(node.a);
+                changed |= eliminate(node.b);
+                return changed;
+            case NodeKind::FUN:
+                return eliminateList(node.b);
+            case NodeKind::RETURN:
+                return removeStores(node.a);
+            default:
+                return false;
+        }
+    }
+
+    void run() {
+        statements(ast.root);
+        // Removing one store can leave others dead, so repeat to a fixed point.
+        bool changed = true;
+        while (changed) {
+            reads.assign(ast.nodes.size(), 0);
+            countReads(ast.root);
+            changed = eliminateList(ast.root);
+        }
+        // Dead stores gone, some conditions may have become constant.
+        statements(ast.root);
+    }
+};
+
+void optimize(Ast &ast) {
+    Optimizer{ast}.run();
+}
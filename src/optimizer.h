@@ -0,0 +1,16 @@
+#ifndef CPPLOX_OPTIMIZER_H
+#define CPPLOX_OPTIMIZER_H
+
+#include "ast.h"
+
+// The -O1 passes, run in order over the whole tree:
+//  - constant folding of number, boolean and string-literal expressions,
+//    leaving anything that would be a runtime error for the runtime;
+//  - branch pruning: if, while and for on a constant condition;
+//  - dead-store elimination for locals: stores to locals nothing reads, and
+//    stores overwritten by the next statement, go away with the locals'
+//    declarations when their values have no side effects.
+void optimize(Ast &ast);
+
+
+#endif //CPPLOX_OPTIMIZER_H
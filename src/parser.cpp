@@ -0,0 +1,82 @@
+#include "parser.h"
+#include <fmt/core.h>
+
+Parser::Parser(std::string_view source) : scanner{source} {}
+
+void Parser::consume(TokenType type, std::string_view message) {
+    if (current.type == type) {
+        advance();
+        return;
+    }
+
+    errorAtCurrent(message);
+}
+
+bool Parser::match(TokenType type) {
+    if (!check(type)) return false;
+    advance();
+    return true;
+}
+
+bool Parser::check(TokenType type) const {
+    return current.type == type;
+}
+
+void Parser::advance() {
+    previous = current;
+
+    for (;;) {
+        current = scanner.scanToken();
+        if (current.type != TokenType::ERROR) break;
+
+        errorAtCurrent(current.lexeme);
+    }
+}
+
+void Parser::error(std::string_view message) {
+    errorAt(previous, message);
+}
+
+void Parser::errorAt(const Token &token, std::string_view message) {
+    if (panicMode) return;
+    panicMode = true;
+    fprintf(stderr, "[line %d] Error", token.line);
+
+    if (token.type == TokenType::EOFILE) {
+        fprintf(stderr, " at end");
+    } else if (token.type == TokenType::ERROR) {
+        // Nothing.
+    } else {
+        fmt::print(stderr, " at {}", token.lexeme);
+    }
+
+    fmt::print(stderr, ": {}\n", message);
+    hadError = true;
+}
+
+void Parser::errorAtCurrent(std::string_view message) {
+    errorAt(current, message);
+}
+
+void Parser::synchronize() {
+    panicMode = false;
+
+    while (current.type != TokenType::EOFILE) {
+        if (previous.type == TokenType::SEMICOLON) return;
+        switch (current.type) {
+            case TokenType::CLASS:
+            case TokenType::FUN:
+            case TokenType::VAR:
+            case TokenType::FOR:
+            case TokenType::IF:
+            case TokenType::WHILE:
+            case TokenType::PRINT:
+            case TokenType::RETURN:
+                return;
+
+            default:
+                ; // do nothin
+        }
+        advance();
+    }
+}
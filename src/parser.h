@@ -0,0 +1,49 @@
+#ifndef CPPLOX_PARSER_H
+#define CPPLOX_PARSER_H
+
+#include <string_view>
+#include "scanner.h"
+
+enum class Precedence {
+    NONE,
+    ASSIGNMENT,  // =
+    OR,          // or
+    AND,         // and
+    EQUALITY,    // == !=
+    COMPARISON,  // < > <= >=
+    TERM,        // + -
+    FACTOR,      // * /
+    UNARY,       // ! -
+    CALL,        // . ()
+    PRIMARY
+};
+
+// Token stream and error state shared by the compiler backends.
+struct Parser {
+    Scanner scanner;
+    Token current{};
+    Token previous{};
+    bool hadError{};
+    bool panicMode{};
+
+    explicit Parser(std::string_view source);
+
+    void advance();
+
+    void consume(TokenType type, std::string_view message);
+
+    bool match(TokenType type);
+
+    [[nodiscard]] bool check(TokenType type) const;
+
+    void error(std::string_view message);
+
+    void errorAt(const Token &token, std::string_view message);
+
+    void errorAtCurrent(std::string_view message);
+
+    void synchronize();
+};
+
+
+#endif //CPPLOX_PARSER_H
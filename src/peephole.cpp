@@ -0,0 +1,354 @@
+#include "peephole.h"
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+// Longer chains of jumps are taken to be cycles.
+constexpr const int MAX_THREAD_HOPS = 16;
+
+struct Instruction {
+    OP op;
+    uint8_t operands[MAX_INSTRUCTION_LENGTH - 1]{};
+    int line{};
+    int offset{};       // in the code as compiled
+    int target{-1};     // jumps: index of the instruction they land on
+    bool removed{};
+    bool far{};         // jumps: encoded through JUMP_LONG
+};
+
+static bool isJump(OP op) {
+    switch (op) {
+        case OP::JUMP:
+        case OP::JUMP_IF_TRUE:
+        case OP::JUMP_IF_FALSE:
+        case OP::LOOP:
+        case OP::POP_JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_TRUE:
+        case OP::JUMP_IF_NOT_LESS:
+        case OP::JUMP_IF_NOT_LESS_EQUAL:
+        case OP::JUMP_IF_NOT_GREATER:
+        case OP::JUMP_IF_NOT_GREATER_EQUAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isUnconditional(OP op) {
+    return op == OP::JUMP || op == OP::LOOP;
+}
+
+static bool isCompareJump(OP op) {
+    return op == OP::JUMP_IF_NOT_LESS || op == OP::JUMP_IF_NOT_LESS_EQUAL ||
+           op == OP::JUMP_IF_NOT_GREATER || op == OP::JUMP_IF_NOT_GREATER_EQUAL;
+}
+
+// The test a compare-and-jump makes, as a standalone instruction.
+static OP comparison(OP op) {
+    switch (op) {
+        case OP::JUMP_IF_NOT_LESS:          return OP::LESS;
+        case OP::JUMP_IF_NOT_LESS_EQUAL:    return OP::LESS_EQUAL;
+        case OP::JUMP_IF_NOT_GREATER:       return OP::GREATER;
+        default:                            return OP::GREATER_EQUAL;
+    }
+}
+
+// The conditional jump taken exactly when `op` is not, with the same effect on the stack.
+static OP inverted(OP op) {
+    switch (op) {
+        case OP::JUMP_IF_TRUE:      return OP::JUMP_IF_FALSE;
+        case OP::JUMP_IF_FALSE:     return OP::JUMP_IF_TRUE;
+        case OP::POP_JUMP_IF_FALSE: return OP::POP_JUMP_IF_TRUE;
+        default:                    return OP::POP_JUMP_IF_FALSE;
+    }
+}
+
+// Pushes a value, and can neither fail nor change anything.
+static bool isPurePush(OP op) {
+    switch (op) {
+        case OP::CONSTANT:
+        case OP::CONSTANT_LONG:
+        case OP::NIL:
+        case OP::TRUE:
+        case OP::FALSE:
+        case OP::GET_LOCAL:
+        case OP::GET_LOCAL_LONG:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int popCount(const Instruction &instruction) {
+    return instruction.op == OP::POPN ? instruction.operands[0] : 1;
+}
+
+class PeepholeOptimizer {
+    std::vector<Instruction> code;
+    int size{};
+    int originalSize{};
+    // Start of each instruction once encoded, plus the end of the code.
+    std::vector<int> offsets;
+
+    // `index`, or the first instruction after it still there.
+    [[nodiscard]] int live(int index) const {
+        while (index < size && code[index].removed) ++index;
+        return index;
+    }
+
+    [[nodiscard]] int nextLive(int index) const { return live(index + 1); }
+
+    // Where a jump from `from` ends up. JUMP_IF_FALSE and JUMP_IF_TRUE leave
+    // their value on the stack, so landing on the same test takes it again.
+    [[nodiscard]] int destination(int from) const {
+        OP op = code[from].op;
+        int target = live(code[from].target);
+        for (int hops = 0; target < size; ++hops) {
+            const Instruction &next = code[target];
+            bool passesThrough = isUnconditional(next.op) ||
+                                 (next.op == op && (op == OP::JUMP_IF_FALSE || op == OP::JUMP_IF_TRUE));
+            if (!passesThrough) break;
+            // A cycle: some code loops forever, leave it be.
+            if (hops == MAX_THREAD_HOPS) return live(code[from].target);
+            target = live(next.target);
+        }
+        return target;
+    }
+
+    bool threadJumps() {
+        bool changed = false;
+        for (int i = live(0); i < size; i = nextLive(i)) {
+            Instruction &jump = code[i];
+            if (!isJump(jump.op)) continue;
+            int target = destination(i);
+            // Only JUMP and LOOP can go either way. A JUMP threaded through
+            // to a LOOP becomes a second back-edge, ahead of code that is
+            // still in the loop; the trace JIT takes a loop's extent from
+            // all of its back-edges for that reason.
+            if ((isUnconditional(jump.op) || target > i) && target != live(jump.target)) {
+                jump.target = target;
+                changed = true;
+            }
+            if (jump.op == OP::JUMP && live(jump.target) == nextLive(i)) {
+                jump.removed = true;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool combinePairs() {
+        std::vector<bool> targeted(size + 1);
+        for (int i = live(0); i < size; i = nextLive(i)) {
+            if (isJump(code[i].op)) targeted[live(code[i].target)] = true;
+        }
+
+        bool changed = false;
+        for (int i = live(0); i < size;) {
+            int j = nextLive(i);
+            if (j >= size || targeted[j]) {
+                i = j;
+                continue;
+            }
+            Instruction &first = code[i];
+            Instruction &second = code[j];
+            if (isPurePush(first.op) && second.op == OP::POP) {
+                first.removed = true;
+                second.removed = true;
+            } else if (isPurePush(first.op) && second.op == OP::POPN) {
+                first.removed = true;
+                if (--second.operands[0] == 1) second.op = OP::POP;
+            } else if (first.op == OP::NOT && second.op == OP::POP_JUMP_IF_FALSE) {
+                first.removed = true;
+                second.op = OP::POP_JUMP_IF_TRUE;
+            } else if (first.op == OP::NOT && second.op == OP::POP_JUMP_IF_TRUE) {
+                first.removed = true;
+                second.op = OP::POP_JUMP_IF_FALSE;
+            } else if ((first.op == OP::POP || first.op == OP::POPN) && (second.op == OP::POP || second.op == OP::POPN) &&
+                       popCount(first) + popCount(second) <= std::numeric_limits<uint8_t>::max()) {
+                first.operands[0] = static_cast<uint8_t>(popCount(first) + popCount(second));
+                first.op = OP::POPN;
+                second.removed = true;
+                // Keep folding the run into `first`.
+                changed = true;
+                continue;
+            } else {
+                i = j;
+                continue;
+            }
+            changed = true;
+            i = live(i);
+        }
+        return changed;
+    }
+
+    bool removeUnreachable() {
+        std::vector<bool> reached(size);
+        std::vector<int> work{live(0)};
+        while (!work.empty()) {
+            int i = work.back();
+            work.pop_back();
+            if (i >= size || reached[i]) continue;
+            reached[i] = true;
+            const Instruction &instruction = code[i];
+            if (isJump(instruction.op)) work.push_back(live(instruction.target));
+            if (!isUnconditional(instruction.op) && instruction.op != OP::RETURN && instruction.op != OP::TAIL_CALL) {
+                work.push_back(nextLive(i));
+            }
+        }
+
+        bool changed = false;
+        for (int i = 0; i < size; ++i) {
+            if (!code[i].removed && !reached[i]) {
+                code[i].removed = true;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    // A far JUMP or LOOP is a JUMP_LONG. A far conditional jump becomes the
+    // inverted jump over a JUMP_LONG, and a far compare-and-jump the
+    // comparison followed by that pair.
+    [[nodiscard]] int encodedLength(const Instruction &instruction) const {
+        int length = instructionLength(instruction.op);
+        if (!instruction.far) return length;
+        if (isUnconditional(instruction.op)) return instructionLength(OP::JUMP_LONG);
+        if (isCompareJump(instruction.op)) length = 1 + instructionLength(OP::POP_JUMP_IF_TRUE);
+        return length + instructionLength(OP::JUMP_LONG);
+    }
+
+    // Branch relaxation: every jump starts short and goes far once its
+    // distance no longer fits 16 bits. That only ever lengthens the code, so
+    // the layout settles.
+    void layout() {
+        offsets.assign(size + 1, 0);
+        bool grew = true;
+        while (grew) {
+            int offset = 0;
+            for (int i = 0; i < size; ++i) {
+                offsets[i] = offset;
+                if (!code[i].removed) offset += encodedLength(code[i]);
+            }
+            offsets[size] = offset;
+
+            grew = false;
+            for (int i = live(0); i < size; i = nextLive(i)) {
+                Instruction &jump = code[i];
+                if (!isJump(jump.op) || jump.far) continue;
+                int distance = offsets[jump.target] - (offsets[i] + 3);
+                if (isUnconditional(jump.op)) distance = std::abs(distance);
+                if (distance < 0 || distance > std::numeric_limits<uint16_t>::max()) {
+                    jump.far = true;
+                    grew = true;
+                }
+            }
+        }
+    }
+
+    static void writeJump(Chunk &chunk, OP op, int distance, int line) {
+        chunk.writeChunk(op, line);
+        chunk.writeChunk(static_cast<uint8_t>(distance >> 8), line);
+        chunk.writeChunk(static_cast<uint8_t>(distance & 0xff), line);
+    }
+
+    void writeFarJump(Chunk &chunk, const Instruction &jump) const {
+        if (!isUnconditional(jump.op)) {
+            if (isCompareJump(jump.op)) {
+                chunk.writeChunk(comparison(jump.op), jump.line);
+                writeJump(chunk, OP::POP_JUMP_IF_TRUE, instructionLength(OP::JUMP_LONG), jump.line);
+            } else {
+                writeJump(chunk, inverted(jump.op), instructionLength(OP::JUMP_LONG), jump.line);
+            }
+        }
+        auto from = static_cast<int>(chunk.code.size()) + instructionLength(OP::JUMP_LONG);
+        auto distance = static_cast<uint32_t>(offsets[jump.target] - from);
+        chunk.writeChunk(OP::JUMP_LONG, jump.line);
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            chunk.writeChunk(static_cast<uint8_t>(distance >> shift), jump.line);
+        }
+    }
+
+public:
+    PeepholeOptimizer(const Chunk &chunk, const FarJumps &farJumps) {
+        std::vector<int> lines;
+        lines.reserve(chunk.code.size());
+        for (auto &info: chunk.lines) lines.insert(lines.end(), info.num_instructions, info.line_no);
+
+        originalSize = static_cast<int>(chunk.code.size());
+        std::vector<int> indexAt(originalSize + 1, -1);
+        for (int offset = 0; offset < originalSize;) {
+            Instruction instruction{static_cast<OP>(chunk.code[offset])};
+            instruction.line = lines[offset];
+            instruction.offset = offset;
+            int length = instructionLength(instruction.op);
+            const uint8_t *at = &chunk.code[offset];
+            // Jump targets are offsets until every instruction has an index.
+            if (instruction.op == OP::JUMP_LONG) {
+                instruction.op = OP::JUMP;
+                instruction.target = offset + length + readInt(at + 1);
+            } else if (auto far = farJumps.find(offset); far != farJumps.end()) {
+                instruction.target = far->second;
+            } else if (isJump(instruction.op)) {
+                int sign = instruction.op == OP::LOOP ? -1 : 1;
+                instruction.target = offset + length + sign * readShort(at + 1);
+            } else {
+                for (int i = 1; i < length; ++i) instruction.operands[i - 1] = at[i];
+            }
+            indexAt[offset] = static_cast<int>(code.size());
+            code.push_back(instruction);
+            offset += length;
+        }
+        size = static_cast<int>(code.size());
+        indexAt[originalSize] = size;
+
+        for (auto &instruction: code) {
+            if (isJump(instruction.op)) instruction.target = indexAt[instruction.target];
+        }
+    }
+
+    void optimize() {
+        bool changed = true;
+        while (changed) {
+            changed = threadJumps();
+            changed |= combinePairs();
+            changed |= removeUnreachable();
+        }
+    }
+
+    // Writes the surviving instructions back with relocated jumps.
+    PeepholeStats encode(Chunk &chunk) {
+        layout();
+        chunk.code.clear();
+        chunk.lines.clear();
+        int kept = 0;
+        for (Instruction instruction: code) {
+            if (instruction.removed) continue;
+            kept++;
+            if (instruction.far) {
+                writeFarJump(chunk, instruction);
+            } else if (isJump(instruction.op)) {
+                int from = static_cast<int>(chunk.code.size()) + 3;
+                int to = offsets[instruction.target];
+                if (isUnconditional(instruction.op)) instruction.op = to < from ? OP::LOOP : OP::JUMP;
+                writeJump(chunk, instruction.op, std::abs(to - from), instruction.line);
+            } else {
+                chunk.writeChunk(instruction.op, instruction.line);
+                for (int i = 1; i < instructionLength(instruction.op); ++i) {
+                    chunk.writeChunk(instruction.operands[i - 1], instruction.line);
+                }
+            }
+        }
+        return {size - kept, originalSize - static_cast<int>(chunk.code.size())};
+    }
+};
+
+PeepholeStats peephole(Chunk &chunk, const FarJumps &farJumps) {
+    PeepholeOptimizer optimizer{chunk, farJumps};
+    optimizer.optimize();
+    return optimizer.encode(chunk);
+}
+
+void relaxJumps(Chunk &chunk, const FarJumps &farJumps) {
+    PeepholeOptimizer{chunk, farJumps}.encode(chunk);
+}
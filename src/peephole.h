@@ -0,0 +1,40 @@
+#ifndef CPPLOX_PEEPHOLE_H
+#define CPPLOX_PEEPHOLE_H
+
+#include "chunk.h"
+#include <unordered_map>
+
+// What the peephole pass took out of one or more chunks.
+struct PeepholeStats {
+    int instructions{};
+    int bytes{};
+
+    PeepholeStats &operator+=(const PeepholeStats &other) {
+        instructions += other.instructions;
+        bytes += other.bytes;
+        return *this;
+    }
+};
+
+// Jumps the compiler could not fit in their 16-bit operand, by offset of the
+// instruction: the offset they land on. Their operand bytes mean nothing.
+using FarJumps = std::unordered_map<int, int>;
+
+// Rewrites finished stack code in place, to a fixed point:
+//  - jumps landing on unconditional jumps (or, for the value-keeping
+//    conditional jumps, on the same test) go straight to the final target,
+//    and jumps to the next instruction go away;
+//  - NOT before a popping conditional jump becomes the inverted jump;
+//  - a constant or local pushed only to be popped is dropped;
+//  - runs of POP become one POPN;
+//  - instructions no path reaches are removed.
+// Jumps are kept as instruction indices while the code is rewritten and
+// encoded again at the end, so every offset is relocated, and each
+// instruction keeps its line. Jumps too long for 16 bits are relaxed into
+// JUMP_LONG forms as they are encoded.
+PeepholeStats peephole(Chunk &chunk, const FarJumps &farJumps = {});
+
+// Only the re-encoding, with jump relaxation, for when the pass is off.
+void relaxJumps(Chunk &chunk, const FarJumps &farJumps);
+
+#endif //CPPLOX_PEEPHOLE_H
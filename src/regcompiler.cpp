@@ -0,0 +1,684 @@
+#include "regcompiler.h"
+#include <algorithm>
+#include <limits>
+#include "common.h"
+#include "Disassembler.h"
+
+// Indexed by TokenType; the entries must stay in enum order.
+const std::array<RegisterCompiler::ParseRule, TOKEN_TYPE_COUNT> RegisterCompiler::rules{{
+        {&RegisterCompiler::grouping, nullptr,                   Precedence::NONE},       // TokenType::LEFT_PAREN
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::RIGHT_PAREN
+        {&RegisterCompiler::map,      nullptr,                   Precedence::NONE},       // TokenType::LEFT_BRACE
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::RIGHT_BRACE
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::LEFT_BRACKET
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::RIGHT_BRACKET
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::COLON
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::COMMA
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::DOT
+        {&RegisterCompiler::unary,    &RegisterCompiler::binary, Precedence::TERM},       // TokenType::MINUS
+        {nullptr,                     &RegisterCompiler::binary, Precedence::TERM},       // TokenType::PLUS
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::SEMICOLON
+        {nullptr,                     &RegisterCompiler::binary, Precedence::FACTOR},     // TokenType::SLASH
+        {nullptr,                     &RegisterCompiler::binary, Precedence::FACTOR},     // TokenType::STAR
+        {&RegisterCompiler::unary,    nullptr,                   Precedence::NONE},       // TokenType::BANG
+        {nullptr,                     &RegisterCompiler::binary, Precedence::EQUALITY},   // TokenType::BANG_EQUAL
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::EQUAL
+        {nullptr,                     &RegisterCompiler::binary, Precedence::EQUALITY},   // TokenType::EQUAL_EQUAL
+        {nullptr,                     &RegisterCompiler::binary, Precedence::COMPARISON}, // TokenType::GREATER
+        {nullptr,                     &RegisterCompiler::binary, Precedence::COMPARISON}, // TokenType::GREATER_EQUAL
+        {nullptr,                     &RegisterCompiler::binary, Precedence::COMPARISON}, // TokenType::LESS
+        {nullptr,                     &RegisterCompiler::binary, Precedence::COMPARISON}, // TokenType::LESS_EQUAL
+        {&RegisterCompiler::variable, nullptr,                   Precedence::NONE},       // TokenType::IDENTIFIER
+        {&RegisterCompiler::string,   nullptr,                   Precedence::NONE},       // TokenType::STRING
+        {&RegisterCompiler::number,   nullptr,                   Precedence::NONE},       // TokenType::NUMBER
+        {nullptr,                     &RegisterCompiler::and_,   Precedence::AND},        // TokenType::AND
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::CLASS
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::ELSE
+        {&RegisterCompiler::literal,  nullptr,                   Precedence::NONE},       // TokenType::FALSE
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::FOR
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::FUN
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::IF
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::IN
+        {&RegisterCompiler::literal,  nullptr,                   Precedence::NONE},       // TokenType::NIL
+        {nullptr,                     &RegisterCompiler::or_,    Precedence::OR},         // TokenType::OR
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::PRINT
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::RETURN
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::SUPER
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::THIS
+        {&RegisterCompiler::literal,  nullptr,                   Precedence::NONE},       // TokenType::TRUE
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::VAR
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::WHILE
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::ERROR
+        {nullptr,                     nullptr,                   Precedence::NONE},       // TokenType::EOFILE
+}};
+
+RegisterCompiler::RegisterCompiler(std::string_view source, VM *vm) :
+        parser{source}, compilingChunk{}, vm{vm} {}
+
+bool RegisterCompiler::compile(Chunk *chunk) {
+    compilingChunk = chunk;
+    parser.advance();
+
+    while (!parser.match(TokenType::EOFILE)) {
+        declaration();
+    }
+
+    endCompiler();
+    return !parser.hadError;
+}
+
+const RegisterCompiler::ParseRule *RegisterCompiler::getRule(TokenType type) {
+    return &rules[to_integral(type)];
+}
+
+void RegisterCompiler::endCompiler() {
+    emit(ROP::RETURN, 0, 0, 0);
+    if constexpr (DEBUG_PRINT_CODE) {
+        if (!parser.hadError) {
+            Disassembler::disassembleRegisterChunk(*compilingChunk, "Code");
+        }
+    }
+}
+
+void RegisterCompiler::beginScope() {
+    current.scopeDepth++;
+}
+
+// Locals need no cleanup code: leaving the scope just makes their registers
+// available again.
+void RegisterCompiler::endScope() {
+    current.scopeDepth--;
+
+    while (current.localCount > 0 && current.locals[current.localCount - 1].depth > current.scopeDepth) {
+        current.localCount--;
+    }
+    freeRegister = current.localCount;
+}
+
+void RegisterCompiler::declaration() {
+    if (parser.match(TokenType::FUN) || parser.match(TokenType::CLASS)) {
+        // Reported once: the rest of the declaration is skipped unparsed.
+        parser.error(parser.previous.type == TokenType::FUN ? "Functions need the stack backend."
+                                                            : "Classes need the stack backend.");
+        for (int depth = 0; !parser.check(TokenType::EOFILE);) {
+            parser.advance();
+            if (parser.previous.type == TokenType::LEFT_BRACE) ++depth;
+            if (parser.previous.type == TokenType::RIGHT_BRACE && --depth == 0) break;
+        }
+    } else if (parser.match(TokenType::VAR)) {
+        varDeclaration();
+    } else {
+        statement();
+    }
+
+    if (parser.panicMode) parser.synchronize();
+}
+
+void RegisterCompiler::varDeclaration() {
+    int global = parseVariable("Expect variable name");
+
+    Expr value{};
+    if (parser.match(TokenType::EQUAL)) {
+        expression(value);
+    } else {
+        value = {ExprKind::RELOC, emit(ROP::LOADNIL, 0, 0, 0)};
+    }
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after variable declaration");
+
+    if (current.scopeDepth > 0) {
+        // The new local's register is the first free one.
+        toNextRegister(value);
+        markInitialized();
+    } else {
+        emitWide(ROP::DEFINE_GLOBAL, toAnyRegister(value), global);
+    }
+    freeRegister = current.localCount;
+}
+
+void RegisterCompiler::statement() {
+    if (parser.match(TokenType::PRINT)) {
+        printStatement();
+    } else if (parser.match(TokenType::FOR)) {
+        forStatement();
+    } else if (parser.match(TokenType::IF)) {
+        ifStatement();
+    } else if (parser.match(TokenType::WHILE)) {
+        whileStatement();
+    } else if (parser.match(TokenType::LEFT_BRACE)) {
+        beginScope();
+        block();
+        endScope();
+    } else {
+        expressionStatement();
+    }
+    freeRegister = current.localCount;
+}
+
+void RegisterCompiler::printStatement() {
+    Expr value{};
+    expression(value);
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after value.");
+    emit(ROP::PRINT, toAnyRegister(value), 0, 0);
+}
+
+void RegisterCompiler::expressionStatement() {
+    Expr value{};
+    expression(value);
+    parser.consume(TokenType::SEMICOLON, "Expect ';' after expression");
+    discharge(value);
+}
+
+void RegisterCompiler::ifStatement() {
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'if'.");
+    Expr condition{};
+    expression(condition);
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
+
+    int thenJump = emitJump(ROP::JUMP_IF_FALSE, toAnyRegister(condition));
+    freeRegister = current.localCount;
+    statement();
+
+    if (parser.match(TokenType::ELSE)) {
+        int elseJump = emitJump(ROP::JUMP, 0);
+        patchJump(thenJump);
+        statement();
+        patchJump(elseJump);
+    } else {
+        patchJump(thenJump);
+    }
+}
+
+void RegisterCompiler::whileStatement() {
+    int loopStart = currentInstruction();
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'while'.");
+    Expr condition{};
+    expression(condition);
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(ROP::JUMP_IF_FALSE, toAnyRegister(condition));
+    freeRegister = current.localCount;
+    statement();
+    emitLoop(loopStart);
+
+    patchJump(exitJump);
+}
+
+void RegisterCompiler::forStatement() {
+    beginScope();
+    parser.consume(TokenType::LEFT_PAREN, "Expect '(' after 'for'.");
+    if (parser.match(TokenType::SEMICOLON)) {
+        // No initializer.
+    } else if (parser.match(TokenType::VAR)) {
+        varDeclaration();
+    } else {
+        expressionStatement();
+        freeRegister = current.localCount;
+    }
+
+    int loopStart = currentInstruction();
+    int exitJump = -1;
+    if (!parser.match(TokenType::SEMICOLON)) {
+        Expr condition{};
+        expression(condition);
+        parser.consume(TokenType::SEMICOLON, "Expect ';' after loop conditions.");
+
+        exitJump = emitJump(ROP::JUMP_IF_FALSE, toAnyRegister(condition));
+        freeRegister = current.localCount;
+    }
+
+    if (!parser.match(TokenType::RIGHT_PAREN)) {
+        int bodyJump = emitJump(ROP::JUMP, 0);
+        int incrementStart = currentInstruction();
+        Expr increment{};
+        expression(increment);
+        discharge(increment);
+        freeRegister = current.localCount;
+        parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emitLoop(loopStart);
+        loopStart = incrementStart;
+        patchJump(bodyJump);
+    }
+
+    statement();
+    emitLoop(loopStart);
+
+    if (exitJump != -1) patchJump(exitJump);
+    endScope();
+}
+
+void RegisterCompiler::block() {
+    while (!parser.check(TokenType::RIGHT_BRACE) && !parser.check(TokenType::EOFILE)) {
+        declaration();
+    }
+    parser.consume(TokenType::RIGHT_BRACE, "Expect, '}' after block.");
+}
+
+void RegisterCompiler::expression(Expr &expr) {
+    parsePrecedence(Precedence::ASSIGNMENT, expr);
+}
+
+void RegisterCompiler::parsePrecedence(Precedence precedence, Expr &expr) {
+    parser.advance();
+    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    if (prefixRule == nullptr) {
+        parser.error("Expect expression");
+        expr = {ExprKind::CONSTANT, 0}; // never run, the chunk is discarded
+        return;
+    }
+
+    bool canAssign = precedence <= Precedence::ASSIGNMENT;
+    (this->*prefixRule)(expr, canAssign);
+
+    while (precedence <= getRule(parser.current.type)->precedence) {
+        parser.advance();
+        ParseFn infixRule = getRule(parser.previous.type)->infix;
+        (this->*infixRule)(expr, canAssign);
+    }
+}
+
+void RegisterCompiler::number(Expr &expr, bool canAssign) {
+    auto value = std::strtod(parser.previous.lexeme.data(), nullptr);
+    expr = {ExprKind::CONSTANT, makeConstant(number_val(value))};
+}
+
+void RegisterCompiler::string(Expr &expr, bool canAssign) {
+    auto lexeme = parser.previous.lexeme;
+    auto str = std::string_view(lexeme.data() + 1, lexeme.size() - 2); // remove opening and trailing "
+    expr = {ExprKind::CONSTANT, makeConstant(obj_val(vm->copyString(str)))};
+}
+
+void RegisterCompiler::literal(Expr &expr, bool canAssign) {
+    switch (parser.previous.type) {
+        case TokenType::FALSE:
+            expr = {ExprKind::RELOC, emit(ROP::LOADFALSE, 0, 0, 0)};
+            break;
+        case TokenType::TRUE:
+            expr = {ExprKind::RELOC, emit(ROP::LOADTRUE, 0, 0, 0)};
+            break;
+        case TokenType::NIL:
+            expr = {ExprKind::RELOC, emit(ROP::LOADNIL, 0, 0, 0)};
+            break;
+        default:
+            return; // unreachable.
+    }
+}
+
+void RegisterCompiler::grouping(Expr &expr, bool canAssign) {
+    expression(expr);
+    parser.consume(TokenType::RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+// Reported once, like functions: the rest of the literal is skipped unparsed.
+void RegisterCompiler::map(Expr &expr, bool canAssign) {
+    parser.error("Maps need the stack backend.");
+    for (int depth = 1; !parser.check(TokenType::EOFILE);) {
+        parser.advance();
+        if (parser.previous.type == TokenType::LEFT_BRACE) ++depth;
+        if (parser.previous.type == TokenType::RIGHT_BRACE && --depth == 0) break;
+    }
+    expr = {ExprKind::CONSTANT, 0}; // never run, the chunk is discarded
+}
+
+void RegisterCompiler::variable(Expr &expr, bool canAssign) {
+    namedVariable(parser.previous, expr, canAssign);
+}
+
+void RegisterCompiler::namedVariable(Token name, Expr &expr, bool canAssign) {
+    int local = resolveLocal(name);
+    if (local != -1) {
+        if (canAssign && parser.match(TokenType::EQUAL)) {
+            Expr value{};
+            expression(value);
+            freeExpr(value);
+            toRegister(value, local);
+        }
+        expr = {ExprKind::LOCAL, local};
+        return;
+    }
+
+    int global = globalSlot(name);
+    if (canAssign && parser.match(TokenType::EQUAL)) {
+        expression(expr);
+        emitWide(ROP::SET_GLOBAL, toAnyRegister(expr), global);
+    } else {
+        expr = {ExprKind::RELOC, emitWide(ROP::GET_GLOBAL, 0, global)};
+    }
+}
+
+void RegisterCompiler::unary(Expr &expr, bool canAssign) {
+    TokenType operatorType = parser.previous.type;
+
+    // compile the operand
+    parsePrecedence(Precedence::UNARY, expr);
+
+    if (operatorType == TokenType::MINUS && expr.kind == ExprKind::CONSTANT) {
+        Value constant = compilingChunk->constants[expr.index];
+        if (isNumber(constant)) {
+            expr = {ExprKind::CONSTANT, makeConstant(number_val(-asNumber(constant)))};
+            return;
+        }
+    }
+
+    int operand = toAnyRegister(expr);
+    freeExpr(expr);
+    switch (operatorType) {
+        case TokenType::MINUS:
+            expr = {ExprKind::RELOC, emit(ROP::NEGATE, 0, operand, 0)};
+            break;
+        case TokenType::BANG:
+            expr = {ExprKind::RELOC, emit(ROP::NOT, 0, operand, 0)};
+            break;
+        default:
+            return; // unreachable
+    }
+}
+
+// Returns false for operators whose operands cannot be swapped; for the rest,
+// adjusts the opcode so that `b op a` gives the same result as `a op b`.
+static bool swapOperands(ROP &opcode) {
+    switch (opcode) {
+        case ROP::EQUAL:
+        case ROP::NOT_EQUAL:
+        case ROP::MULTIPLY:
+            return true;
+        case ROP::GREATER:
+            opcode = ROP::LESS;
+            return true;
+        case ROP::GREATER_EQUAL:
+            opcode = ROP::LESS_EQUAL;
+            return true;
+        case ROP::LESS:
+            opcode = ROP::GREATER;
+            return true;
+        case ROP::LESS_EQUAL:
+            opcode = ROP::GREATER_EQUAL;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void RegisterCompiler::binary(Expr &left, bool canAssign) {
+    TokenType operatorType = parser.previous.type;
+
+    // The left operand has to be read before the right one runs. Constants
+    // can wait, and so can a local unless the right operand assigns to it.
+    if (left.kind == ExprKind::RELOC ||
+        (left.kind == ExprKind::LOCAL && assignedAhead(current.locals[left.index].name))) {
+        toNextRegister(left);
+    }
+
+    const ParseRule *rule = getRule(operatorType);
+    Expr right{};
+    parsePrecedence(static_cast<Precedence>(to_integral(rule->precedence) + 1), right);
+
+    ROP opcode;
+    switch (operatorType) {
+        case TokenType::BANG_EQUAL:    opcode = ROP::NOT_EQUAL; break;
+        case TokenType::EQUAL_EQUAL:   opcode = ROP::EQUAL; break;
+        case TokenType::GREATER:       opcode = ROP::GREATER; break;
+        case TokenType::GREATER_EQUAL: opcode = ROP::GREATER_EQUAL; break;
+        case TokenType::LESS:          opcode = ROP::LESS; break;
+        case TokenType::LESS_EQUAL:    opcode = ROP::LESS_EQUAL; break;
+        case TokenType::PLUS:          opcode = ROP::ADD; break;
+        case TokenType::MINUS:         opcode = ROP::SUBTRACT; break;
+        case TokenType::STAR:          opcode = ROP::MULTIPLY; break;
+        case TokenType::SLASH:         opcode = ROP::DIVIDE; break;
+        default:
+            return; // unreachable
+    }
+
+    if (left.kind == ExprKind::CONSTANT && right.kind != ExprKind::CONSTANT && swapOperands(opcode)) {
+        std::swap(left, right);
+    }
+
+    // K forms hold the constant in C, so constants past 255 go through LOADK.
+    int rhs;
+    if (right.kind == ExprKind::CONSTANT && right.index <= std::numeric_limits<uint8_t>::max()) {
+        opcode = static_cast<ROP>(to_integral(opcode) + 1); // the K form
+        rhs = right.index;
+    } else {
+        rhs = toAnyRegister(right);
+    }
+    int lhs = toAnyRegister(left);
+
+    // Temporaries are released top first.
+    if (left.kind == ExprKind::TEMP && right.kind == ExprKind::TEMP && left.index < right.index) {
+        freeExpr(right);
+        freeExpr(left);
+    } else {
+        freeExpr(left);
+        freeExpr(right);
+    }
+    left = {ExprKind::RELOC, emit(opcode, 0, lhs, rhs)};
+}
+
+void RegisterCompiler::and_(Expr &left, bool canAssign) {
+    int result = toNextRegister(left);
+    int endJump = emitJump(ROP::JUMP_IF_FALSE, result);
+
+    Expr right{};
+    parsePrecedence(Precedence::AND, right);
+    freeExpr(right);
+    toRegister(right, result);
+
+    patchJump(endJump);
+    left = {ExprKind::TEMP, result};
+}
+
+void RegisterCompiler::or_(Expr &left, bool canAssign) {
+    int result = toNextRegister(left);
+    int endJump = emitJump(ROP::JUMP_IF_TRUE, result);
+
+    Expr right{};
+    parsePrecedence(Precedence::OR, right);
+    freeExpr(right);
+    toRegister(right, result);
+
+    patchJump(endJump);
+    left = {ExprKind::TEMP, result};
+}
+
+// Looks ahead, up to the end of the statement, for an assignment to the named
+// variable. Locals used as left operands are read in place, which is only
+// correct if nothing writes to them before the operator runs.
+bool RegisterCompiler::assignedAhead(const Token &name) const {
+    Scanner lookahead = parser.scanner;
+    Token token = parser.current;
+    int depth = 0;
+
+    for (;;) {
+        switch (token.type) {
+            case TokenType::SEMICOLON:
+            case TokenType::LEFT_BRACE:
+            case TokenType::RIGHT_BRACE:
+            case TokenType::EOFILE:
+                return false;
+            case TokenType::LEFT_PAREN:
+                depth++;
+                break;
+            case TokenType::RIGHT_PAREN:
+                if (depth-- == 0) return false;
+                break;
+            default:
+                break;
+        }
+
+        Token next = lookahead.scanToken();
+        if (token.type == TokenType::IDENTIFIER && next.type == TokenType::EQUAL &&
+            Compiler::identifiersEqual(token, name)) {
+            return true;
+        }
+        token = next;
+    }
+}
+
+int RegisterCompiler::reserveRegister() {
+    if (freeRegister >= REGISTER_MAX) {
+        parser.error("Too many registers in one chunk.");
+    }
+    int reg = freeRegister++;
+    compilingChunk->registerCount = std::max(compilingChunk->registerCount, freeRegister);
+    return reg;
+}
+
+void RegisterCompiler::freeExpr(const Expr &expr) {
+    if (expr.kind == ExprKind::TEMP) freeRegister--;
+}
+
+// Puts the value of expr into reg. Callers storing into a local relabel the
+// result themselves.
+void RegisterCompiler::toRegister(Expr &expr, int reg) {
+    switch (expr.kind) {
+        case ExprKind::CONSTANT:
+            emitWide(ROP::LOADK, reg, expr.index);
+            break;
+        case ExprKind::LOCAL:
+        case ExprKind::TEMP:
+            if (expr.index != reg) emit(ROP::MOVE, reg, expr.index, 0);
+            break;
+        case ExprKind::RELOC:
+            setDestination(expr.index, reg);
+            break;
+    }
+    expr = {ExprKind::TEMP, reg};
+}
+
+int RegisterCompiler::toNextRegister(Expr &expr) {
+    freeExpr(expr);
+    int reg = reserveRegister();
+    toRegister(expr, reg);
+    return reg;
+}
+
+int RegisterCompiler::toAnyRegister(Expr &expr) {
+    if (expr.kind == ExprKind::LOCAL || expr.kind == ExprKind::TEMP) return expr.index;
+    return toNextRegister(expr);
+}
+
+// Gives a pending instruction somewhere to write, for expressions evaluated
+// only for their effects.
+void RegisterCompiler::discharge(Expr &expr) {
+    if (expr.kind == ExprKind::RELOC) toNextRegister(expr);
+}
+
+void RegisterCompiler::declareVariable() {
+    if (current.scopeDepth == 0) {
+        return;
+    }
+
+    Token name = parser.previous;
+    for (int i = current.localCount - 1; i >= 0; --i) {
+        auto &local = current.locals[i];
+        if (local.depth != -1 && local.depth < current.scopeDepth) {
+            break;
+        }
+
+        if (Compiler::identifiersEqual(name, local.name)) {
+            parser.error("Already a variable with this name in this scope.");
+        }
+    }
+
+    addLocal(name);
+}
+
+void RegisterCompiler::addLocal(Token name) {
+    if (current.localCount == UINT8_COUNT) {
+        parser.error("Too many local variables in function.");
+        return;
+    }
+
+    Local &local = current.push();
+    local.name = name;
+    local.depth = -1;
+}
+
+int RegisterCompiler::resolveLocal(const Token &name) {
+    for (int i = current.localCount - 1; i >= 0; --i) {
+        auto &local = current.locals[i];
+        if (Compiler::identifiersEqual(name, local.name)) {
+            if (local.depth == -1) {
+                parser.error("Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void RegisterCompiler::markInitialized() {
+    current.locals[current.localCount - 1].depth = current.scopeDepth;
+}
+
+int RegisterCompiler::parseVariable(std::string_view message) {
+    parser.consume(TokenType::IDENTIFIER, message);
+
+    declareVariable();
+    if (current.scopeDepth > 0) return 0;
+
+    return globalSlot(parser.previous);
+}
+
+int RegisterCompiler::globalSlot(const Token &name) {
+    int slot = vm->resolveGlobal(name.lexeme);
+    if (slot > std::numeric_limits<uint16_t>::max()) {
+        parser.error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
+int RegisterCompiler::makeConstant(Value value) {
+    int constant = compilingChunk->addConstant(value);
+    if (constant > std::numeric_limits<uint16_t>::max()) {
+        parser.error("Too many constants in one chunk.");
+        return 0;
+    }
+    return constant;
+}
+
+int RegisterCompiler::currentInstruction() const {
+    return static_cast<int>(compilingChunk->code.size()) / REGISTER_INSTRUCTION_SIZE;
+}
+
+int RegisterCompiler::emit(ROP opcode, int a, int b, int c) {
+    int instruction = currentInstruction();
+    auto line = parser.previous.line;
+    compilingChunk->writeChunk(to_integral(opcode), line);
+    compilingChunk->writeChunk(static_cast<uint8_t>(a), line);
+    compilingChunk->writeChunk(static_cast<uint8_t>(b), line);
+    compilingChunk->writeChunk(static_cast<uint8_t>(c), line);
+    return instruction;
+}
+
+int RegisterCompiler::emitWide(ROP opcode, int a, int bx) {
+    return emit(opcode, a, (bx >> 8) & 0xff, bx & 0xff);
+}
+
+int RegisterCompiler::emitJump(ROP opcode, int a) {
+    return emitWide(opcode, a, 0xffff);
+}
+
+void RegisterCompiler::patchJump(int jump) {
+    int offset = currentInstruction() - jump - 1;
+    if (offset > std::numeric_limits<int16_t>::max()) {
+        parser.error("Too much code to jump over.");
+    }
+
+    auto *operand = &compilingChunk->code[jump * REGISTER_INSTRUCTION_SIZE + 2];
+    operand[0] = (offset >> 8) & 0xff;
+    operand[1] = offset & 0xff;
+}
+
+void RegisterCompiler::emitLoop(int start) {
+    int offset = start - currentInstruction() - 1;
+    if (offset < std::numeric_limits<int16_t>::min()) parser.error("Loop body too large");
+
+    emitWide(ROP::JUMP, 0, static_cast<uint16_t>(offset));
+}
+
+void RegisterCompiler::setDestination(int instruction, int reg) {
+    compilingChunk->code[instruction * REGISTER_INSTRUCTION_SIZE + 1] = static_cast<uint8_t>(reg);
+}
@@ -0,0 +1,155 @@
+#ifndef CPPLOX_REGCOMPILER_H
+#define CPPLOX_REGCOMPILER_H
+
+#include <string_view>
+#include <array>
+#include <cstdint>
+#include "chunk.h"
+#include "compiler.h"
+#include "parser.h"
+#include "VM.h"
+
+// Register operands are one byte. Two stack slots above the frame stay free
+// for the values the VM pushes while it concatenates or flattens strings.
+constexpr const auto REGISTER_MAX = UINT8_COUNT - 2;
+
+// Where the value of an expression is while it is being compiled. Values are
+// kept out of registers as long as possible so the instruction producing one
+// can write straight into the register that ends up needing it.
+enum class ExprKind {
+    CONSTANT,   // constant pool entry `index`
+    LOCAL,      // register `index` of a local variable
+    TEMP,       // temporary register `index`, the top of the register stack
+    RELOC       // instruction `index`, whose destination A is not set yet
+};
+
+struct Expr {
+    ExprKind kind;
+    int index;
+};
+
+// Single-pass compiler for the register instruction set (ROP). Locals live in
+// registers 0..localCount-1; temporaries are allocated stack-wise above them.
+class RegisterCompiler {
+    Parser parser;
+    Chunk *compilingChunk;
+    VM *vm;
+    CompilerLocals current{};
+    int freeRegister{};
+
+    void endCompiler();
+
+    void beginScope();
+
+    void endScope();
+
+    void declaration();
+
+    void varDeclaration();
+
+    void statement();
+
+    void printStatement();
+
+    void expressionStatement();
+
+    void ifStatement();
+
+    void whileStatement();
+
+    void forStatement();
+
+    void block();
+
+//  Expressions
+    void expression(Expr &expr);
+
+    void parsePrecedence(Precedence precedence, Expr &expr);
+
+    void number(Expr &expr, bool canAssign);
+
+    void string(Expr &expr, bool canAssign);
+
+    void literal(Expr &expr, bool canAssign);
+
+    void grouping(Expr &expr, bool canAssign);
+
+    void map(Expr &expr, bool canAssign);
+
+    void variable(Expr &expr, bool canAssign);
+
+    void unary(Expr &expr, bool canAssign);
+
+    void binary(Expr &expr, bool canAssign);
+
+    void and_(Expr &expr, bool canAssign);
+
+    void or_(Expr &expr, bool canAssign);
+
+    void namedVariable(Token name, Expr &expr, bool canAssign);
+
+    bool assignedAhead(const Token &name) const;
+
+//  Registers
+    int reserveRegister();
+
+    void freeExpr(const Expr &expr);
+
+    void toRegister(Expr &expr, int reg);
+
+    int toNextRegister(Expr &expr);
+
+    int toAnyRegister(Expr &expr);
+
+    void discharge(Expr &expr);
+
+//  Variables
+    void declareVariable();
+
+    void addLocal(Token name);
+
+    int resolveLocal(const Token &name);
+
+    void markInitialized();
+
+    int parseVariable(std::string_view message);
+
+    int globalSlot(const Token &name);
+
+    int makeConstant(Value value);
+
+//  Emitting
+    int currentInstruction() const;
+
+    int emit(ROP opcode, int a, int b, int c);
+
+    int emitWide(ROP opcode, int a, int bx);
+
+    int emitJump(ROP opcode, int a);
+
+    void patchJump(int jump);
+
+    void emitLoop(int start);
+
+    void setDestination(int instruction, int reg);
+
+    using ParseFn = void (RegisterCompiler::*)(Expr &expr, bool canAssign);
+
+    struct ParseRule {
+        ParseFn prefix;
+        ParseFn infix;
+        Precedence precedence;
+    };
+
+    static const std::array<ParseRule, TOKEN_TYPE_COUNT> rules;
+
+    static const ParseRule *getRule(TokenType type);
+
+public:
+    explicit RegisterCompiler(std::string_view source, VM *vm);
+
+    bool compile(Chunk *chunk);
+};
+
+
+#endif //CPPLOX_REGCOMPILER_H
@@ -35,6 +35,12 @@ Token Scanner::scanToken() {
             return makeToken(TokenType::LEFT_BRACE);
         case '}':
             return makeToken(TokenType::RIGHT_BRACE);
+        case '[':
+            return makeToken(TokenType::LEFT_BRACKET);
+        case ']':
+            return makeToken(TokenType::RIGHT_BRACKET);
+        case ':':
+            return makeToken(TokenType::COLON);
         case ';':
             return makeToken(TokenType::SEMICOLON);
         case ',':
@@ -167,7 +173,15 @@ TokenType Scanner::identifierType() {
         case 'e':
             return checkKeyword(1, 3, "lse", TokenType::ELSE);
         case 'i':
-            return checkKeyword(1, 1, "f", TokenType::IF);
+            if ((current - start) > 1) {
+                switch (start[1]) {
+                    case 'f':
+                        return checkKeyword(2, 0, "", TokenType::IF);
+                    case 'n':
+                        return checkKeyword(2, 0, "", TokenType::IN);
+                }
+            }
+            break;
         case 'n':
             return checkKeyword(1, 2, "il", TokenType::NIL);
         case 'o':
@@ -9,7 +9,8 @@ enum class TokenType {
     // Single-character tokens.
     LEFT_PAREN, RIGHT_PAREN,
     LEFT_BRACE, RIGHT_BRACE,
-    COMMA, DOT, MINUS, PLUS,
+    LEFT_BRACKET, RIGHT_BRACKET,
+    COLON, COMMA, DOT, MINUS, PLUS,
     SEMICOLON, SLASH, STAR,
     // One or two character tokens.
     BANG, BANG_EQUAL,
@@ -20,13 +21,15 @@ enum class TokenType {
     IDENTIFIER, STRING, NUMBER,
     // Keywords.
     AND, CLASS, ELSE, FALSE,
-    FOR, FUN, IF, NIL, OR,
+    FOR, FUN, IF, IN, NIL, OR,
     PRINT, RETURN, SUPER, THIS,
     TRUE, VAR, WHILE,
 
     ERROR, EOFILE
 };
 
+constexpr const auto TOKEN_TYPE_COUNT{static_cast<size_t>(TokenType::EOFILE) + 1};
+
 template<>
 struct fmt::formatter<TokenType> {
     template<typename ParseContext>
@@ -0,0 +1,25 @@
+#include "shape.h"
+
+ShapeTable::ShapeTable() {
+    shapes.push_back({NO_SHAPE, nullptr, 0, NO_SHAPE, NO_SHAPE}); // placeholder for NO_SHAPE
+    shapes.push_back({NO_SHAPE, nullptr, 0, NO_SHAPE, NO_SHAPE});
+}
+
+int ShapeTable::find(uint32_t id, const ObjString *key) const {
+    // Keys are interned strings, so identity is equality.
+    for (; id != EMPTY_SHAPE; id = shapes[id].parent) {
+        if (shapes[id].key == key) return static_cast<int>(shapes[id].fieldCount) - 1;
+    }
+    return -1;
+}
+
+uint32_t ShapeTable::transition(uint32_t id, ObjString *key) {
+    for (uint32_t child = shapes[id].firstChild; child != NO_SHAPE; child = shapes[child].nextSibling) {
+        if (shapes[child].key == key) return child;
+    }
+
+    auto child = static_cast<uint32_t>(shapes.size());
+    shapes.push_back({id, key, shapes[id].fieldCount + 1, NO_SHAPE, shapes[id].firstChild});
+    shapes[id].firstChild = child;
+    return child;
+}
@@ -0,0 +1,55 @@
+#ifndef CPPLOX_SHAPE_H
+#define CPPLOX_SHAPE_H
+
+
+#include <cstdint>
+#include <vector>
+#include "object.h"
+
+// Shape ids. No shape has id 0, so an all-zero inline cache entry is empty.
+constexpr const uint32_t NO_SHAPE = 0;
+constexpr const uint32_t EMPTY_SHAPE = 1;
+// Field indices are 16 bits in the inline caches.
+constexpr const uint32_t MAX_FIELDS = UINT16_MAX;
+
+// A hidden class: the field names of an instance, in the order they were
+// added, which is also the order of their values. Every shape but the empty
+// one is its parent plus one field, so instances that gain the same fields
+// in the same order share one shape, and a field access that has seen a
+// shape before needs no name lookup (see the inline caches in VM.cpp).
+struct Shape {
+    uint32_t parent;
+    ObjString* key;         // the field added to the parent, nullptr for the empty shape
+    uint32_t fieldCount;
+    // The shapes that add one more field to this one, linked through nextSibling.
+    uint32_t firstChild;
+    uint32_t nextSibling;
+};
+
+// All shapes, addressed by id. Shapes are never freed: there is one per
+// distinct sequence of field additions, and programs make few. Their keys
+// are GC roots.
+class ShapeTable {
+public:
+    ShapeTable();
+
+    const Shape &operator[](uint32_t id) const { return shapes[id]; }
+
+    // Index of `key` in instances of shape `id`, or -1. Walks the chain of
+    // parents, which is what the inline caches save.
+    [[nodiscard]] int find(uint32_t id, const ObjString *key) const;
+
+    // The shape of an instance of shape `id` once it gains field `key`, made
+    // on first use.
+    uint32_t transition(uint32_t id, ObjString *key);
+
+    std::vector<Shape>::iterator begin() { return shapes.begin(); }
+
+    std::vector<Shape>::iterator end() { return shapes.end(); }
+
+private:
+    std::vector<Shape> shapes;
+};
+
+
+#endif //CPPLOX_SHAPE_H
@@ -0,0 +1,201 @@
+#ifndef CPPLOX_SWISSTABLE_H
+#define CPPLOX_SWISSTABLE_H
+
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include "object.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CPPLOX_SWISSTABLE_SSE2 1
+#else
+#define CPPLOX_SWISSTABLE_SSE2 0
+#endif
+
+// A slot's control byte: the low 7 bits of its key's hash, or EMPTY.
+constexpr const int8_t SWISS_EMPTY = INT8_MIN;
+// Control bytes compared per probe step, one SSE2 register.
+constexpr const size_t SWISS_GROUP = 16;
+constexpr const size_t SWISS_MIN_CAPACITY = SWISS_GROUP;
+constexpr const size_t SWISS_MAX_LOAD_NUM = 3;
+constexpr const size_t SWISS_MAX_LOAD_DEN = 4;
+
+struct NoValue {};
+
+// Open-addressing hash table keyed on interned ObjString*, after Abseil's
+// Swiss tables. Each slot has a control byte holding a 7-bit tag of its
+// key's hash; a probe compares 16 control bytes against the tag at once,
+// so only slots whose tag matches are looked at, and an empty byte among
+// the 16 ends an unsuccessful lookup. Positions come from the other 25
+// bits of ObjString::hash, which nothing needs to recompute.
+//
+// Unlike Abseil's, probing is linear by slot rather than by group: the 16
+// bytes are read from the probed slot on, running past the end into a
+// copy of the first 15 control bytes. Every key then lies between its
+// home slot and the next empty one, so erasing shifts the keys after it
+// back instead of leaving a tombstone, and the load factor alone decides
+// when to grow.
+template<typename V = NoValue>
+class SwissTable {
+public:
+    struct Entry {
+        ObjString *key;
+        [[no_unique_address]] V value;
+    };
+
+    [[nodiscard]] size_t size() const { return count; }
+
+    [[nodiscard]] size_t capacity() const { return slotCount; }
+
+    // Keys are interned, so identity is equality.
+    Entry *find(const ObjString *key) {
+        return findIf(key->hash, [key](const ObjString *candidate) { return candidate == key; });
+    }
+
+    // The entry whose key has `hash` and satisfies `matches`, or nullptr.
+    template<typename Matches>
+    Entry *findIf(uint32_t hash, Matches matches) {
+        if (count == 0) return nullptr;
+        auto tag = tagOf(hash);
+        for (size_t index = homeOf(hash);; index = (index + SWISS_GROUP) & mask()) {
+            const int8_t *group = &control[index];
+            for (uint32_t bits = match(group, tag); bits != 0; bits &= bits - 1) {
+                auto slot = (index + std::countr_zero(bits)) & mask();
+                if (matches(slots[slot].key)) return &slots[slot];
+            }
+            if (match(group, SWISS_EMPTY) != 0) return nullptr;
+        }
+    }
+
+    template<typename Matches>
+    const Entry *findIf(uint32_t hash, Matches matches) const {
+        return const_cast<SwissTable *>(this)->findIf(hash, matches);
+    }
+
+    // The entry for `key`, added with `value` if there was none, and whether it was added.
+    std::pair<Entry *, bool> insert(ObjString *key, V value = {}) {
+        if (auto entry = find(key)) return {entry, false};
+        return {insertUnique(key, std::move(value)), true};
+    }
+
+    // Adds `key`, which must not be in the table yet.
+    Entry *insertUnique(ObjString *key, V value = {}) {
+        if ((count + 1) * SWISS_MAX_LOAD_DEN > slotCount * SWISS_MAX_LOAD_NUM) {
+            rehash(std::max(SWISS_MIN_CAPACITY, slotCount * 2));
+        }
+        auto slot = firstEmpty(key->hash);
+        setControl(slot, tagOf(key->hash));
+        slots[slot] = {key, std::move(value)};
+        ++count;
+        return &slots[slot];
+    }
+
+    bool erase(const ObjString *key) {
+        auto entry = find(key);
+        if (entry == nullptr) return false;
+        eraseAt(static_cast<size_t>(entry - slots.get()));
+        return true;
+    }
+
+    // Erases the entries `remove` returns true for.
+    template<typename Remove>
+    void eraseIf(Remove remove) {
+        for (size_t slot = 0; slot < slotCount;) {
+            if (control[slot] != SWISS_EMPTY && remove(slots[slot])) {
+                eraseAt(slot); // re-examine the slot, a later entry may have moved in
+            } else {
+                ++slot;
+            }
+        }
+    }
+
+    template<typename Visit>
+    void forEach(Visit visit) {
+        for (size_t slot = 0; slot < slotCount; ++slot) {
+            if (control[slot] != SWISS_EMPTY) visit(slots[slot]);
+        }
+    }
+
+    // Keeps the capacity.
+    void clear() {
+        if (count == 0) return;
+        std::fill_n(control.get(), slotCount + SWISS_GROUP - 1, SWISS_EMPTY);
+        count = 0;
+    }
+
+private:
+    std::unique_ptr<int8_t[]> control;
+    std::unique_ptr<Entry[]> slots;
+    size_t slotCount{};
+    size_t count{};
+
+    [[nodiscard]] size_t mask() const { return slotCount - 1; }
+
+    static int8_t tagOf(uint32_t hash) { return static_cast<int8_t>(hash & 0x7f); }
+
+    [[nodiscard]] size_t homeOf(uint32_t hash) const { return (hash >> 7) & mask(); }
+
+    // Bit i is set when the control byte i places after `group` is `tag`.
+    static uint32_t match(const int8_t *group, int8_t tag) {
+#if CPPLOX_SWISSTABLE_SSE2
+        auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(tag))));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < SWISS_GROUP; ++i) bits |= static_cast<uint32_t>(group[i] == tag) << i;
+        return bits;
+#endif
+    }
+
+    [[nodiscard]] size_t firstEmpty(uint32_t hash) const {
+        for (size_t index = homeOf(hash);; index = (index + SWISS_GROUP) & mask()) {
+            if (auto empty = match(&control[index], SWISS_EMPTY)) return (index + std::countr_zero(empty)) & mask();
+        }
+    }
+
+    // The first 15 control bytes are mirrored past the end.
+    void setControl(size_t slot, int8_t byte) {
+        control[slot] = byte;
+        if (slot < SWISS_GROUP - 1) control[slotCount + slot] = byte;
+    }
+
+    // Backward-shift deletion: moves each later key of the run that may
+    // live at the hole into it, which keeps every probe run unbroken.
+    void eraseAt(size_t hole) {
+        for (size_t next = (hole + 1) & mask(); control[next] != SWISS_EMPTY; next = (next + 1) & mask()) {
+            auto home = homeOf(slots[next].key->hash);
+            if (((next - home) & mask()) >= ((next - hole) & mask())) {
+                setControl(hole, control[next]);
+                slots[hole] = std::move(slots[next]);
+                hole = next;
+            }
+        }
+        setControl(hole, SWISS_EMPTY);
+        --count;
+    }
+
+    void rehash(size_t newCapacity) {
+        auto oldControl = std::move(control);
+        auto oldSlots = std::move(slots);
+        auto oldCapacity = slotCount;
+
+        control.reset(new int8_t[newCapacity + SWISS_GROUP - 1]);
+        std::fill_n(control.get(), newCapacity + SWISS_GROUP - 1, SWISS_EMPTY);
+        slots.reset(new Entry[newCapacity]);
+        slotCount = newCapacity;
+        for (size_t slot = 0; slot < oldCapacity; ++slot) {
+            if (oldControl[slot] == SWISS_EMPTY) continue;
+            auto target = firstEmpty(oldSlots[slot].key->hash);
+            setControl(target, oldControl[slot]);
+            slots[target] = std::move(oldSlots[slot]);
+        }
+    }
+};
+
+
+#endif //CPPLOX_SWISSTABLE_H
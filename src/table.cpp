@@ -0,0 +1,23 @@
+#include "table.h"
+
+ObjString* StringTable::find(std::string_view chars, uint32_t hash) const {
+    auto entry = set.findIf(hash, [&](const ObjString* string) {
+        return string->hash == hash && string->str() == chars;
+    });
+    return entry != nullptr ? entry->key : nullptr;
+}
+
+// Callers look the text up first, so the string is never already there.
+void StringTable::insert(ObjString* string) {
+    set.insertUnique(string);
+}
+
+// Interned strings are weak references: drop the ones the collector did not
+// reach before their objects are swept.
+void StringTable::removeUnmarked() {
+    set.eraseIf([](const SwissTable<>::Entry& entry) { return !entry.key->isMarked; });
+}
+
+void StringTable::clear() {
+    set.clear();
+}
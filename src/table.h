@@ -0,0 +1,22 @@
+#ifndef CPPLOX_TABLE_H
+#define CPPLOX_TABLE_H
+
+
+#include <cstdint>
+#include <string_view>
+#include "object.h"
+#include "swisstable.h"
+
+// Intern table: the set of canonical ObjStrings, looked up by their text
+// and cached hash.
+struct StringTable {
+    SwissTable<> set;
+
+    [[nodiscard]] ObjString* find(std::string_view chars, uint32_t hash) const;
+    void insert(ObjString* string);
+    void removeUnmarked();
+    void clear();
+};
+
+
+#endif //CPPLOX_TABLE_H
@@ -0,0 +1,816 @@
+#include "trace.h"
+#include <bit>
+#include <functional>
+
+static bool numberOrBool(Value value) {
+    return isNumber(value) || isBool(value);
+}
+
+// The slot or constant index of the instruction at `at`, at its encoded width.
+static int indexOperand(const uint8_t *at) {
+    switch (static_cast<OP>(*at)) {
+        case OP::CONSTANT_LONG:
+            return static_cast<int>(readTriple(at + 1));
+        case OP::GET_LOCAL_LONG:
+        case OP::SET_LOCAL_LONG:
+        case OP::GET_GLOBAL_SLOT_LONG:
+        case OP::SET_GLOBAL_SLOT_LONG:
+            return readShort(at + 1);
+        default:
+            return at[1];
+    }
+}
+
+// The code of the loop with the given header: from there to the furthest
+// LOOP back to it, widened by every LOOP that starts or lands inside, such as
+// a for loop's jump from its increment back to its condition. Going by the
+// back-edges rather than by what one iteration ran matters when the other
+// side of a branch is laid out after that iteration's LOOP, with its own.
+static std::pair<int, int> loopExtent(std::span<const uint8_t> code, int header) {
+    int start = header;
+    int end = header;
+    for (bool widened = true; widened;) {
+        widened = false;
+        for (int offset = 0; offset < static_cast<int>(code.size());) {
+            auto op = static_cast<OP>(code[offset]);
+            int length = instructionLength(op);
+            if (op == OP::LOOP) {
+                int target = offset + length - readShort(&code[offset + 1]);
+                bool inside = (offset >= start && offset <= end) || (target >= start && target <= end);
+                if (inside && (target < start || offset > end)) {
+                    start = std::min(start, target);
+                    end = std::max(end, offset);
+                    widened = true;
+                }
+            }
+            offset += length;
+        }
+    }
+    return {start, end};
+}
+
+// Called on every back-edge while tracing is on, with ip at the loop header.
+void VM::loopBackEdge() {
+    auto header = static_cast<int>(ip - code);
+    HotLoop &loop = hotLoops[header];
+    if (loop.trace) {
+        // A trace whose guards keep failing, or that keeps leaving the recorded
+        // path before getting round the loop once, was specialised for the
+        // wrong iteration: drop it and let the loop heat up again, or leave
+        // the loop to the interpreter once it has been rerecorded too often.
+        auto outcome = loop.trace->run(*this);
+        if (outcome == TraceOutcome::LEFT_LOOP || outcome == TraceOutcome::LEFT_PATH_AFTER_LOOPING) return;
+        if (++loop.misses < HOT_LOOP_THRESHOLD) return;
+        loop.trace.reset();
+        loop.count = 0;
+        loop.misses = 0;
+        if (++loop.retraces > MAX_RETRACES) loop.blacklisted = true;
+        return;
+    }
+    if (loop.blacklisted || ++loop.count < HOT_LOOP_THRESHOLD) return;
+    recordTrace(header);
+}
+
+// Interprets one iteration of the loop an instruction at a time, noting the
+// path taken, then compiles it. Recording stops in front of anything the
+// trace compiler cannot handle, which also means every recorded instruction
+// runs without error; the interpreter then carries on from there.
+void VM::recordTrace(int header) {
+    auto depth = static_cast<int>(stackTop - stack.data());
+    auto [start, end] = loopExtent(chunk->bytes(), header);
+    TraceRecording recording{header, start, end, depth, {}, {stack.data(), stackTop}, globals};
+
+    recordingTrace = true;
+    bool closed = false;
+    bool left = false;
+    while (recording.steps.size() < MAX_TRACE_LENGTH) {
+        auto offset = static_cast<int>(ip - code);
+        if (offset == header && !recording.steps.empty()) {
+            closed = true;
+            break;
+        }
+        if (offset < start || offset > end) {
+            left = true;
+            break;
+        }
+        if (!traceable(static_cast<OP>(chunk->bytes()[offset]))) break;
+        executeAt(ip);
+        recording.steps.push_back({offset, static_cast<int>(ip - code)});
+    }
+    recordingTrace = false;
+
+    HotLoop &loop = hotLoops[header];
+    // The iteration recorded was the loop's last, which says nothing about
+    // the loop: record the next one instead. Waiting for the count to come
+    // round again could land on the last iteration every time.
+    if (left) {
+        loop.count = HOT_LOOP_THRESHOLD - 1;
+        return;
+    }
+    if (closed) loop.trace = Trace::compile(*chunk, recording);
+    if (!loop.trace) {
+        loop.blacklisted = true;
+        return;
+    }
+    loop.trace->run(*this);
+}
+
+// Whether the instruction at ip can be traced with the operands it is about
+// to see. The opcode comes from the chunk, since the code being run may have
+// been quickened.
+bool VM::traceable(OP instruction) const {
+    switch (instruction) {
+        case OP::CONSTANT:
+        case OP::CONSTANT_LONG:
+            return numberOrBool(chunk->constants[indexOperand(ip)]);
+        case OP::TRUE:
+        case OP::FALSE:
+        case OP::POP:
+        case OP::POPN:
+        case OP::JUMP:
+        case OP::LOOP:
+        case OP::JUMP_LONG:
+            return true;
+        case OP::GET_LOCAL:
+        case OP::GET_LOCAL_LONG:
+            return numberOrBool(stack[indexOperand(ip)]);
+        case OP::SET_LOCAL:
+        case OP::SET_LOCAL_LONG:
+        case OP::SET_LOCAL_POP:
+            return numberOrBool(peek(0));
+        case OP::GET_GLOBAL_SLOT:
+        case OP::GET_GLOBAL_SLOT_LONG:
+            return numberOrBool(globals[indexOperand(ip)]);
+        case OP::SET_GLOBAL_SLOT:
+        case OP::SET_GLOBAL_SLOT_LONG:
+            return !isUndefined(globals[indexOperand(ip)]) && numberOrBool(peek(0));
+        case OP::NEGATE:
+            return isNumber(peek(0));
+        case OP::NOT:
+        case OP::JUMP_IF_TRUE:
+        case OP::JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_TRUE:
+            return isBool(peek(0));
+        case OP::EQUAL:
+        case OP::NOT_EQUAL:
+        case OP::GREATER:
+        case OP::GREATER_EQUAL:
+        case OP::LESS:
+        case OP::LESS_EQUAL:
+        case OP::ADD:
+        case OP::SUBTRACT:
+        case OP::MULTIPLY:
+        case OP::DIVIDE:
+        case OP::JUMP_IF_NOT_LESS:
+        case OP::JUMP_IF_NOT_LESS_EQUAL:
+        case OP::JUMP_IF_NOT_GREATER:
+        case OP::JUMP_IF_NOT_GREATER_EQUAL:
+            return isNumber(peek(0)) && isNumber(peek(1));
+        case OP::ADD_TO_LOCAL:
+            return isNumber(stack[ip[1]]) && isNumber(chunk->constants[ip[2]]);
+        default:
+            return false;
+    }
+}
+
+#if CPPLOX_HAS_JIT
+
+// Trace code is a function (Value *stack, Value *globals) returning the index
+// of the side exit taken, or -1 when an entry guard failed, in the low 32
+// bits, and the iterations completed in the high ones. It keeps the two
+// pointers in RDI and RSI, counts iterations in R8 in steps of R9, uses RAX,
+// RCX and RDX as scratch, xmm0 and xmm1 for constants, xmm2-xmm7 for
+// temporaries and xmm8-xmm15 for variables.
+using TraceEntry = uint64_t (*)(Value *stack, Value *globals);
+constexpr const uint64_t ITERATION = uint64_t{1} << 32;
+
+constexpr const int FIRST_TEMP = 2;
+constexpr const int TEMP_COUNT = 6;
+constexpr const int FIRST_VARIABLE = 8;
+constexpr const int MAX_VARIABLES = 8;
+
+enum class TraceType : uint8_t {
+    NUMBER,
+    BOOL
+};
+
+static TraceType typeOf(Value value) {
+    return isNumber(value) ? TraceType::NUMBER : TraceType::BOOL;
+}
+
+// A value on the abstract operand stack. Nothing is boxed or type-tagged at
+// run time: the type is known here, and numbers and booleans are just their
+// NaN-boxed bits in an XMM register.
+struct TraceValue {
+    enum class Kind : uint8_t {
+        CONSTANT,   // `bits`
+        TEMP,       // XMM register `index`
+        VARIABLE    // the current value of variable `index`
+    };
+
+    Kind kind;
+    TraceType type;
+    int index{};
+    uint64_t bits{};
+};
+
+// A local below the loop's stack height, or a global, that the loop uses.
+struct TraceVariable {
+    bool global;
+    int slot;
+    bool readFirst;     // read before written: loaded and guarded on entry
+    bool written;       // written back at every exit
+    TraceType entryType;
+    TraceType type;     // as of the instruction being compiled
+};
+
+struct PendingExit {
+    int rel32;
+    int target;
+    std::vector<TraceValue> stack;
+};
+
+struct TraceCompiler {
+    const Chunk &chunk;
+    const TraceRecording &recording;
+    X64Assembler as;
+    std::vector<TraceVariable> variables;
+    std::vector<TraceValue> stack;
+    std::vector<PendingExit> exits;
+    std::vector<int> guards;
+    uint32_t freeTemps{(1u << TEMP_COUNT) - 1};
+    bool ok{true};
+
+    TraceCompiler(const Chunk &chunk, const TraceRecording &recording) : chunk{chunk}, recording{recording} {}
+
+    [[nodiscard]] int depth() const { return recording.depth; }
+
+    static int xmm(int variable) { return FIRST_VARIABLE + variable; }
+
+    static TraceValue constant(Value value) {
+        return {TraceValue::Kind::CONSTANT, typeOf(value), 0, value.bits};
+    }
+
+    static Reg base(const TraceVariable &variable) { return variable.global ? Reg::RSI : Reg::RDI; }
+
+//  Variables
+
+    int find(bool global, int slot) const {
+        for (int i = 0; i < static_cast<int>(variables.size()); ++i) {
+            if (variables[i].global == global && variables[i].slot == slot) return i;
+        }
+        return -1;
+    }
+
+    void touch(bool global, int slot, bool read) {
+        int index = find(global, slot);
+        if (index < 0) {
+            if (variables.size() == MAX_VARIABLES) {
+                ok = false;
+                return;
+            }
+            Value entry = global ? recording.globals[slot] : recording.locals[slot];
+            if (read && !numberOrBool(entry)) ok = false;
+            variables.push_back({global, slot, read, false, typeOf(entry), typeOf(entry)});
+            index = static_cast<int>(variables.size()) - 1;
+        }
+        if (!read) variables[index].written = true;
+    }
+
+    void collectVariables() {
+        for (auto [offset, next]: recording.steps) {
+            int operand = indexOperand(&chunk.bytes()[offset]);
+            bool local = operand < depth();
+            switch (static_cast<OP>(chunk.bytes()[offset])) {
+                case OP::GET_LOCAL:
+                case OP::GET_LOCAL_LONG:
+                    if (local) touch(false, operand, true);
+                    break;
+                case OP::SET_LOCAL:
+                case OP::SET_LOCAL_LONG:
+                case OP::SET_LOCAL_POP:
+                    if (local) touch(false, operand, false);
+                    break;
+                case OP::ADD_TO_LOCAL:
+                    if (local) {
+                        touch(false, operand, true);
+                        touch(false, operand, false);
+                    }
+                    break;
+                case OP::GET_GLOBAL_SLOT:
+                case OP::GET_GLOBAL_SLOT_LONG:
+                    touch(true, operand, true);
+                    break;
+                case OP::SET_GLOBAL_SLOT:
+                case OP::SET_GLOBAL_SLOT_LONG:
+                    touch(true, operand, false);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    // Loads every variable into its register, checking the type of those
+    // read before they are written. This is the only place types are checked.
+    void enter() {
+        for (int i = 0; i < static_cast<int>(variables.size()); ++i) {
+            auto &variable = variables[i];
+            as.load(Reg::RAX, base(variable), variable.slot * 8);
+            if (variable.readFirst && variable.entryType == TraceType::NUMBER) {
+                as.mov(Reg::RCX, QNAN);
+                as.mov(Reg::RDX, Reg::RAX);
+                as.and_(Reg::RDX, Reg::RCX);
+                as.cmp(Reg::RDX, Reg::RCX);
+                guards.push_back(as.jcc(Cond::E));
+            } else if (variable.readFirst) {
+                as.mov(Reg::RCX, TRUE_BITS);
+                as.mov(Reg::RDX, Reg::RAX);
+                as.or_(Reg::RDX, int8_t{1});
+                as.cmp(Reg::RDX, Reg::RCX);
+                guards.push_back(as.jcc(Cond::NE));
+            }
+            as.movq(xmm(i), Reg::RAX);
+        }
+    }
+
+//  Values
+
+    int allocateTemp() {
+        if (freeTemps == 0) {
+            ok = false;
+            return FIRST_TEMP;
+        }
+        int bit = std::countr_zero(freeTemps);
+        freeTemps &= ~(1u << bit);
+        return FIRST_TEMP + bit;
+    }
+
+    void release(const TraceValue &value) {
+        if (value.kind == TraceValue::Kind::TEMP) freeTemps |= 1u << (value.index - FIRST_TEMP);
+    }
+
+    TraceValue pop() {
+        if (stack.empty()) {
+            ok = false;
+            return constant(number_val(0));
+        }
+        TraceValue value = stack.back();
+        stack.pop_back();
+        return value;
+    }
+
+    // The register holding `value`; constants are materialised in `scratch`.
+    int load(const TraceValue &value, int scratch) {
+        switch (value.kind) {
+            case TraceValue::Kind::CONSTANT:
+                as.mov(Reg::RAX, value.bits);
+                as.movq(scratch, Reg::RAX);
+                return scratch;
+            case TraceValue::Kind::TEMP:
+                return value.index;
+            case TraceValue::Kind::VARIABLE:
+            default:
+                return xmm(value.index);
+        }
+    }
+
+    TraceValue copyToTemp(const TraceValue &value) {
+        int temp = allocateTemp();
+        as.movapd(temp, load(value, temp));
+        return {TraceValue::Kind::TEMP, value.type, temp};
+    }
+
+    // Stack entries still standing for a variable's old value get their own
+    // copy before the variable changes.
+    void detach(int variable) {
+        for (auto &entry: stack) {
+            if (entry.kind == TraceValue::Kind::VARIABLE && entry.index == variable) entry = copyToTemp(entry);
+        }
+    }
+
+    void assign(int variable, const TraceValue &value) {
+        if (value.kind == TraceValue::Kind::VARIABLE && value.index == variable) return;
+        detach(variable);
+        as.movapd(xmm(variable), load(value, 0));
+        variables[variable].type = value.type;
+    }
+
+    // A local declared inside the loop lives on the abstract stack.
+    int bodySlot(int slot) {
+        int index = slot - depth();
+        if (index < 0 || index >= static_cast<int>(stack.size())) {
+            ok = false;
+            return 0;
+        }
+        return index;
+    }
+
+    void getLocal(int slot) {
+        if (slot < depth()) {
+            int variable = find(false, slot);
+            stack.push_back({TraceValue::Kind::VARIABLE, variables[variable].type, variable});
+            return;
+        }
+        TraceValue entry = stack[bodySlot(slot)];
+        stack.push_back(entry.kind == TraceValue::Kind::TEMP ? copyToTemp(entry) : entry);
+    }
+
+    void setLocal(int slot, bool pops) {
+        TraceValue value = pops ? pop() : stack.back();
+        if (slot < depth()) {
+            assign(find(false, slot), value);
+            if (pops) release(value);
+            return;
+        }
+        int index = bodySlot(slot);
+        if (!ok) return;
+        release(stack[index]);
+        stack[index] = !pops && value.kind == TraceValue::Kind::TEMP ? copyToTemp(value) : value;
+    }
+
+    void addToLocal(int slot, Value constant) {
+        TraceValue addend = TraceCompiler::constant(constant);
+        if (slot < depth()) {
+            int variable = find(false, slot);
+            detach(variable);
+            as.sse(0xF2, 0x58, xmm(variable), load(addend, 0));
+            return;
+        }
+        int index = bodySlot(slot);
+        if (!ok) return;
+        TraceValue &entry = stack[index];
+        if (entry.kind == TraceValue::Kind::CONSTANT) {
+            entry.bits = number_val(std::bit_cast<double>(entry.bits) + asNumber(constant)).bits;
+            return;
+        }
+        if (entry.kind != TraceValue::Kind::TEMP) entry = copyToTemp(entry);
+        as.sse(0xF2, 0x58, entry.index, load(addend, 0));
+    }
+
+//  Operators
+
+    bool numbers(const TraceValue &a, const TraceValue &b) {
+        if (a.type != TraceType::NUMBER || b.type != TraceType::NUMBER) ok = false;
+        return a.kind == TraceValue::Kind::CONSTANT && b.kind == TraceValue::Kind::CONSTANT;
+    }
+
+    template<typename BINARY>
+    void arithmetic(uint8_t opcode, BINARY fct) {
+        TraceValue b = pop();
+        TraceValue a = pop();
+        if (numbers(a, b)) {
+            stack.push_back(constant(number_val(fct(std::bit_cast<double>(a.bits), std::bit_cast<double>(b.bits)))));
+            return;
+        }
+        TraceValue result = a.kind == TraceValue::Kind::TEMP ? a : copyToTemp(a);
+        as.sse(0xF2, opcode, result.index, load(b, 1));
+        release(b);
+        stack.push_back(result);
+    }
+
+    // ucomisd sets the flags like an unsigned compare, with unordered (NaN)
+    // operands failing both A and AE, so each ordered comparison is one of
+    // those after putting the operands in the right order.
+    static std::pair<bool, Cond> ordered(OP op) {
+        switch (op) {
+            case OP::LESS:
+            case OP::JUMP_IF_NOT_LESS:
+                return {true, Cond::A};
+            case OP::LESS_EQUAL:
+            case OP::JUMP_IF_NOT_LESS_EQUAL:
+                return {true, Cond::AE};
+            case OP::GREATER:
+            case OP::JUMP_IF_NOT_GREATER:
+                return {false, Cond::A};
+            case OP::GREATER_EQUAL:
+            case OP::JUMP_IF_NOT_GREATER_EQUAL:
+            default:
+                return {false, Cond::AE};
+        }
+    }
+
+    void compareFlags(const TraceValue &a, const TraceValue &b, bool swap) {
+        int first = load(a, 0);
+        int second = load(b, 1);
+        if (swap) {
+            as.sse(0x66, 0x2E, second, first);
+        } else {
+            as.sse(0x66, 0x2E, first, second);
+        }
+    }
+
+    // Boxes the 0/1 in al as a Lox boolean.
+    void pushBool() {
+        as.movzxEaxAl();
+        as.mov(Reg::RCX, FALSE_BITS);
+        as.add(Reg::RAX, Reg::RCX);
+        int temp = allocateTemp();
+        as.movq(temp, Reg::RAX);
+        stack.push_back({TraceValue::Kind::TEMP, TraceType::BOOL, temp});
+    }
+
+    template<typename COMPARE>
+    void comparison(OP op, COMPARE fct) {
+        TraceValue b = pop();
+        TraceValue a = pop();
+        if (numbers(a, b)) {
+            stack.push_back(constant(bool_val(fct(std::bit_cast<double>(a.bits), std::bit_cast<double>(b.bits)))));
+            return;
+        }
+        if (op == OP::EQUAL || op == OP::NOT_EQUAL) {
+            compareFlags(a, b, false);
+            bool equal = op == OP::EQUAL;
+            as.setcc(equal ? Cond::E : Cond::NE);
+            as.setcc(equal ? Cond::NP : Cond::P, Reg::RCX);
+            if (equal) {
+                as.andAlCl();
+            } else {
+                as.orAlCl();
+            }
+        } else {
+            auto [swap, cond] = ordered(op);
+            compareFlags(a, b, swap);
+            as.setcc(cond);
+        }
+        release(a);
+        release(b);
+        pushBool();
+    }
+
+    void unary(OP op) {
+        TraceValue value = pop();
+        TraceType type = op == OP::NOT ? TraceType::BOOL : TraceType::NUMBER;
+        if (value.type != type) ok = false;
+        if (value.kind == TraceValue::Kind::CONSTANT) {
+            value.bits ^= op == OP::NOT ? (TRUE_BITS ^ FALSE_BITS) : SIGN_BIT;
+            stack.push_back(value);
+            return;
+        }
+        as.movq(Reg::RAX, load(value, 0));
+        as.mov(Reg::RCX, op == OP::NOT ? (TRUE_BITS ^ FALSE_BITS) : SIGN_BIT);
+        as.xor_(Reg::RAX, Reg::RCX);
+        release(value);
+        int temp = allocateTemp();
+        as.movq(temp, Reg::RAX);
+        stack.push_back({TraceValue::Kind::TEMP, type, temp});
+    }
+
+//  Branches
+
+    void exitIf(Cond cond, int target) {
+        exits.push_back({as.jcc(cond), target, stack});
+    }
+
+    // The recorded direction is the trace; the other one is a side exit.
+    void branch(OP op, int offset, int next) {
+        int fallthrough = offset + 3;
+        int target = fallthrough + readShort(&chunk.bytes()[offset + 1]);
+        bool taken = next != fallthrough;
+        bool pops = op == OP::POP_JUMP_IF_FALSE || op == OP::POP_JUMP_IF_TRUE;
+        TraceValue condition = pops || stack.empty() ? pop() : stack.back();
+        if (condition.type != TraceType::BOOL) ok = false;
+
+        bool onFalse = op == OP::JUMP_IF_FALSE || op == OP::POP_JUMP_IF_FALSE;
+        if (condition.kind == TraceValue::Kind::CONSTANT) {
+            if (taken != ((condition.bits == FALSE_BITS) == onFalse)) ok = false;
+            return;
+        }
+        as.movq(Reg::RAX, load(condition, 0));
+        as.mov(Reg::RCX, FALSE_BITS);
+        as.cmp(Reg::RAX, Reg::RCX);
+        if (pops) release(condition);
+        // E means the value is false.
+        if (taken) {
+            exitIf(onFalse ? Cond::NE : Cond::E, fallthrough);
+        } else {
+            exitIf(onFalse ? Cond::E : Cond::NE, target);
+        }
+    }
+
+    template<typename COMPARE>
+    void compareBranch(OP op, int offset, int next, COMPARE fct) {
+        int fallthrough = offset + 3;
+        int target = fallthrough + readShort(&chunk.bytes()[offset + 1]);
+        bool taken = next != fallthrough;
+        TraceValue b = pop();
+        TraceValue a = pop();
+        if (numbers(a, b)) {
+            if (taken == fct(std::bit_cast<double>(a.bits), std::bit_cast<double>(b.bits))) ok = false;
+            return;
+        }
+        auto [swap, holds] = ordered(op);
+        compareFlags(a, b, swap);
+        release(a);
+        release(b);
+        // The instruction jumps when the comparison fails.
+        if (taken) {
+            exitIf(holds, fallthrough);
+        } else {
+            exitIf(holds == Cond::A ? Cond::BE : Cond::B, target);
+        }
+    }
+
+//  Driver
+
+    void step(TraceStep step) {
+        auto [offset, next] = step;
+        auto op = static_cast<OP>(chunk.bytes()[offset]);
+        int operand = indexOperand(&chunk.bytes()[offset]);
+        switch (op) {
+            case OP::CONSTANT:
+            case OP::CONSTANT_LONG:
+                stack.push_back(constant(chunk.constants[operand]));
+                break;
+            case OP::TRUE:
+                stack.push_back(constant(bool_val(true)));
+                break;
+            case OP::FALSE:
+                stack.push_back(constant(bool_val(false)));
+                break;
+            case OP::POP:
+                release(pop());
+                break;
+            case OP::POPN:
+                for (int i = 0; i < operand; ++i) release(pop());
+                break;
+            case OP::GET_LOCAL:
+            case OP::GET_LOCAL_LONG:
+                getLocal(operand);
+                break;
+            case OP::SET_LOCAL:
+            case OP::SET_LOCAL_LONG:
+                setLocal(operand, false);
+                break;
+            case OP::SET_LOCAL_POP:
+                setLocal(operand, true);
+                break;
+            case OP::GET_GLOBAL_SLOT:
+            case OP::GET_GLOBAL_SLOT_LONG: {
+                int variable = find(true, operand);
+                stack.push_back({TraceValue::Kind::VARIABLE, variables[variable].type, variable});
+                break;
+            }
+            case OP::SET_GLOBAL_SLOT:
+            case OP::SET_GLOBAL_SLOT_LONG:
+                if (stack.empty()) {
+                    ok = false;
+                } else {
+                    assign(find(true, operand), stack.back());
+                }
+                break;
+            case OP::ADD_TO_LOCAL:
+                addToLocal(operand, chunk.constants[chunk.bytes()[offset + 2]]);
+                break;
+            case OP::ADD:
+                arithmetic(0x58, std::plus<double>{});
+                break;
+            case OP::SUBTRACT:
+                arithmetic(0x5C, std::minus<double>{});
+                break;
+            case OP::MULTIPLY:
+                arithmetic(0x59, std::multiplies<double>{});
+                break;
+            case OP::DIVIDE:
+                arithmetic(0x5E, std::divides<double>{});
+                break;
+            case OP::EQUAL:
+                comparison(op, std::equal_to<double>{});
+                break;
+            case OP::NOT_EQUAL:
+                comparison(op, std::not_equal_to<double>{});
+                break;
+            case OP::LESS:
+                comparison(op, std::less<double>{});
+                break;
+            case OP::LESS_EQUAL:
+                comparison(op, std::less_equal<double>{});
+                break;
+            case OP::GREATER:
+                comparison(op, std::greater<double>{});
+                break;
+            case OP::GREATER_EQUAL:
+                comparison(op, std::greater_equal<double>{});
+                break;
+            case OP::NOT:
+            case OP::NEGATE:
+                unary(op);
+                break;
+            case OP::JUMP:
+            case OP::LOOP:
+            case OP::JUMP_LONG:
+                break;
+            case OP::JUMP_IF_FALSE:
+            case OP::JUMP_IF_TRUE:
+            case OP::POP_JUMP_IF_FALSE:
+            case OP::POP_JUMP_IF_TRUE:
+                branch(op, offset, next);
+                break;
+            case OP::JUMP_IF_NOT_LESS:
+                compareBranch(op, offset, next, std::less<double>{});
+                break;
+            case OP::JUMP_IF_NOT_LESS_EQUAL:
+                compareBranch(op, offset, next, std::less_equal<double>{});
+                break;
+            case OP::JUMP_IF_NOT_GREATER:
+                compareBranch(op, offset, next, std::greater<double>{});
+                break;
+            case OP::JUMP_IF_NOT_GREATER_EQUAL:
+                compareBranch(op, offset, next, std::greater_equal<double>{});
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+
+    // Side exits write back what the interpreter will look at: every variable
+    // the loop writes, and the abstract stack above the loop's height.
+    void emitExit(const PendingExit &exit, int index) {
+        as.bind(exit.rel32);
+        for (int i = 0; i < static_cast<int>(variables.size()); ++i) {
+            if (variables[i].written) as.movsdStore(base(variables[i]), variables[i].slot * 8, xmm(i));
+        }
+        for (int i = 0; i < static_cast<int>(exit.stack.size()); ++i) {
+            auto &entry = exit.stack[i];
+            int disp = (depth() + i) * 8;
+            if (entry.kind == TraceValue::Kind::CONSTANT) {
+                as.mov(Reg::RAX, entry.bits);
+                as.store(Reg::RDI, disp, Reg::RAX);
+            } else {
+                as.movsdStore(Reg::RDI, disp, load(entry, 0));
+            }
+        }
+        as.movEax(static_cast<uint32_t>(index));
+        as.add(Reg::RAX, Reg::R8);
+        as.ret();
+    }
+
+    std::unique_ptr<Trace> compile() {
+        collectVariables();
+        if (!ok) return nullptr;
+        enter();
+        as.xor_(Reg::R8, Reg::R8);
+        as.mov(Reg::R9, ITERATION);
+        int loop = as.size();
+        for (auto recorded: recording.steps) {
+            step(recorded);
+            if (!ok) return nullptr;
+        }
+
+        // Back at the header: the next iteration must find what this one did.
+        if (!stack.empty()) return nullptr;
+        for (auto &variable: variables) {
+            if (variable.readFirst && variable.type != variable.entryType) return nullptr;
+        }
+        as.add(Reg::R8, Reg::R9);
+        as.patch(as.jmp(), loop);
+
+        for (int guard: guards) as.bind(guard);
+        as.movEax(static_cast<uint32_t>(-1));
+        as.ret();
+
+        std::vector<TraceExit> resume;
+        for (int i = 0; i < static_cast<int>(exits.size()); ++i) {
+            emitExit(exits[i], i);
+            int target = exits[i].target;
+            resume.push_back({target, depth() + static_cast<int>(exits[i].stack.size()),
+                              target < recording.start || target > recording.end});
+        }
+
+        auto memory = ExecutableMemory::map(as.bytes);
+        if (!memory) return nullptr;
+        return std::make_unique<Trace>(std::move(*memory), depth(), std::move(resume));
+    }
+};
+
+std::unique_ptr<Trace> Trace::compile(const Chunk &chunk, const TraceRecording &recording) {
+    return TraceCompiler{chunk, recording}.compile();
+}
+
+TraceOutcome Trace::run(VM &vm) const {
+    if (vm.stackTop - vm.stack.data() != depth) return TraceOutcome::GUARD_FAILED;
+    auto entry = reinterpret_cast<TraceEntry>(memory.address());
+    uint64_t result = entry(vm.stack.data(), vm.globals.data());
+    auto exit = static_cast<int32_t>(static_cast<uint32_t>(result));
+    if (exit < 0) return TraceOutcome::GUARD_FAILED;
+
+    auto [offset, exitDepth, leavesLoop] = exits[exit];
+    vm.ip = vm.code + offset;
+    vm.stackTop = vm.stack.data() + exitDepth;
+    if (leavesLoop) return TraceOutcome::LEFT_LOOP;
+    return result >= ITERATION ? TraceOutcome::LEFT_PATH_AFTER_LOOPING : TraceOutcome::LEFT_PATH;
+}
+
+#else
+
+std::unique_ptr<Trace> Trace::compile(const Chunk &, const TraceRecording &) {
+    return nullptr;
+}
+
+TraceOutcome Trace::run(VM &) const {
+    return TraceOutcome::GUARD_FAILED;
+}
+
+#endif
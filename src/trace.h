@@ -0,0 +1,88 @@
+#ifndef CPPLOX_TRACE_H
+#define CPPLOX_TRACE_H
+
+
+#include <memory>
+#include <vector>
+#include "VM.h"
+#include "native.h"
+
+// Back-edges taken before a loop is recorded, and trace entries that fail
+// or leave the recorded path within an iteration before its trace is thrown
+// away and rerecorded; after MAX_RETRACES, the loop stays interpreted.
+constexpr const uint32_t HOT_LOOP_THRESHOLD = 1000;
+constexpr const int MAX_RETRACES = 3;
+// Longer recordings (typically an outer loop running an inner one) are
+// abandoned, which keeps only the inner loop native.
+constexpr const size_t MAX_TRACE_LENGTH = 512;
+
+// One executed instruction and where execution went next; for conditional
+// branches that is the direction the trace is specialised for.
+struct TraceStep {
+    int offset;
+    int next;
+};
+
+// One iteration of a loop as the recorder saw it, from the loop header back
+// to it, plus the locals and globals when recording began, whose types the
+// trace is specialised for.
+struct TraceRecording {
+    int header;
+    int start;                  // the loop's code; exits outside it leave the loop
+    int end;
+    int depth;                  // stack height at the header
+    std::vector<TraceStep> steps;
+    std::vector<Value> locals;  // stack[0, depth) at the header
+    std::vector<Value> globals;
+};
+
+// Where a side exit resumes the interpreter.
+struct TraceExit {
+    int offset;
+    int depth;
+    bool leavesLoop;            // the loop is done, not just off the recorded path
+};
+
+enum class TraceOutcome {
+    GUARD_FAILED,               // nothing ran
+    LEFT_PATH,                  // back to the header, not one iteration done
+    LEFT_PATH_AFTER_LOOPING,
+    LEFT_LOOP
+};
+
+// Native code for one hot loop. Locals and globals the loop uses stay
+// unboxed in XMM registers across iterations, with their type guards hoisted
+// to the single entry; inside the loop every type is known statically. A
+// branch leaving the recorded path is a side exit that writes registers and
+// pending temporaries back to the VM stack and resumes the interpreter at
+// the other side of the branch.
+class Trace {
+public:
+    // Nothing when the recording uses something the compiler does not
+    // handle or is not type-stable from one iteration to the next.
+    static std::unique_ptr<Trace> compile(const Chunk &chunk, const TraceRecording &recording);
+
+    // Runs from the loop header until a side exit, leaving vm.ip and
+    // vm.stackTop where the interpreter continues.
+    TraceOutcome run(VM &vm) const;
+
+    Trace(ExecutableMemory memory, int depth, std::vector<TraceExit> exits)
+            : memory{std::move(memory)}, depth{depth}, exits{std::move(exits)} {}
+
+private:
+    ExecutableMemory memory;
+    int depth;
+    std::vector<TraceExit> exits;
+};
+
+// Tracing bookkeeping for the loop whose header is at a given offset.
+struct HotLoop {
+    uint32_t count{};
+    uint32_t misses{};
+    int retraces{};
+    bool blacklisted{};
+    std::unique_ptr<Trace> trace;
+};
+
+
+#endif //CPPLOX_TRACE_H
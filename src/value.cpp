@@ -1,74 +1,35 @@
 #include "value.h"
 #include "fmt/core.h"
 
-template<typename T>
-Value createValue(T value) {
-    return Value{value};
-}
-
-Value number_val(double val) {
-    return createValue(val);
-}
-
-Value bool_val(bool val) {
-    return createValue(val);
-}
-
-Value nil_val() {
-    return createValue(std::monostate());
-}
-
-Value obj_val(Obj* obj) {
-    return createValue(obj);
-}
-
-double asNumber(Value value) {
-    return std::get<double>(value);
-}
-
-bool asBool(Value value) {
-    return std::get<bool>(value);
-}
-
-bool isNumber(Value val) {
-    return std::holds_alternative<double>(val);
-}
+#if CPPLOX_NAN_BOXING
 
-bool isBool(Value val) {
-    return std::holds_alternative<bool>(val);
-}
-
-bool isNil(Value val) {
-    return std::holds_alternative<std::monostate>(val);
-}
-
-bool isObj(Value val) {
-    return std::holds_alternative<Obj*>(val);;
-}
-
-bool isObjType(Value value, ObjType type) {
-    return isObj(value) && asObject(value)->type == type;
+void printValue(Value value) {
+    if (isNumber(value)) {
+        fmt::print("{}", asNumber(value));
+    } else if (isBool(value)) {
+        fmt::print("{}", asBool(value));
+    } else if (isNil(value)) {
+        fmt::print("nil");
+    } else {
+        printObject(asObject(value));
+    }
 }
 
+bool valuesEqual(Value a, Value b) {
+    if (isNumber(a) && isNumber(b)) {
+        return asNumber(a) == asNumber(b);
+    }
 
-bool isString(Value value) {
-    return isObjType(value, ObjType::STRING);
-}
-
-Obj* asObject(Value value) {
-    return std::get<Obj*>(value);
+    // Strings are interned, so equal objects are the same object.
+    return a.bits == b.bits;
 }
 
-ObjString *asString(Value value) {
-    return static_cast<ObjString*>(asObject(value));
-}
+#else
 
-//const char* asCString(Value value) {
-//    return static_cast<ObjString*>(asObject(value))->str.data();
-//}
+template<class... Ts> struct overload : Ts... { using Ts::operator()...; };
+template<class... Ts> overload(Ts...) -> overload<Ts...>;
 
 bool isFalsey(Value val) {
-//    return isNil(val) || (isBool(val) && !asBool(val));
     return std::visit(overload{
         [](double)         {return false;},
         [](bool val)       {return !val;},
@@ -79,8 +40,8 @@ bool isFalsey(Value val) {
 
 void printValue(Value value) {
     std::visit(overload{
-            [](double val)     { fmt::print("{}", asNumber(val)); },
-            [](bool val)       { fmt::print("{}", asBool(val)); },
+            [](double val)     { fmt::print("{}", val); },
+            [](bool val)       { fmt::print("{}", val); },
             [](std::monostate) { fmt::print("nil"); },
             [](Obj* obj)       { printObject(obj); }
     }, value);
@@ -89,9 +50,8 @@ void printValue(Value value) {
 bool valuesEqual(Value a, Value b) {
     if (a.index() != b.index()) return false;
 
-    if (std::holds_alternative<Obj*>(a)) {
-        return asString(a)->str.data() == asString(b)->str.data();
-    }
-
+    // Strings are interned, so equal objects compare equal as pointers.
     return a == b;
 }
+
+#endif
@@ -1,35 +1,253 @@
 #ifndef CPPLOX_VALUE_H
 #define CPPLOX_VALUE_H
 
+#include <bit>
+#include <cstdint>
+#include <type_traits>
 #include <variant>
 #include "object.h"
 
+#ifndef CPPLOX_NAN_BOXING
+#define CPPLOX_NAN_BOXING 1
+#endif
+
+#if CPPLOX_NAN_BOXING
+
+// A Value is one 64-bit word. Doubles are stored as themselves; everything
+// else lives in the payload of a quiet NaN. Objects additionally set the sign
+// bit and keep their pointer in the low 48 bits.
+struct Value {
+    uint64_t bits;
+};
+
+constexpr const uint64_t SIGN_BIT{0x8000000000000000};
+constexpr const uint64_t QNAN{0x7ffc000000000000};
+
+constexpr const uint64_t TAG_NIL{1};
+constexpr const uint64_t TAG_FALSE{2};
+constexpr const uint64_t TAG_TRUE{3};
+
+constexpr const uint64_t NIL_BITS{QNAN | TAG_NIL};
+constexpr const uint64_t FALSE_BITS{QNAN | TAG_FALSE};
+constexpr const uint64_t TRUE_BITS{QNAN | TAG_TRUE};
+
+inline Value number_val(double val) {
+    return Value{std::bit_cast<uint64_t>(val)};
+}
+
+inline Value bool_val(bool val) {
+    return Value{val ? TRUE_BITS : FALSE_BITS};
+}
+
+inline Value nil_val() {
+    return Value{NIL_BITS};
+}
+
+inline Value obj_val(Obj* obj) {
+    return Value{SIGN_BIT | QNAN | reinterpret_cast<uintptr_t>(obj)};
+}
+
+template<typename T>
+Value createValue(T value) {
+    if constexpr (std::is_same_v<T, double>) {
+        return number_val(value);
+    } else if constexpr (std::is_same_v<T, bool>) {
+        return bool_val(value);
+    } else if constexpr (std::is_same_v<T, std::monostate>) {
+        return nil_val();
+    } else {
+        return obj_val(value);
+    }
+}
+
+inline bool isNumber(Value val) {
+    return (val.bits & QNAN) != QNAN;
+}
+
+inline bool isBool(Value val) {
+    return (val.bits | 1) == TRUE_BITS;
+}
+
+inline bool isNil(Value val) {
+    return val.bits == NIL_BITS;
+}
+
+inline bool isObj(Value val) {
+    return (val.bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT);
+}
+
+inline double asNumber(Value value) {
+    return std::bit_cast<double>(value.bits);
+}
+
+inline bool asBool(Value value) {
+    return value.bits == TRUE_BITS;
+}
+
+inline Obj* asObject(Value value) {
+    return reinterpret_cast<Obj*>(static_cast<uintptr_t>(value.bits & ~(SIGN_BIT | QNAN)));
+}
+
+inline bool isFalsey(Value val) {
+    return val.bits == NIL_BITS || val.bits == FALSE_BITS;
+}
+
+// Marks a global slot that has been resolved by the compiler but not yet
+// defined at runtime. No Lox value is ever a null object.
+inline Value undefined_val() {
+    return Value{SIGN_BIT | QNAN};
+}
+
+inline bool isUndefined(Value val) {
+    return val.bits == (SIGN_BIT | QNAN);
+}
+
+#else
+
 using Value = std::variant<double, bool, std::monostate, Obj*>;
-template<class... Ts> struct overload : Ts... { using Ts::operator()...; };
-template<class... Ts> overload(Ts...) -> overload<Ts...>;
 
 template<typename T>
-Value createValue(T value);
-Value number_val(double val);
-Value bool_val(bool val);
-Value nil_val();
-Value obj_val(Obj* obj);
-
-double asNumber(Value value);
-bool asBool(Value value);
-Obj* asObject(Value value);
-ObjString* asString(Value value);
-//const char* asCString(Value value);
-bool isNumber(Value val);
-bool isBool(Value val);
-bool isNil(Value val);
-bool isObj(Value val);
-bool isObjType(Value value, ObjType type);
-bool isString(Value value);
+Value createValue(T value) {
+    return Value{value};
+}
+
+inline Value number_val(double val) {
+    return createValue(val);
+}
+
+inline Value bool_val(bool val) {
+    return createValue(val);
+}
+
+inline Value nil_val() {
+    return createValue(std::monostate());
+}
+
+inline Value obj_val(Obj* obj) {
+    return createValue(obj);
+}
+
+inline bool isNumber(Value val) {
+    return std::holds_alternative<double>(val);
+}
 
+inline bool isBool(Value val) {
+    return std::holds_alternative<bool>(val);
+}
+
+inline bool isNil(Value val) {
+    return std::holds_alternative<std::monostate>(val);
+}
+
+inline bool isObj(Value val) {
+    return std::holds_alternative<Obj*>(val);
+}
+
+inline double asNumber(Value value) {
+    return std::get<double>(value);
+}
+
+inline bool asBool(Value value) {
+    return std::get<bool>(value);
+}
+
+inline Obj* asObject(Value value) {
+    return std::get<Obj*>(value);
+}
 
 bool isFalsey(Value val);
 
+inline Value undefined_val() {
+    return createValue(static_cast<Obj*>(nullptr));
+}
+
+inline bool isUndefined(Value val) {
+    return isObj(val) && asObject(val) == nullptr;
+}
+
+#endif
+
+inline bool isObjType(Value value, ObjType type) {
+    return isObj(value) && asObject(value)->type == type;
+}
+
+inline bool isString(Value value) {
+    return isObjType(value, ObjType::STRING);
+}
+
+inline ObjString* asString(Value value) {
+    return static_cast<ObjString*>(asObject(value));
+}
+
+inline bool isRope(Value value) {
+    return isObjType(value, ObjType::ROPE);
+}
+
+inline ObjRope* asRope(Value value) {
+    return static_cast<ObjRope*>(asObject(value));
+}
+
+inline bool isFunction(Value value) {
+    return isObjType(value, ObjType::FUNCTION);
+}
+
+inline ObjFunction* asFunction(Value value) {
+    return static_cast<ObjFunction*>(asObject(value));
+}
+
+inline bool isClass(Value value) {
+    return isObjType(value, ObjType::CLASS);
+}
+
+inline ObjClass* asClass(Value value) {
+    return static_cast<ObjClass*>(asObject(value));
+}
+
+inline bool isInstance(Value value) {
+    return isObjType(value, ObjType::INSTANCE);
+}
+
+inline ObjInstance* asInstance(Value value) {
+    return static_cast<ObjInstance*>(asObject(value));
+}
+
+inline bool isMap(Value value) {
+    return isObjType(value, ObjType::MAP);
+}
+
+inline ObjMap* asMap(Value value) {
+    return static_cast<ObjMap*>(asObject(value));
+}
+
+inline bool isNative(Value value) {
+    return isObjType(value, ObjType::NATIVE);
+}
+
+inline ObjNative* asNative(Value value) {
+    return static_cast<ObjNative*>(asObject(value));
+}
+
+static_assert(sizeof(ObjInstance) % alignof(Value) == 0 && sizeof(ObjFields) % alignof(Value) == 0);
+
+inline Value* inlineFields(ObjInstance* instance) {
+    return reinterpret_cast<Value*>(instance + 1);
+}
+
+inline Value* overflowFields(ObjFields* fields) {
+    return reinterpret_cast<Value*>(fields + 1);
+}
+
+// Where field `index` of an instance is stored.
+inline Value& fieldAt(ObjInstance* instance, uint32_t index) {
+    return index < instance->capacity ? inlineFields(instance)[index]
+                                      : overflowFields(instance->overflow)[index - instance->capacity];
+}
+
+// A string in either representation: interned ObjString or lazy ObjRope.
+inline bool isText(Value value) {
+    return isObj(value) && isText(asObject(value));
+}
+
 bool valuesEqual(Value a, Value b);
 
 void printValue(Value value);
@@ -0,0 +1,110 @@
+#include "valuestack.h"
+#include <algorithm>
+#include <new>
+
+#if CPPLOX_HAS_GUARDED_STACK
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Mapped when the stack is made; enough for most scripts never to fault.
+constexpr const size_t INITIAL_COMMIT = 64 * 1024;
+
+thread_local ValueStack *ValueStack::active = nullptr;
+
+static struct sigaction previousSegv;
+static struct sigaction previousBus;
+
+static size_t pageSize() {
+    static const auto size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+static size_t roundToPage(size_t bytes) {
+    return (bytes + pageSize() - 1) / pageSize() * pageSize();
+}
+
+ValueStack::ValueStack(size_t maxSlots)
+        : base{nullptr}, reserved{roundToPage(maxSlots * sizeof(Value)) + pageSize()}, committed{0} {
+    void *memory = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw std::bad_alloc{};
+    base = static_cast<Value *>(memory);
+    installHandler();
+    commit(INITIAL_COMMIT / sizeof(Value));
+}
+
+ValueStack::~ValueStack() {
+    munmap(base, reserved);
+}
+
+void ValueStack::commit(size_t slots) {
+    if (slots * sizeof(Value) > committed && !commitAddress(reinterpret_cast<uintptr_t>(base + slots) - 1)) {
+        throw std::bad_alloc{};
+    }
+}
+
+// Maps everything up to and including `address`, and at least doubles what
+// is mapped, so a stack that keeps growing faults only a logarithmic number
+// of times. Called from the fault handler, so it only makes system calls.
+bool ValueStack::commitAddress(uintptr_t address) {
+    auto start = reinterpret_cast<uintptr_t>(base);
+    auto limit = reserved - pageSize();
+    if (address < start || address - start >= limit) return false;
+    auto wanted = std::min(std::max(committed * 2, roundToPage(address - start + 1)), limit);
+    if (mprotect(reinterpret_cast<char *>(base) + committed, wanted - committed, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    committed = wanted;
+    return true;
+}
+
+void ValueStack::installHandler() {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        pageSize();
+        struct sigaction action{};
+        action.sa_sigaction = handleFault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previousSegv);
+        sigaction(SIGBUS, &action, &previousBus);
+    });
+}
+
+// A fault in the active stack's reservation either grows the stack, after
+// which the faulting access is retried, or is an overflow and abandons the
+// guarded code. Any other fault goes to whichever handler was there before.
+void ValueStack::handleFault(int number, siginfo_t *info, void *context) {
+    auto stack = active;
+    auto address = reinterpret_cast<uintptr_t>(info->si_addr);
+    if (stack != nullptr) {
+        auto start = reinterpret_cast<uintptr_t>(stack->base);
+        if (address >= start && address - start < stack->reserved) {
+            if (stack->commitAddress(address)) return;
+            siglongjmp(stack->overflow, 1);
+        }
+    }
+
+    auto &previous = number == SIGBUS ? previousBus : previousSegv;
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(number, info, context);
+    } else if (previous.sa_handler == SIG_DFL || previous.sa_handler == SIG_IGN) {
+        // The faulting access runs again and gets the default action.
+        signal(number, SIG_DFL);
+    } else {
+        previous.sa_handler(number);
+    }
+}
+
+#else
+
+ValueStack::ValueStack(size_t maxSlots)
+        : base{new Value[maxSlots]}, reserved{maxSlots * sizeof(Value)}, committed{reserved} {}
+
+ValueStack::~ValueStack() {
+    delete[] base;
+}
+
+void ValueStack::commit(size_t) {}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef CPPLOX_VALUESTACK_H
+#define CPPLOX_VALUESTACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include "value.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CPPLOX_HAS_GUARDED_STACK 1
+#include <csetjmp>
+#include <csignal>
+#else
+#define CPPLOX_HAS_GUARDED_STACK 0
+#endif
+
+// The VM's value stack: one large reservation of address space of which only
+// a prefix is mapped read+write. Push and pop never check anything. The first
+// access past the mapped prefix faults, the fault handler maps more, and the
+// access is retried, so the stack grows on demand. The last page of the
+// reservation is never mapped: a fault there is an overflow, which guard()
+// turns into a return value.
+//
+// Without mmap and signals the whole stack is allocated up front and
+// overflow goes undetected.
+class ValueStack {
+public:
+    explicit ValueStack(size_t maxSlots);
+    ValueStack(const ValueStack &) = delete;
+    ValueStack &operator=(const ValueStack &) = delete;
+    ~ValueStack();
+
+    [[nodiscard]] Value *data() const { return base; }
+
+    Value &operator[](size_t slot) const { return base[slot]; }
+
+    // Maps enough for `slots` slots now, so using them costs no faults.
+    void commit(size_t slots);
+
+    // Runs `body`. False if it overflowed the stack, in which case it was
+    // abandoned where it stood: nothing on the way out of it was unwound.
+    template<typename BODY>
+    bool guard(BODY &&body);
+
+private:
+#if CPPLOX_HAS_GUARDED_STACK
+    static void installHandler();
+    static void handleFault(int signal, siginfo_t *info, void *context);
+    bool commitAddress(uintptr_t address);
+
+    // The stack guarding the code running on this thread, if any.
+    static thread_local ValueStack *active;
+
+    sigjmp_buf overflow{};
+#endif
+
+    Value *base;
+    size_t reserved;    // bytes
+    size_t committed;   // bytes, from base
+};
+
+template<typename BODY>
+bool ValueStack::guard(BODY &&body) {
+#if CPPLOX_HAS_GUARDED_STACK
+    auto previous = active;
+    active = this;
+    if (sigsetjmp(overflow, 1) != 0) {
+        active = previous;
+        return false;
+    }
+    body();
+    active = previous;
+#else
+    body();
+#endif
+    return true;
+}
+
+#endif //CPPLOX_VALUESTACK_H
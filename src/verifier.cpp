@@ -0,0 +1,348 @@
+#include "verifier.h"
+#include <algorithm>
+#include <vector>
+
+// How a stack instruction uses the stack: how many values it needs and how
+// many it leaves in their place.
+struct StackEffect {
+    int pops;
+    int pushes;
+};
+
+static StackEffect stackEffect(OP op, const uint8_t *operands) {
+    switch (op) {
+        case OP::CONSTANT:
+        case OP::CONSTANT_LONG:
+        case OP::NIL:
+        case OP::TRUE:
+        case OP::FALSE:
+        case OP::GET_LOCAL:
+        case OP::GET_LOCAL_LONG:
+        case OP::GET_GLOBAL_SLOT:
+        case OP::GET_GLOBAL_SLOT_LONG:
+        case OP::CLASS:
+        case OP::FOR_IN:
+            return {0, 1};
+        case OP::NOT:
+        case OP::NEGATE:
+        case OP::SET_LOCAL:
+        case OP::SET_LOCAL_LONG:
+        case OP::SET_GLOBAL_SLOT:
+        case OP::SET_GLOBAL_SLOT_LONG:
+        case OP::JUMP_IF_TRUE:
+        case OP::JUMP_IF_FALSE:
+        case OP::GET_FIELD:
+        case OP::GET_FIELD_MONO:
+            return {1, 1};
+        case OP::EQUAL:
+        case OP::NOT_EQUAL:
+        case OP::GREATER:
+        case OP::GREATER_EQUAL:
+        case OP::LESS:
+        case OP::LESS_EQUAL:
+        case OP::ADD:
+        case OP::SUBTRACT:
+        case OP::MULTIPLY:
+        case OP::DIVIDE:
+        case OP::ADD_NUMBERS:
+        case OP::ADD_TEXT:
+        case OP::EQUAL_NUMBERS:
+        case OP::NOT_EQUAL_NUMBERS:
+        case OP::SET_FIELD:
+        case OP::SET_FIELD_MONO:
+        case OP::GET_INDEX:
+            return {2, 1};
+        case OP::SET_INDEX:
+            return {3, 1};
+        case OP::PRINT:
+        case OP::POP:
+        case OP::DEFINE_GLOBAL_SLOT:
+        case OP::DEFINE_GLOBAL_SLOT_LONG:
+        case OP::POP_JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_TRUE:
+        case OP::SET_LOCAL_POP:
+            return {1, 0};
+        case OP::JUMP_IF_NOT_LESS:
+        case OP::JUMP_IF_NOT_LESS_EQUAL:
+        case OP::JUMP_IF_NOT_GREATER:
+        case OP::JUMP_IF_NOT_GREATER_EQUAL:
+            return {2, 0};
+        case OP::POPN:
+            return {operands[0], 0};
+        case OP::BUILD_MAP:
+            return {2 * readShort(operands), 1};
+        case OP::CALL:
+            return {operands[0] + 1, 1};
+        case OP::TAIL_CALL:
+            return {operands[0] + 1, 0};
+        default:
+            return {0, 0};
+    }
+}
+
+// Where control can go after the instruction at `offset`: on to the next
+// instruction unless it always jumps or returns, and to its jump target if
+// it has one.
+struct Successors {
+    bool fallsThrough{};
+    bool jumps{};
+    int64_t target{};
+};
+
+static Successors successors(OP op, int offset, const uint8_t *operands) {
+    int64_t next = offset + instructionLength(op);
+    switch (op) {
+        case OP::JUMP:
+            return {false, true, next + readShort(operands)};
+        case OP::JUMP_LONG:
+            return {false, true, next + readInt(operands)};
+        case OP::LOOP:
+            return {false, true, next - readShort(operands)};
+        case OP::JUMP_IF_TRUE:
+        case OP::JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_FALSE:
+        case OP::POP_JUMP_IF_TRUE:
+        case OP::JUMP_IF_NOT_LESS:
+        case OP::JUMP_IF_NOT_LESS_EQUAL:
+        case OP::JUMP_IF_NOT_GREATER:
+        case OP::JUMP_IF_NOT_GREATER_EQUAL:
+            return {true, true, next + readShort(operands)};
+        case OP::RETURN:
+        case OP::TAIL_CALL:
+            return {};
+        default:
+            return {true, false};
+    }
+}
+
+// The local slot an instruction reads or writes, or -1.
+static int localSlot(OP op, const uint8_t *operands) {
+    switch (op) {
+        case OP::GET_LOCAL:
+        case OP::SET_LOCAL:
+        case OP::SET_LOCAL_POP:
+        case OP::ADD_TO_LOCAL:
+        case OP::ADD_TO_LOCAL_NUMBER:
+            return operands[0];
+        case OP::GET_LOCAL_LONG:
+        case OP::SET_LOCAL_LONG:
+            return readShort(operands);
+        // The map, then the cursor and the loop variable it writes.
+        case OP::FOR_IN:
+            return readShort(operands) + 2;
+        default:
+            return -1;
+    }
+}
+
+// The constant pool index an instruction reads, or -1.
+static int64_t constantIndex(OP op, const uint8_t *operands) {
+    switch (op) {
+        case OP::CONSTANT:
+            return operands[0];
+        case OP::CONSTANT_LONG:
+        case OP::CLASS:
+        case OP::GET_FIELD:
+        case OP::GET_FIELD_MONO:
+        case OP::SET_FIELD:
+        case OP::SET_FIELD_MONO:
+            return readTriple(operands);
+        case OP::ADD_TO_LOCAL:
+        case OP::ADD_TO_LOCAL_NUMBER:
+            return operands[1];
+        default:
+            return -1;
+    }
+}
+
+// Whether the constant an instruction reads is a name, which must be a string.
+static bool readsName(OP op) {
+    switch (op) {
+        case OP::CLASS:
+        case OP::GET_FIELD:
+        case OP::GET_FIELD_MONO:
+        case OP::SET_FIELD:
+        case OP::SET_FIELD_MONO:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The global slot an instruction reads or writes, or -1.
+static int globalSlot(OP op, const uint8_t *operands) {
+    switch (op) {
+        case OP::DEFINE_GLOBAL_SLOT:
+        case OP::GET_GLOBAL_SLOT:
+        case OP::SET_GLOBAL_SLOT:
+            return operands[0];
+        case OP::DEFINE_GLOBAL_SLOT_LONG:
+        case OP::GET_GLOBAL_SLOT_LONG:
+        case OP::SET_GLOBAL_SLOT_LONG:
+            return readShort(operands);
+        default:
+            return -1;
+    }
+}
+
+static Verification reject(int offset, std::string error) {
+    return {0, offset, std::move(error)};
+}
+
+// Two passes. The first decodes the code front to back, which finds the
+// instruction boundaries and checks everything that does not depend on the
+// path taken. The second follows every path from the entry, carrying the
+// stack height, which checks jumps, heights and local slots. `function` is
+// null for the script; a function's frame starts with its callee and
+// arguments, and its RETURN pops the result.
+static Verification verifyStack(const Chunk &chunk, size_t globalCount, const ObjFunction *function) {
+    auto code = chunk.bytes();
+    auto size = static_cast<int>(code.size());
+    std::vector<bool> boundary(size);
+
+    for (int offset = 0; offset < size;) {
+        if (code[offset] >= OP_COUNT) return reject(offset, "unknown opcode");
+        auto op = static_cast<OP>(code[offset]);
+        if (instructionLength(op) > size - offset) return reject(offset, "truncated instruction");
+        auto operands = &code[offset + 1];
+        auto constant = constantIndex(op, operands);
+        if (constant >= static_cast<int64_t>(chunk.constants.size())) return reject(offset, "constant out of range");
+        // The quickened form adds without checking the constant's type.
+        if (op == OP::ADD_TO_LOCAL_NUMBER && !isNumber(chunk.constants[constant])) {
+            return reject(offset, "constant is not a number");
+        }
+        if (readsName(op) && !isString(chunk.constants[constant])) return reject(offset, "name is not a string");
+        // Shape ids are only meaningful in the process that made them, so a
+        // chunk must arrive with its inline caches empty.
+        if (op != OP::CLASS && readsName(op)
+            && std::any_of(operands + 3, &code[offset] + instructionLength(op), [](uint8_t byte) { return byte != 0; })) {
+            return reject(offset, "inline cache not empty");
+        }
+        if (globalSlot(op, operands) >= static_cast<int64_t>(globalCount)) return reject(offset, "global out of range");
+        // The script's frame is the bottom one; it has nothing to reuse.
+        if (op == OP::TAIL_CALL && function == nullptr) return reject(offset, "tail call outside a function");
+        boundary[offset] = true;
+        offset += instructionLength(op);
+    }
+    if (size == 0) return reject(0, "no code");
+
+    std::vector<int> heights(size, -1);
+    std::vector<int> worklist{0};
+    heights[0] = function == nullptr ? 0 : function->arity + 1;
+    int maxStack = heights[0];
+    while (!worklist.empty()) {
+        int offset = worklist.back();
+        worklist.pop_back();
+        auto op = static_cast<OP>(code[offset]);
+        auto operands = &code[offset + 1];
+        int height = heights[offset];
+
+        auto [pops, pushes] = stackEffect(op, operands);
+        if (op == OP::RETURN && function != nullptr) pops = 1;
+        if (height < pops) return reject(offset, "stack underflow");
+        // Locals are the bottom slots; SET_LOCAL_POP stores below what remains.
+        int slot = localSlot(op, operands);
+        if (slot >= (op == OP::SET_LOCAL_POP ? height - 1 : height)) return reject(offset, "local out of range");
+        height += pushes - pops;
+        maxStack = std::max(maxStack, height);
+
+        // Every path into an instruction must agree on the height there.
+        auto enter = [&](int64_t next, const char *outside) -> const char * {
+            if (next < 0 || next >= size || !boundary[next]) return outside;
+            if (heights[next] == -1) {
+                heights[next] = height;
+                worklist.push_back(static_cast<int>(next));
+            }
+            return heights[next] == height ? nullptr : "inconsistent stack height";
+        };
+        auto [fallsThrough, jumps, target] = successors(op, offset, operands);
+        const char *error = nullptr;
+        if (fallsThrough) error = enter(offset + instructionLength(op), "runs off the end");
+        if (error == nullptr && jumps) error = enter(target, "jump target is not an instruction");
+        if (error != nullptr) return reject(offset, error);
+    }
+
+    // Functions are verified with the chunk that creates them.
+    for (Value constant: chunk.constants) {
+        if (!isFunction(constant)) continue;
+        auto nested = asFunction(constant);
+        auto verified = verifyStack(*nested->chunk, globalCount, nested);
+        if (!verified) {
+            verified.error = fmt::format("{} in {}()", verified.error, nested->name->str());
+            return verified;
+        }
+    }
+    return {maxStack};
+}
+
+static bool readsB(ROP op) {
+    switch (op) {
+        case ROP::MOVE:
+        case ROP::NOT:
+        case ROP::NEGATE:
+            return true;
+        default:
+            return op >= ROP::EQUAL && op <= ROP::DIVIDEK;
+    }
+}
+
+static bool isConstantForm(ROP op) {
+    switch (op) {
+        case ROP::EQUALK:
+        case ROP::NOT_EQUALK:
+        case ROP::GREATERK:
+        case ROP::GREATER_EQUALK:
+        case ROP::LESSK:
+        case ROP::LESS_EQUALK:
+        case ROP::ADDK:
+        case ROP::SUBTRACTK:
+        case ROP::MULTIPLYK:
+        case ROP::DIVIDEK:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Register instructions are all the same size, so the boundaries are known
+// up front and one pass suffices.
+static Verification verifyRegisters(const Chunk &chunk, size_t globalCount) {
+    auto code = chunk.bytes();
+    auto size = static_cast<int>(code.size());
+    auto registers = chunk.registerCount;
+    auto constants = static_cast<int>(chunk.constants.size());
+    if (size == 0 || size % REGISTER_INSTRUCTION_SIZE != 0) return reject(0, "truncated instruction");
+    if (registers < 0) return reject(0, "negative register count");
+
+    for (int offset = 0; offset < size; offset += REGISTER_INSTRUCTION_SIZE) {
+        if (code[offset] > to_integral(ROP::RETURN)) return reject(offset, "unknown opcode");
+        auto op = static_cast<ROP>(code[offset]);
+        int a = code[offset + 1];
+        int b = code[offset + 2];
+        int c = code[offset + 3];
+        int bx = readShort(&code[offset + 2]);
+        int next = offset + REGISTER_INSTRUCTION_SIZE;
+
+        bool writesOrReadsA = op != ROP::JUMP && op != ROP::RETURN;
+        if (writesOrReadsA && a >= registers) return reject(offset, "register out of range");
+        if (readsB(op) && b >= registers) return reject(offset, "register out of range");
+        if (op >= ROP::EQUAL && op <= ROP::DIVIDEK && (isConstantForm(op) ? c >= constants : c >= registers)) {
+            return reject(offset, isConstantForm(op) ? "constant out of range" : "register out of range");
+        }
+        if (op == ROP::LOADK && bx >= constants) return reject(offset, "constant out of range");
+        if ((op == ROP::DEFINE_GLOBAL || op == ROP::GET_GLOBAL || op == ROP::SET_GLOBAL) &&
+            bx >= static_cast<int64_t>(globalCount)) {
+            return reject(offset, "global out of range");
+        }
+        if (op == ROP::JUMP || op == ROP::JUMP_IF_TRUE || op == ROP::JUMP_IF_FALSE) {
+            int target = next + static_cast<int16_t>(bx) * REGISTER_INSTRUCTION_SIZE;
+            if (target < 0 || target >= size) return reject(offset, "jump out of range");
+        }
+        if (next == size && op != ROP::JUMP && op != ROP::RETURN) return reject(offset, "runs off the end");
+    }
+    return {registers};
+}
+
+Verification verify(const Chunk &chunk, Backend backend, size_t globalCount) {
+    return backend == Backend::REGISTER ? verifyRegisters(chunk, globalCount) : verifyStack(chunk, globalCount, nullptr);
+}
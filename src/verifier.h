@@ -0,0 +1,36 @@
+#ifndef CPPLOX_VERIFIER_H
+#define CPPLOX_VERIFIER_H
+
+#include <string>
+#include "chunk.h"
+#include "common.h"
+
+// The interpreter loops read operands and move stackTop without checking
+// anything. verify() is what makes that safe: it runs over a finished chunk
+// once, before the chunk runs, and rejects code that could step outside it.
+// For stack code that means:
+//  - every opcode is known and its operands fit in the code;
+//  - every jump lands on the start of an instruction, and no path runs off
+//    the end;
+//  - constant indices are in the pool, global slots are resolved, and local
+//    slots are below the stack height where they are used;
+//  - the stack height is the same on every path into an instruction and
+//    never goes below zero.
+// The chunks of functions in the constant pool are checked along with it.
+// Register code is checked the same way for its own operands: registers
+// below registerCount, constants, globals, and jump targets.
+struct Verification {
+    // On success, the most stack slots the code occupies at once (for
+    // register code, its registers). Calls are not counted: each frame's
+    // slots are mapped when the call reaches them.
+    int maxStack{};
+    // On failure, where and why.
+    int offset{};
+    std::string error{};
+
+    explicit operator bool() const { return error.empty(); }
+};
+
+Verification verify(const Chunk &chunk, Backend backend, size_t globalCount);
+
+#endif //CPPLOX_VERIFIER_H